@@ -0,0 +1,1074 @@
+/* Goxel 3D voxels editor
+ *
+ * copyright (c) 2018 Guillaume Chereau <guillaume@noctua-software.com>
+ *
+ * Goxel is free software: you can redistribute it and/or modify it under the
+ * terms of the GNU General Public License as published by the Free Software
+ * Foundation, either version 3 of the License, or (at your option) any later
+ * version.
+
+ * Goxel is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details.
+
+ * You should have received a copy of the GNU General Public License along with
+ * goxel.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Some micro benchmarks of the mesh functions.
+ *
+ * Run them with `goxel --bench`, or `goxel --bench=NAME` to only run the
+ * benchmarks whose name contains NAME.
+ */
+
+#include "goxel.h"
+
+#define N BLOCK_SIZE
+
+static uint32_t g_seed = 1;
+
+static uint32_t rand_next(void)
+{
+    g_seed = g_seed * 1664525u + 1013904223u;
+    return g_seed >> 8;
+}
+
+static void bench_log(const char *name, double time, int nb, const char *unit)
+{
+    LOG_I("%-40s %10.2f ns/%s", name, time * 1e9 / nb, unit);
+}
+
+// Create a mesh with a cube of w * h * d blocks, all sharing the same data.
+static mesh_t *create_blocks_mesh(int w, int h, int d)
+{
+    mesh_t *mesh = mesh_new();
+    int x, y, z;
+    mesh_set_at(mesh, NULL, (int[]){0, 0, 0}, (uint8_t[]){255, 0, 0, 255});
+    for (z = 0; z < d; z++)
+    for (y = 0; y < h; y++)
+    for (x = 0; x < w; x++) {
+        if (!x && !y && !z) continue;
+        mesh_copy_block(mesh, (int[]){0, 0, 0},
+                        mesh, (int[]){x * N, y * N, z * N});
+    }
+    return mesh;
+}
+
+/*
+ * Compare the mesh blocks table with the uthash table we used to have
+ * before (one hash handle per block, keyed by the block position).
+ */
+typedef struct {
+    UT_hash_handle  hh;
+    void            *data;
+    int             pos[3];
+    uint64_t        id;
+} uthash_block_t;
+
+static void bench_blocks_table(void)
+{
+    const int w = 64, h = 64, d = 48, nb_lookups = 1 << 21, nb_copies = 256;
+    mesh_t *mesh, *copy;
+    mesh_iterator_t iter;
+    uthash_block_t *blocks = NULL, *block, *tmp;
+    int i, (*pos)[3], bpos[3], sum = 0, nb_blocks = 0;
+    uint8_t v[4];
+    double t;
+
+    mesh = create_blocks_mesh(w, h, d);
+    iter = mesh_get_iterator(mesh, MESH_ITER_BLOCKS);
+    while (mesh_iter(&iter, bpos)) {
+        block = calloc(1, sizeof(*block));
+        memcpy(block->pos, bpos, sizeof(bpos));
+        block->data = mesh_get_block_data(mesh, &iter, bpos, &block->id);
+        HASH_ADD(hh, blocks, pos, sizeof(block->pos), block);
+        nb_blocks++;
+    }
+
+    pos = calloc(nb_lookups, sizeof(*pos));
+    for (i = 0; i < nb_lookups; i++) {
+        pos[i][0] = rand_next() % (w * N);
+        pos[i][1] = rand_next() % (h * N);
+        pos[i][2] = rand_next() % (d * N);
+    }
+
+    t = sys_get_time();
+    for (i = 0; i < nb_lookups; i++) {
+        mesh_get_at(mesh, NULL, pos[i], v);
+        sum += v[3];
+    }
+    bench_log("blocks_table: lookup", sys_get_time() - t, nb_lookups,
+              "lookup");
+
+    t = sys_get_time();
+    for (i = 0; i < nb_lookups; i++) {
+        bpos[0] = pos[i][0] & ~(N - 1);
+        bpos[1] = pos[i][1] & ~(N - 1);
+        bpos[2] = pos[i][2] & ~(N - 1);
+        HASH_FIND(hh, blocks, bpos, sizeof(bpos), block);
+        sum += ((uint8_t*)block->data)[3];
+    }
+    bench_log("blocks_table: lookup (uthash)", sys_get_time() - t,
+              nb_lookups, "lookup");
+
+    t = sys_get_time();
+    iter = mesh_get_iterator(mesh, MESH_ITER_BLOCKS);
+    while (mesh_iter(&iter, bpos)) {
+        sum += ((uint8_t*)mesh_get_block_data(mesh, &iter, bpos, NULL))[3];
+    }
+    bench_log("blocks_table: iter", sys_get_time() - t, nb_blocks, "block");
+
+    t = sys_get_time();
+    HASH_ITER(hh, blocks, block, tmp) {
+        sum += ((uint8_t*)block->data)[3];
+    }
+    bench_log("blocks_table: iter (uthash)", sys_get_time() - t,
+              nb_blocks, "block");
+
+    // Copy the mesh and modify one voxel, like we do for each undo step.
+    t = sys_get_time();
+    for (i = 0; i < nb_copies; i++) {
+        copy = mesh_copy(mesh);
+        mesh_set_at(mesh, NULL, pos[i], (uint8_t[]){255, 0, 0, 255});
+        mesh_delete(copy);
+    }
+    bench_log("blocks_table: copy and write", sys_get_time() - t,
+              nb_copies, "copy");
+
+    LOG_D("%d", sum); // Make sure the loops are not optimized out.
+    HASH_ITER(hh, blocks, block, tmp) {
+        HASH_DEL(blocks, block);
+        free(block);
+    }
+    free(pos);
+    mesh_delete(mesh);
+}
+
+/*
+ * Simulate some brush strokes with an undo history, so that most of the
+ * modified blocks need to be copied, and check that the memory goes back
+ * down once we release the history.
+ */
+static void bench_blocks_alloc(void)
+{
+    const int nb_strokes = 2000, nb_history = 32, stroke_size = 256;
+    mesh_t *mesh, *history[32] = {};
+    mesh_iterator_t iter;
+    mesh_stats_t stats;
+    int i, j, pos[3];
+    uint8_t v[4] = {0, 0, 0, 255};
+    double t;
+
+    mesh = create_blocks_mesh(16, 16, 16);
+    iter = mesh_get_accessor(mesh);
+    t = sys_get_time();
+    for (i = 0; i < nb_strokes; i++) {
+        mesh_delete(history[i % nb_history]);
+        history[i % nb_history] = mesh_copy(mesh);
+        pos[0] = rand_next() % (16 * N);
+        pos[1] = rand_next() % (16 * N);
+        pos[2] = rand_next() % (16 * N);
+        v[0] = rand_next() % 256;
+        for (j = 0; j < stroke_size; j++) {
+            pos[rand_next() % 3] += 1;
+            mesh_set_at(mesh, &iter, pos, v);
+        }
+        mesh_remove_empty_blocks(mesh, false);
+    }
+    bench_log("blocks_alloc: stroke", sys_get_time() - t, nb_strokes,
+              "stroke");
+
+    mesh_get_stats(NULL, &stats);
+    LOG_I("blocks_alloc: %d datas, used %zu KiB, allocated %zu KiB, "
+          "peak %zu KiB", stats.nb_datas, stats.mem_used / 1024,
+          stats.mem_allocated / 1024, stats.mem_peak / 1024);
+    for (i = 0; i < nb_history; i++) mesh_delete(history[i]);
+    mesh_delete(mesh);
+    mesh_get_stats(NULL, &stats);
+    LOG_I("blocks_alloc: after delete: %d datas, allocated %zu KiB",
+          stats.nb_datas, stats.mem_allocated / 1024);
+}
+
+/*
+ * Import the same volume into several layers, as if the user loaded the
+ * same model several times, then deduplicate their blocks.  The volume is
+ * made of a few different blocks repeated.
+ */
+static void bench_dedup(void)
+{
+    const int s = 128, nb_layers = 4;
+    mesh_t *layers[4];
+    mesh_stats_t stats;
+    uint8_t *data;
+    int i, x, y, z, nb_blocks = 0, nb_datas;
+    double t;
+
+    data = calloc(s * s * s, 4);
+    for (z = 0; z < s; z++)
+    for (y = 0; y < s; y++)
+    for (x = 0; x < s; x++) {
+        if ((x % N + y % N + z % N) % 5 == 0) continue;
+        data[((z * s + y) * s + x) * 4 + 0] = (x / N) % 3 * 100;
+        data[((z * s + y) * s + x) * 4 + 3] = 255;
+    }
+    for (i = 0; i < nb_layers; i++) {
+        layers[i] = mesh_new();
+        mesh_write(layers[i], (int[]){0, 0, 0}, (int[]){s, s, s}, data);
+        mesh_get_stats(layers[i], &stats);
+        nb_blocks += stats.nb_blocks;
+    }
+    free(data);
+
+    mesh_get_stats(NULL, &stats);
+    nb_datas = stats.nb_datas;
+    t = sys_get_time();
+    for (i = 0; i < nb_layers; i++) mesh_dedup(layers[i]);
+    bench_log("dedup: layers", sys_get_time() - t, nb_blocks, "block");
+
+    t = sys_get_time();
+    for (i = 0; i < nb_layers; i++) mesh_dedup(layers[i]);
+    bench_log("dedup: unchanged layers", sys_get_time() - t, nb_blocks,
+              "block");
+
+    mesh_get_stats(NULL, &stats);
+    LOG_I("dedup: %d datas -> %d, %d blocks deduped, %zu KiB saved",
+          nb_datas, stats.nb_datas, stats.nb_deduped,
+          stats.mem_deduped / 1024);
+    for (i = 0; i < nb_layers; i++) mesh_delete(layers[i]);
+}
+
+/*
+ * Diff a 1M voxels mesh with a copy where we changed a few voxels, with a
+ * copy built separately (so all the blocks differ), and compare with a
+ * voxel by voxel comparison.
+ */
+static void bench_diff(void)
+{
+    const int s = 128, nb_iter = 100;
+    mesh_t *mesh, *copy, *other;
+    mesh_accessor_t a1, a2;
+    mesh_iterator_t iter;
+    mesh_stats_t stats;
+    uint8_t (*data)[4], v1[4], v2[4];
+    int i, n = 0, pos[3];
+    double t;
+
+    // Ball of radius 62, about 1M voxels.
+    data = calloc(s * s * s, sizeof(*data));
+    for (i = 0; i < s * s * s; i++) {
+        pos[0] = i % s - s / 2;
+        pos[1] = i / s % s - s / 2;
+        pos[2] = i / s / s - s / 2;
+        if (vec3_norm2((float[]){pos[0], pos[1], pos[2]}) > 62 * 62)
+            continue;
+        memcpy(data[i], (uint8_t[]){pos[0] & 0xf0, 128, 0, 255}, 4);
+    }
+    mesh = mesh_new();
+    mesh_write(mesh, (int[]){0, 0, 0}, (int[]){s, s, s}, (uint8_t*)data);
+    other = mesh_new();
+    mesh_write(other, (int[]){0, 0, 0}, (int[]){s, s, s}, (uint8_t*)data);
+    free(data);
+    mesh_get_stats(mesh, &stats);
+
+    copy = mesh_copy(mesh);
+    for (i = 0; i < 16; i++) {
+        pos[0] = rand_next() % s;
+        pos[1] = rand_next() % s;
+        pos[2] = rand_next() % s;
+        mesh_set_at(copy, NULL, pos, (uint8_t[]){0, 255, 0, 255});
+    }
+
+    t = sys_get_time();
+    for (i = 0; i < nb_iter; i++) n += mesh_diff(mesh, copy, NULL, NULL);
+    bench_log("diff: copy with 16 voxels changed",
+              sys_get_time() - t, stats.nb_blocks * nb_iter, "block");
+
+    t = sys_get_time();
+    for (i = 0; i < nb_iter; i++) n += mesh_diff(mesh, other, NULL, NULL);
+    bench_log("diff: separate meshes",
+              sys_get_time() - t, stats.nb_blocks * nb_iter, "block");
+
+    t = sys_get_time();
+    a1 = mesh_get_accessor(mesh);
+    a2 = mesh_get_accessor(copy);
+    iter = mesh_get_iterator(mesh, 0);
+    while (mesh_iter(&iter, pos)) {
+        mesh_get_at(mesh, &a1, pos, v1);
+        mesh_get_at(copy, &a2, pos, v2);
+        n += memcmp(v1, v2, 4) != 0;
+    }
+    bench_log("diff: voxels comparison", sys_get_time() - t,
+              stats.nb_blocks, "block");
+
+    LOG_I("diff: %d blocks, %d voxels", stats.nb_blocks, stats.nb_voxels);
+    LOG_D("%d", n); // Make sure the loops are not optimized out.
+    mesh_delete(mesh);
+    mesh_delete(copy);
+    mesh_delete(other);
+}
+
+/*
+ * Composite a stack of layers, as done at each update of the image, with
+ * successive merges or in a single pass, before and after sorting the
+ * layers blocks.  Each layer is a different random set of uniform
+ * blocks, so that we mostly measure the iteration of the blocks.
+ */
+static void bench_merge_layers(void)
+{
+    const int nb_layers = 8, nb_blocks = 4096, s = 32, nb_runs = 5;
+    mesh_t *layers[8], *mesh = mesh_new();
+    mesh_iterator_t iter;
+    int i, j, k, r, n = 0, pos[3];
+    double t, best[3];
+
+    for (i = 0; i < nb_layers; i++) {
+        layers[i] = mesh_new();
+        for (j = 0; j < nb_blocks; j++) {
+            for (k = 0; k < 3; k++) pos[k] = (rand_next() % s) * N;
+            mesh_fill_block(layers[i], pos, (uint8_t[]){i * 30, 0, 0, 255});
+        }
+    }
+
+    // Keep the best of a few runs for each measure.
+    for (k = 0; k < 2; k++) {
+        best[0] = best[1] = best[2] = DBL_MAX;
+        for (r = 0; r < nb_runs; r++) {
+            // Modify each layer a bit so that we don't hit the caches.
+            for (i = 0; i < nb_layers; i++) {
+                mesh_fill_block(layers[i], (int[]){0, 0, 0},
+                                (uint8_t[]){k * nb_runs + r, 0, 0, 255});
+            }
+            n = 0;
+            t = sys_get_time();
+            for (i = 0; i < nb_layers; i++) {
+                iter = mesh_get_union_iterator(layers[i],
+                        layers[(i + 1) % nb_layers], MESH_ITER_BLOCKS);
+                while (mesh_iter(&iter, pos)) n++;
+            }
+            best[0] = min(best[0], sys_get_time() - t);
+
+            t = sys_get_time();
+            mesh_clear(mesh);
+            for (i = 0; i < nb_layers; i++)
+                mesh_merge(mesh, layers[i], MODE_OVER, NULL);
+            best[1] = min(best[1], sys_get_time() - t);
+
+            t = sys_get_time();
+            mesh_clear(mesh);
+            mesh_merge_all(mesh, (const mesh_t**)layers, nb_layers,
+                           MODE_OVER);
+            best[2] = min(best[2], sys_get_time() - t);
+        }
+        bench_log(k ? "merge_layers: union iter (sorted)" :
+                      "merge_layers: union iter", best[0], n, "block");
+        bench_log(k ? "merge_layers: merge (sorted)" : "merge_layers: merge",
+                  best[1], nb_layers * nb_blocks, "block");
+        bench_log(k ? "merge_layers: merge all (sorted)" :
+                      "merge_layers: merge all",
+                  best[2], nb_layers * nb_blocks, "block");
+        for (i = 0; i < nb_layers; i++) mesh_sort_blocks(layers[i]);
+    }
+
+    for (i = 0; i < nb_layers; i++) mesh_delete(layers[i]);
+    mesh_delete(mesh);
+}
+
+/*
+ * Write a big volume into a mesh, as done by the importers, and read it
+ * back.
+ */
+static void bench_read_write(void)
+{
+    const int s = 256;
+    mesh_t *mesh;
+    mesh_iterator_t iter;
+    uint8_t (*data)[4];
+    int i, pos[3];
+    double t;
+
+    // Some noisy sphere.
+    data = calloc(s * s * s, sizeof(*data));
+    for (i = 0; i < s * s * s; i++) {
+        pos[0] = i % s - s / 2;
+        pos[1] = i / s % s - s / 2;
+        pos[2] = i / s / s - s / 2;
+        if (pos[0] * pos[0] + pos[1] * pos[1] + pos[2] * pos[2] > s * s / 4)
+            continue;
+        data[i][0] = 128 + (rand_next() % 4);
+        data[i][1] = 128;
+        data[i][2] = 255;
+        data[i][3] = 255;
+    }
+
+    mesh = mesh_new();
+    t = sys_get_time();
+    mesh_write(mesh, (int[]){0, 0, 0}, (int[]){s, s, s}, (uint8_t*)data);
+    bench_log("read_write: write", sys_get_time() - t, s * s * s, "voxel");
+
+    t = sys_get_time();
+    mesh_read(mesh, (int[]){0, 0, 0}, (int[]){s, s, s}, (uint8_t*)data);
+    bench_log("read_write: read", sys_get_time() - t, s * s * s, "voxel");
+    mesh_delete(mesh);
+
+    // Compare with setting the voxels one by one.
+    mesh = mesh_new();
+    iter = mesh_get_accessor(mesh);
+    t = sys_get_time();
+    for (i = 0; i < s * s * s; i++) {
+        pos[0] = i % s;
+        pos[1] = i / s % s;
+        pos[2] = i / s / s;
+        mesh_set_at(mesh, &iter, pos, data[i]);
+    }
+    mesh_remove_empty_blocks(mesh, false);
+    bench_log("read_write: write (mesh_set_at)", sys_get_time() - t,
+              s * s * s, "voxel");
+    mesh_delete(mesh);
+    free(data);
+}
+
+/*
+ * Single voxel writes throughput, with and without an edit session.  We
+ * keep a copy of the mesh, as the undo history would, so that the blocks
+ * have to be copied on the first write.
+ */
+static void bench_set_at(void)
+{
+    const int s = 8, nb = 1 << 22;
+    mesh_t *mesh, *copy;
+    mesh_iterator_t iter;
+    int i, k, (*pos)[3];
+    uint8_t v[4] = {0, 0, 0, 255};
+    double t;
+
+    pos = calloc(nb, sizeof(*pos));
+    for (i = 0; i < nb; i++) {
+        pos[i][0] = rand_next() % (s * N);
+        pos[i][1] = rand_next() % (s * N);
+        pos[i][2] = rand_next() % (s * N);
+    }
+    copy = create_blocks_mesh(s, s, s);
+
+    for (k = 0; k < 2; k++) {
+        mesh = mesh_copy(copy);
+        iter = mesh_get_accessor(mesh);
+        t = sys_get_time();
+        if (k) mesh_begin_edit(mesh);
+        for (i = 0; i < nb; i++) {
+            v[0] = i % 8;
+            mesh_set_at(mesh, &iter, pos[i], v);
+        }
+        if (k) mesh_end_edit(mesh);
+        bench_log(k ? "set_at: random (edit session)" : "set_at: random",
+                  sys_get_time() - t, nb, "voxel");
+        mesh_delete(mesh);
+    }
+
+    mesh_delete(copy);
+    free(pos);
+}
+
+/*
+ * Iterate the blocks of a box, with and without MESH_ITER_SKIP_EMPTY, on a
+ * sparse scene (a few voxels in a large volume) and a dense one.
+ */
+static void bench_box_iter_scene(const char *name, mesh_t *mesh,
+                                 const int aabb[2][3])
+{
+    float box[4][4];
+    mesh_iterator_t iter;
+    int k, pos[3], nb_pos, nb = 0;
+    char label[64];
+    double t;
+
+    bbox_from_aabb(box, aabb);
+    nb_pos = (aabb[1][0] - aabb[0][0]) / N * (aabb[1][1] - aabb[0][1]) / N *
+             (aabb[1][2] - aabb[0][2]) / N;
+    for (k = 0; k < 2; k++) {
+        t = sys_get_time();
+        iter = mesh_get_box_iterator(mesh, box, MESH_ITER_BLOCKS |
+                                     (k ? MESH_ITER_SKIP_EMPTY : 0));
+        while (mesh_iter(&iter, pos)) nb++;
+        sprintf(label, "box_iter: %s%s", name, k ? " (skip empty)" : "");
+        bench_log(label, sys_get_time() - t, nb_pos, "block");
+    }
+    LOG_D("%d", nb);
+}
+
+static void bench_box_iter(void)
+{
+    mesh_t *mesh;
+    int i, pos[3];
+    const int s = 2048;
+
+    // Sparse: a few voxels in a 2048^3 volume.
+    mesh = mesh_new();
+    for (i = 0; i < 1000; i++) {
+        pos[0] = rand_next() % s;
+        pos[1] = rand_next() % s;
+        pos[2] = rand_next() % s;
+        mesh_set_at(mesh, NULL, pos, (uint8_t[]){255, 255, 255, 255});
+    }
+    bench_box_iter_scene("sparse", mesh,
+                         (int[2][3]){{0, 0, 0}, {s, s, s}});
+    // Laser like box going through the whole volume.
+    bench_box_iter_scene("sparse laser", mesh,
+                         (int[2][3]){{0, 1024, 1024}, {s, 1024 + 64,
+                                                          1024 + 64}});
+    mesh_delete(mesh);
+
+    // Dense: all the blocks present.
+    mesh = create_blocks_mesh(32, 32, 32);
+    bench_box_iter_scene("dense", mesh,
+                         (int[2][3]){{0, 0, 0}, {32 * N, 32 * N, 32 * N}});
+    mesh_delete(mesh);
+}
+
+/*
+ * Meshing, merge and random access throughput, to compare the blocks
+ * layouts (compile with scons block_layout=N) and the blocks order.
+ */
+static void bench_layout_meshing(mesh_t *mesh, const char *name)
+{
+    mesh_iterator_t iter;
+    voxel_vertex_t *vertices;
+    int bpos[3], nb_blocks = 0, nb = 0;
+    double t;
+
+    vertices = calloc(N * N * N * 6 * 4, sizeof(*vertices));
+    t = sys_get_time();
+    iter = mesh_get_iterator(mesh, MESH_ITER_BLOCKS);
+    while (mesh_iter(&iter, bpos)) {
+        nb += mesh_generate_vertices(mesh, bpos, 0, vertices);
+        nb_blocks++;
+    }
+    bench_log(name, sys_get_time() - t, nb_blocks, "block");
+    LOG_D("%d", nb);
+    free(vertices);
+}
+
+static void bench_layout(void)
+{
+    const int s = 128, nb_lookups = 1 << 22;
+    mesh_t *mesh, *other;
+    uint8_t (*data)[4], v[4];
+    int i, pos[3], sum = 0;
+    double t;
+
+    LOG_I("layout: BLOCK_LAYOUT=%d", BLOCK_LAYOUT);
+    // Noisy sphere with a few colors, and a shifted copy of it.
+    data = calloc(s * s * s, sizeof(*data));
+    for (i = 0; i < s * s * s; i++) {
+        pos[0] = i % s - s / 2;
+        pos[1] = i / s % s - s / 2;
+        pos[2] = i / s / s - s / 2;
+        if (pos[0] * pos[0] + pos[1] * pos[1] + pos[2] * pos[2] > s * s / 4)
+            continue;
+        if (rand_next() % 8 == 0) continue;
+        data[i][0] = 64 * (rand_next() % 4);
+        data[i][3] = 255;
+    }
+    mesh = mesh_new();
+    other = mesh_new();
+    mesh_write(mesh, (int[]){0, 0, 0}, (int[]){s, s, s}, (uint8_t*)data);
+    mesh_write(other, (int[]){s / 3, 0, 0}, (int[]){s, s, s},
+               (uint8_t*)data);
+    free(data);
+
+    bench_layout_meshing(mesh, "layout: meshing");
+    mesh_sort_blocks(mesh);
+    bench_layout_meshing(mesh, "layout: meshing (morton order)");
+
+    t = sys_get_time();
+    for (i = 0; i < nb_lookups; i++) {
+        pos[0] = rand_next() % s;
+        pos[1] = rand_next() % s;
+        pos[2] = rand_next() % s;
+        mesh_get_at(mesh, NULL, pos, v);
+        sum += v[0];
+    }
+    bench_log("layout: random get", sys_get_time() - t, nb_lookups,
+              "voxel");
+
+    t = sys_get_time();
+    mesh_merge(mesh, other, MODE_OVER, NULL);
+    bench_log("layout: merge", sys_get_time() - t, s * s * s, "voxel");
+
+    LOG_D("%d", sum);
+    mesh_delete(mesh);
+    mesh_delete(other);
+}
+
+/*
+ * Edit latency, memory and meshing throughput for the compiled block size.
+ * To compare the sizes, run it with the different builds (scons
+ * block_size=8, 16 or 32).
+ */
+static void bench_block_size(void)
+{
+    const int s = 256, nb_edits = 256;
+    mesh_t *mesh, *copy;
+    mesh_stats_t stats;
+    mesh_iterator_t iter;
+    voxel_vertex_t *vertices;
+    uint8_t (*data)[4];
+    float box[4][4];
+    int i, r2, pos[3], bpos[3], nb = 0;
+    double t;
+    painter_t painter = {
+        .mode = MODE_OVER,
+        .color = {255, 0, 0, 255},
+        .shape = &shape_sphere,
+    };
+
+    LOG_I("block_size: BLOCK_SIZE=%d", BLOCK_SIZE);
+    // Noisy sphere shell, with a few colors.
+    data = calloc(s * s * s, sizeof(*data));
+    for (i = 0; i < s * s * s; i++) {
+        pos[0] = i % s - s / 2;
+        pos[1] = i / s % s - s / 2;
+        pos[2] = i / s / s - s / 2;
+        r2 = pos[0] * pos[0] + pos[1] * pos[1] + pos[2] * pos[2];
+        if (r2 > s * s / 4 || r2 < s * s / 5) continue;
+        data[i][0] = 64 * (rand_next() % 4);
+        data[i][3] = 255;
+    }
+    mesh = mesh_new();
+    mesh_write(mesh, (int[]){0, 0, 0}, (int[]){s, s, s}, (uint8_t*)data);
+    free(data);
+    mesh_get_stats(mesh, &stats);
+    LOG_I("block_size: %d blocks %d voxels %6.2f B/voxel",
+          stats.nb_blocks, stats.nb_voxels,
+          (double)stats.mem / max(stats.nb_voxels, 1));
+
+    // Small brush strokes on the surface, each one on a new copy of the
+    // mesh, like the history does.
+    t = sys_get_time();
+    for (i = 0; i < nb_edits; i++) {
+        copy = mesh_copy(mesh);
+        pos[0] = s / 2 + (int)(rand_next() % (s / 2)) - s / 4;
+        pos[1] = s / 2 + (int)(rand_next() % (s / 2)) - s / 4;
+        pos[2] = s / 2 + s / 2 - s / 10;
+        bbox_from_extents(box, VEC(pos[0], pos[1], pos[2]), 3, 3, 3);
+        mesh_op(copy, &painter, box);
+        mesh_delete(mesh);
+        mesh = copy;
+    }
+    bench_log("block_size: edit", sys_get_time() - t, nb_edits, "edit");
+
+    vertices = calloc(N * N * N * 6 * 4, sizeof(*vertices));
+    t = sys_get_time();
+    iter = mesh_get_iterator(mesh, MESH_ITER_BLOCKS);
+    while (mesh_iter(&iter, bpos)) {
+        nb += mesh_generate_vertices(mesh, bpos, 0, vertices);
+    }
+    bench_log("block_size: meshing", sys_get_time() - t, nb, "quad");
+    free(vertices);
+    mesh_delete(mesh);
+}
+
+/*
+ * Memory used by the history of a brush stroke: 1000 small dabs along a
+ * spiral on the surface of a sphere, keeping a copy of the mesh after each
+ * dab, as the undo history would do.
+ */
+static void bench_history(void)
+{
+    const int s = 128, nb_dabs = 1000;
+    mesh_t *mesh, **history;
+    mesh_stats_t stats;
+    uint8_t (*data)[4];
+    float box[4][4], p[3], lat, lon;
+    int i, pos[3];
+    size_t mem;
+    double t;
+    painter_t painter = {
+        .mode = MODE_OVER,
+        .color = {255, 0, 0, 255},
+        .shape = &shape_sphere,
+    };
+
+    data = calloc(s * s * s, sizeof(*data));
+    for (i = 0; i < s * s * s; i++) {
+        pos[0] = i % s - s / 2;
+        pos[1] = i / s % s - s / 2;
+        pos[2] = i / s / s - s / 2;
+        if (pos[0] * pos[0] + pos[1] * pos[1] + pos[2] * pos[2] > s * s / 4)
+            continue;
+        data[i][0] = 64 * (rand_next() % 4);
+        data[i][3] = 255;
+    }
+    mesh = mesh_new();
+    mesh_write(mesh, (int[]){0, 0, 0}, (int[]){s, s, s}, (uint8_t*)data);
+    free(data);
+    history = calloc(nb_dabs, sizeof(*history));
+
+    mesh_get_stats(NULL, &stats);
+    mem = stats.mem_used;
+    t = sys_get_time();
+    for (i = 0; i < nb_dabs; i++) {
+        lat = -1.2 + 2.4 * i / nb_dabs;
+        lon = i * 0.05;
+        p[0] = s / 2 + s / 2 * cos(lat) * cos(lon);
+        p[1] = s / 2 + s / 2 * cos(lat) * sin(lon);
+        p[2] = s / 2 + s / 2 * sin(lat);
+        bbox_from_extents(box, p, 2, 2, 2);
+        mesh_op(mesh, &painter, box);
+        history[i] = mesh_copy(mesh);
+    }
+    bench_log("history: dab", sys_get_time() - t, nb_dabs, "dab");
+    mesh_get_stats(NULL, &stats);
+    LOG_I("history: %zu KiB for %d dabs (%.2f KiB/dab)",
+          (stats.mem_used - mem) / 1024, nb_dabs,
+          (double)(stats.mem_used - mem) / 1024 / nb_dabs);
+
+    for (i = 0; i < nb_dabs; i++) mesh_delete(history[i]);
+    free(history);
+    mesh_delete(mesh);
+}
+
+/*
+ * Run all the procedural programs of data/progs, and compare the memory
+ * used by the resulting meshes with what they would use with raw RGBA
+ * blocks.
+ */
+static void on_prog(int index, const char *name, const char *code,
+                    void *user)
+{
+    gox_proc_t proc = {};
+    mesh_t *mesh = goxel->image->active_layer->mesh;
+    mesh_stats_t stats;
+    painter_t painter = goxel->painter;
+    int i, nb_voxels;
+
+    mesh_clear(mesh);
+    goxel->painter.color[3] = 255;
+    goxel->painter.symmetry = 0;
+    goxel->painter.box = NULL;
+    if (proc_parse(code, &proc) != 0 || proc_start(&proc, NULL) != 0) {
+        LOG_W("Cannot run %s", name);
+        proc_release(&proc);
+        return;
+    }
+    // Some programs are animated forever, so we stop them at some point.
+    for (i = 0; i < 10000 && proc.state == PROC_RUNNING; i++)
+        proc_iter(&proc);
+    proc_release(&proc);
+    goxel->painter = painter;
+
+    mesh_get_stats(mesh, &stats);
+    nb_voxels = max(stats.nb_voxels, 1);
+    LOG_I("%-20s %7d blocks %9d voxels %6.2f B/voxel (raw: %6.2f B/voxel)",
+          name, stats.nb_blocks, stats.nb_voxels,
+          (double)stats.mem / nb_voxels, (double)stats.mem_raw / nb_voxels);
+    mesh_clear(mesh);
+}
+
+static void bench_brush_size(void)
+{
+    const int nb = 4;
+    const float sizes[] = {8, 32, 128};
+    mesh_t *filled, *mesh;
+    float box[4][4];
+    int i, j, m;
+    double t;
+    char name[64];
+    painter_t painter = {
+        .color = {255, 0, 0, 255},
+        .shape = &shape_sphere,
+    };
+    const struct {
+        const char *name;
+        int mode;
+        bool filled;
+    } modes[] = {
+        {"over", MODE_OVER, false},
+        {"sub", MODE_SUB, true},
+        {"paint", MODE_PAINT, true},
+    };
+
+    // A filled cube larger than the biggest brush, to subtract from.
+    filled = mesh_new();
+    bbox_from_extents(box, VEC(0, 0, 0), 160, 160, 160);
+    painter.mode = MODE_OVER;
+    painter.shape = &shape_cube;
+    mesh_op(filled, &painter, box);
+    painter.shape = &shape_sphere;
+
+    for (m = 0; m < ARRAY_SIZE(modes); m++) {
+        painter.mode = modes[m].mode;
+        for (j = 0; j < ARRAY_SIZE(sizes); j++) {
+            t = 0;
+            for (i = 0; i < nb; i++) {
+                mesh = modes[m].filled ? mesh_copy(filled) : mesh_new();
+                // Move the brush a bit so that we never hit the op cache.
+                bbox_from_extents(box, VEC(i, 0, 0),
+                                  sizes[j], sizes[j], sizes[j]);
+                t -= sys_get_time();
+                mesh_op(mesh, &painter, box);
+                t += sys_get_time();
+                mesh_delete(mesh);
+            }
+            sprintf(name, "brush_size: %s r=%d", modes[m].name,
+                    (int)sizes[j]);
+            bench_log(name, t, nb, "op");
+        }
+    }
+    mesh_delete(filled);
+}
+
+// Compare the scalar and batched shape functions, on random positions
+// around the shape surface.
+static void bench_shapes(void)
+{
+    const int n = 1 << 14, nb = 64;
+    const float size[3] = {20, 20, 20};
+    const float smoothness[] = {0, 1, 4};
+    const shape_t *shapes[] = {&shape_sphere, &shape_cube, &shape_cylinder};
+    float (*p)[3], *xyz[3], *out;
+    int i, j, k, r;
+    double t;
+    char name[64];
+
+    p = calloc(n, sizeof(*p));
+    for (i = 0; i < 3; i++) xyz[i] = calloc(n, sizeof(float));
+    out = calloc(n, sizeof(*out));
+    for (i = 0; i < n; i++) {
+        for (k = 0; k < 3; k++) {
+            p[i][k] = (rand_next() % 2048) / 1024.0 * 24 - 24;
+            xyz[k][i] = p[i][k];
+        }
+    }
+
+    for (j = 0; j < ARRAY_SIZE(shapes); j++)
+    for (k = 0; k < ARRAY_SIZE(smoothness); k++) {
+        t = sys_get_time();
+        for (r = 0; r < nb; r++) {
+            for (i = 0; i < n; i++)
+                out[i] = shapes[j]->func(p[i], size, smoothness[k]);
+        }
+        t = sys_get_time() - t;
+        sprintf(name, "shapes: %s sm=%g scalar", shapes[j]->id,
+                smoothness[k]);
+        LOG_I("%-40s %10.1f Mvoxels/s", name, n * nb / t / 1e6);
+
+        t = sys_get_time();
+        for (r = 0; r < nb; r++) {
+            shapes[j]->func_batch(n, xyz[0], xyz[1], xyz[2], size,
+                                  smoothness[k], out);
+        }
+        t = sys_get_time() - t;
+        sprintf(name, "shapes: %s sm=%g batch", shapes[j]->id,
+                smoothness[k]);
+        LOG_I("%-40s %10.1f Mvoxels/s", name, n * nb / t / 1e6);
+    }
+
+    free(p);
+    for (i = 0; i < 3; i++) free(xyz[i]);
+    free(out);
+}
+
+// Random voxels in a cube of size s, with new blocks data each time.
+static mesh_t *create_noise_mesh(int s)
+{
+    mesh_t *mesh = mesh_new();
+    uint8_t (*data)[4];
+    int i;
+
+    data = calloc(s * s * s, sizeof(*data));
+    for (i = 0; i < s * s * s; i++) {
+        data[i][0] = 64 * (rand_next() % 4);
+        data[i][3] = rand_next() % 2 ? 255 : 0;
+    }
+    mesh_write(mesh, (int[]){-s / 2, -s / 2, -s / 2}, (int[]){s, s, s},
+               (uint8_t*)data);
+    free(data);
+    return mesh;
+}
+
+// mesh_op, mesh_merge and mesh_crop with different numbers of workers.
+static void bench_parallel(void)
+{
+    const int s = 128;
+    int nb, max_nb = workers_get_count();
+    mesh_t *filled, *mesh, *other;
+    float box[4][4];
+    double t;
+    char name[64];
+    painter_t painter = {
+        .mode = MODE_SUB,
+        .color = {255, 255, 255, 255},
+        .shape = &shape_sphere,
+    };
+
+    filled = create_noise_mesh(s);
+    for (nb = 1; ; nb = min(nb * 2, max_nb)) {
+        workers_set_count(nb);
+
+        // Move the box a bit so that we never hit the op cache.
+        mesh = mesh_copy(filled);
+        bbox_from_extents(box, VEC(nb, 0, 0), s / 3, s / 3, s / 3);
+        t = sys_get_time();
+        mesh_op(mesh, &painter, box);
+        sprintf(name, "parallel: op (%d workers)", nb);
+        bench_log(name, sys_get_time() - t, 1, "op");
+        mesh_delete(mesh);
+
+        mesh = mesh_copy(filled);
+        other = create_noise_mesh(s);
+        t = sys_get_time();
+        mesh_merge(mesh, other, MODE_OVER, NULL);
+        sprintf(name, "parallel: merge (%d workers)", nb);
+        bench_log(name, sys_get_time() - t, 1, "op");
+        mesh_delete(mesh);
+        mesh_delete(other);
+
+        mesh = mesh_copy(filled);
+        bbox_from_extents(box, VEC(nb, 0, 0), s / 3, s / 3, s / 3);
+        t = sys_get_time();
+        mesh_crop(mesh, box);
+        sprintf(name, "parallel: crop (%d workers)", nb);
+        bench_log(name, sys_get_time() - t, 1, "op");
+        mesh_delete(mesh);
+        if (nb == max_nb) break;
+    }
+    workers_set_count(0);
+    mesh_delete(filled);
+}
+
+// mesh_op with symmetry, with a brush at the center of the model, so that
+// the mirrored shapes overlap, and with a brush away from the center.
+static void bench_symmetry(void)
+{
+    const int nb = 4;
+    const int symmetries[] = {0, 1, 7};
+    const float centers[] = {0, 64};
+    mesh_t *filled, *mesh;
+    float box[4][4];
+    int i, j, k;
+    double t;
+    char name[64];
+    painter_t painter = {
+        .mode = MODE_OVER,
+        .color = {255, 0, 0, 255},
+        .shape = &shape_cube,
+    };
+
+    filled = mesh_new();
+    bbox_from_extents(box, VEC(0, 0, 0), 128, 128, 128);
+    mesh_op(filled, &painter, box);
+    painter.shape = &shape_sphere;
+    painter.mode = MODE_SUB;
+
+    for (k = 0; k < ARRAY_SIZE(centers); k++) {
+        for (j = 0; j < ARRAY_SIZE(symmetries); j++) {
+            painter.symmetry = symmetries[j];
+            t = 0;
+            for (i = 0; i < nb; i++) {
+                mesh = mesh_copy(filled);
+                // Move the brush a bit so that we never hit the op cache.
+                bbox_from_extents(box, VEC(centers[k] + i, 3, 5), 32, 32, 32);
+                t -= sys_get_time();
+                mesh_op(mesh, &painter, box);
+                t += sys_get_time();
+                mesh_delete(mesh);
+            }
+            sprintf(name, "symmetry: sub x=%d sym=%d", (int)centers[k],
+                    symmetries[j]);
+            bench_log(name, t, nb, "op");
+        }
+    }
+    mesh_delete(filled);
+}
+
+static void bench_blocks_memory(void)
+{
+    proc_list_examples(on_prog, NULL);
+}
+
+/*
+ * Import a volume bigger than the paging budget, then read random voxels
+ * from it, so that most of the reads have to page the blocks back in.
+ * Since the paging can't be disabled, this should run last.
+ */
+static void bench_paging(void)
+{
+    const int s = 256, nb_reads = 1 << 20, budget = 16;
+    mesh_t *mesh;
+    mesh_stats_t stats;
+    uint8_t (*data)[4], v[4];
+    int i, pos[3], sum = 0;
+    double t;
+
+    data = calloc(s * s * s, sizeof(*data));
+    for (i = 0; i < s * s * s; i++) {
+        data[i][0] = rand_next() % 64 * 4;
+        data[i][1] = 128;
+        data[i][3] = 255;
+    }
+    if (!mesh_set_paging(NULL, budget << 20)) {
+        LOG_W("Cannot create the paging file");
+        free(data);
+        return;
+    }
+    mesh = mesh_new();
+    t = sys_get_time();
+    mesh_write(mesh, (int[]){0, 0, 0}, (int[]){s, s, s}, (uint8_t*)data);
+    bench_log("paging: write", sys_get_time() - t, s * s * s, "voxel");
+    free(data);
+    mesh_get_stats(NULL, &stats);
+    LOG_I("paging: %d blocks paged out, used %zu KiB, file %zu KiB",
+          stats.nb_paged, stats.mem_used / 1024,
+          stats.paging_file_size / 1024);
+
+    t = sys_get_time();
+    for (i = 0; i < nb_reads; i++) {
+        pos[0] = rand_next() % s;
+        pos[1] = rand_next() % s;
+        pos[2] = rand_next() % s;
+        mesh_get_at(mesh, NULL, pos, v);
+        sum += v[0];
+        if (i % 4096 == 0) mesh_paging_trim();
+    }
+    bench_log("paging: random reads", sys_get_time() - t, nb_reads, "read");
+    mesh_get_stats(NULL, &stats);
+    LOG_I("paging: %d blocks paged out, used %zu KiB", stats.nb_paged,
+          stats.mem_used / 1024);
+    LOG_D("%d", sum);
+    mesh_delete(mesh);
+    mesh_set_paging(NULL, 0);
+}
+
+static const struct {
+    const char *name;
+    void (*func)(void);
+} BENCHS[] = {
+    {"blocks_table", bench_blocks_table},
+    {"blocks_alloc", bench_blocks_alloc},
+    {"blocks_memory", bench_blocks_memory},
+    {"dedup", bench_dedup},
+    {"diff", bench_diff},
+    {"merge_layers", bench_merge_layers},
+    {"read_write", bench_read_write},
+    {"set_at", bench_set_at},
+    {"box_iter", bench_box_iter},
+    {"layout", bench_layout},
+    {"block_size", bench_block_size},
+    {"history", bench_history},
+    {"brush_size", bench_brush_size},
+    {"shapes", bench_shapes},
+    {"parallel", bench_parallel},
+    {"symmetry", bench_symmetry},
+    {"paging", bench_paging},
+};
+
+void bench_run(const char *filter)
+{
+    int i;
+    for (i = 0; i < ARRAY_SIZE(BENCHS); i++) {
+        if (filter && !strstr(BENCHS[i].name, filter)) continue;
+        BENCHS[i].func();
+    }
+}
@@ -359,8 +359,9 @@ static void dicom_import(const char *dirpath)
     free(data);
 
     // This could belong to the caller function.
-    mesh_blit(goxel->image->active_layer->mesh, (uint8_t*)cube,
-              -w / 2, -h / 2, -d / 2, w, h, d, NULL);
+    mesh_write(goxel->image->active_layer->mesh,
+               (int[]){-w / 2, -h / 2, -d / 2}, (int[]){w, h, d},
+               (uint8_t*)cube);
 
     free(cube);
 }
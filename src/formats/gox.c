@@ -75,6 +75,10 @@ static int gzseek(gzFile file, long offset, int whence) {
  *
  *  BL16: a 16^3 block saved as a 64x64 png image.
  *
+ *  BL08, BL32: same thing for the builds with a different block size, the
+ *  blocks being saved as (N*N/4)x(4*N) png images.  We can read all of
+ *  them, whatever the block size of the mesh.
+ *
  *  LAYR: a layer:
  *      4 bytes: number of blocks.
  *      for each block:
@@ -99,8 +103,13 @@ static int gzseek(gzFile file, long offset, int whence) {
 typedef struct {
     UT_hash_handle  hh;
     void            *v;
+    int             size;   // Size of the block (8, 16 or 32).
     uint64_t        uid;
     int             index;
+    // First mesh and position of the block.  When saving we read the
+    // voxels from there, when loading the other blocks share its data.
+    mesh_t          *mesh;
+    int             pos[3];
 } block_hash_t;
 
 #define CHUNK_BUFF_SIZE (1 << 20) // 1 MiB max buffer size!
@@ -233,8 +242,9 @@ void save_to_file(goxel_t *goxel, const char *path, bool with_preview)
     chunk_t c;
     int nb_blocks, index, size, bpos[3];
     uint64_t uid;
+    char block_type[8];
     gzFile out;
-    uint8_t *png, *preview;
+    uint8_t *png, *preview, *voxels;
     camera_t *camera;
     mesh_iterator_t iter;
 
@@ -267,24 +277,33 @@ void save_to_file(goxel_t *goxel, const char *path, bool with_preview)
     DL_FOREACH(goxel->image->layers, layer) {
         iter = mesh_get_iterator(layer->mesh, MESH_ITER_BLOCKS);
         while (mesh_iter(&iter, bpos)) {
-            mesh_get_block_data(layer->mesh, &iter, bpos, &uid);
+            uid = mesh_get_block_id(layer->mesh, &iter, bpos);
             HASH_FIND(hh, blocks_table, &uid, sizeof(uid), data);
             if (data) continue;
             data = calloc(1, sizeof(*data));
-            data->v = mesh_get_block_data(layer->mesh, &iter, bpos, NULL);
-            assert(data->v);
+            data->mesh = layer->mesh;
+            memcpy(data->pos, bpos, sizeof(data->pos));
             data->uid = uid;
             data->index = index++;
             HASH_ADD(hh, blocks_table, uid, sizeof(data->uid), data);
         }
     }
 
-    // Write all the blocks chunks.
+    // Write all the blocks chunks.  The palette encoded blocks are decoded
+    // into a temporary buffer, so that the saved meshes don't keep a
+    // decoded copy of their data.
+    sprintf(block_type, "BL%02d", BLOCK_SIZE);
+    voxels = malloc(BLOCK_SIZE * BLOCK_SIZE * BLOCK_SIZE * 4);
     HASH_ITER(hh, blocks_table, data, data_tmp) {
-        png = img_write_to_mem((uint8_t*)data->v, 64, 64, 4, &size);
-        chunk_write_all(out, "BL16", (char*)png, size);
+        mesh_read(data->mesh, data->pos,
+                  (int[]){BLOCK_SIZE, BLOCK_SIZE, BLOCK_SIZE}, voxels);
+        png = img_write_to_mem(voxels,
+                               BLOCK_SIZE * BLOCK_SIZE / 4, 4 * BLOCK_SIZE,
+                               4, &size);
+        chunk_write_all(out, block_type, (char*)png, size);
         free(png);
     }
+    free(voxels);
 
     // Write all the layers.
     DL_FOREACH(goxel->image->layers, layer) {
@@ -300,7 +319,7 @@ void save_to_file(goxel_t *goxel, const char *path, bool with_preview)
         if (!layer->base_id) {
             iter = mesh_get_iterator(layer->mesh, MESH_ITER_BLOCKS);
             while (mesh_iter(&iter, bpos)) {
-                mesh_get_block_data(layer->mesh, &iter, bpos, &uid);
+                uid = mesh_get_block_id(layer->mesh, &iter, bpos);
                 HASH_FIND(hh, blocks_table, &uid, sizeof(uid), data);
                 assert(data);
                 chunk_write_int32(&c, out, data->index);
@@ -411,7 +430,7 @@ int load_from_file(goxel_t *goxel, const char *path)
     int w, h, bpp;
     uint8_t *png;
     chunk_t c;
-    int i, index, version, x, y, z;
+    int i, index, version, x, y, z, s;
     int  dict_value_size;
     char dict_key[256];
     char dict_value[256];
@@ -439,15 +458,19 @@ int load_from_file(goxel_t *goxel, const char *path)
     goxel->image->layers = NULL;
 
     while (chunk_read_start(&c, in)) {
-        if (strncmp(c.type, "BL16", 4) == 0) {
+        if (    strncmp(c.type, "BL08", 4) == 0 ||
+                strncmp(c.type, "BL16", 4) == 0 ||
+                strncmp(c.type, "BL32", 4) == 0) {
+            s = (c.type[2] - '0') * 10 + (c.type[3] - '0');
             png = calloc(1, c.length);
             chunk_read(&c, in, (char*)png, c.length);
             bpp = 4;
             voxel_data = img_read_from_mem((void*)png, c.length, &w, &h, &bpp);
-            assert(w == 64 && h == 64 && bpp == 4);
+            assert(w * h == s * s * s && bpp == 4);
             data = calloc(1, sizeof(*data));
-            data->v = calloc(1, 64 * 64 * 4);
-            memcpy(data->v, voxel_data, 64 * 64 * 4);
+            data->size = s;
+            data->v = calloc(1, s * s * s * 4);
+            memcpy(data->v, voxel_data, s * s * s * 4);
             data->uid = ++uid;
             HASH_ADD(hh, blocks_table, uid, sizeof(data->uid), data);
             free(voxel_data);
@@ -456,6 +479,7 @@ int load_from_file(goxel_t *goxel, const char *path)
         } else if (strncmp(c.type, "LAYR", 4) == 0) {
             layer = image_add_layer(goxel->image);
             nb_blocks = chunk_read_int32(&c, in);   assert(nb_blocks >= 0);
+            mesh_begin_edit(layer->mesh);
             for (i = 0; i < nb_blocks; i++) {
                 index = chunk_read_int32(&c, in);   assert(index >= 0);
                 x = chunk_read_int32(&c, in);
@@ -467,8 +491,24 @@ int load_from_file(goxel_t *goxel, const char *path)
                 chunk_read_int32(&c, in);
                 data = hash_find_at(blocks_table, index);
                 assert(data);
-                mesh_blit(layer->mesh, data->v, x, y, z, 16, 16, 16, NULL);
+                if (data->mesh) {
+                    mesh_copy_block(data->mesh, data->pos, layer->mesh,
+                                    (int[]){x, y, z});
+                    continue;
+                }
+                s = data->size;
+                mesh_write(layer->mesh, (int[]){x, y, z},
+                           (int[]){s, s, s}, data->v);
+                // Only blocks of the mesh size can share their data.
+                if (    s == BLOCK_SIZE &&
+                        x % s == 0 && y % s == 0 && z % s == 0 &&
+                        mesh_get_block_id(layer->mesh, NULL,
+                                          (int[]){x, y, z})) {
+                    data->mesh = layer->mesh;
+                    vec3_set(data->pos, x, y, z);
+                }
             }
+            mesh_end_edit(layer->mesh);
             while ((chunk_read_dict_value(&c, in, dict_key, dict_value,
                                           &dict_value_size))) {
                 if (strcmp(dict_key, "name") == 0)
@@ -22,10 +22,8 @@ static void export_as_png_slices(const char *path)
 {
     float box[4][4];
     mesh_t *mesh;
-    int x, y, z, w, h, d, pos[3], start_pos[3];
-    uint8_t c[4];
-    uint8_t *img;
-    mesh_iterator_t iter = {0};
+    int y, z, w, h, d, start_pos[3];
+    uint8_t *img, *data;
 
     path = path ?: noc_file_dialog_open(NOC_FILE_DIALOG_SAVE,
                    "png\0*.png\0", NULL, "untitled.png");
@@ -39,22 +37,19 @@ static void export_as_png_slices(const char *path)
     start_pos[0] = box[3][0] - box[0][0];
     start_pos[1] = box[3][1] - box[1][1];
     start_pos[2] = box[3][2] - box[2][2];
+    data = calloc(w * h * d, 4);
+    mesh_read(mesh, start_pos, (int[]){w, h, d}, data);
+    // Put all the z slices side by side.
     img = calloc(w * h * d, 4);
     for (z = 0; z < d; z++)
-    for (y = 0; y < h; y++)
-    for (x = 0; x < w; x++) {
-        pos[0] = x + start_pos[0];
-        pos[1] = y + start_pos[1];
-        pos[2] = z + start_pos[2];
-        mesh_get_at(mesh, &iter, pos, c);
-        img[(y * w * d + z * w + x) * 4 + 0] = c[0];
-        img[(y * w * d + z * w + x) * 4 + 1] = c[1];
-        img[(y * w * d + z * w + x) * 4 + 2] = c[2];
-        img[(y * w * d + z * w + x) * 4 + 3] = c[3];
+    for (y = 0; y < h; y++) {
+        memcpy(&img[(y * w * d + z * w) * 4],
+               &data[(z * w * h + y * w) * 4], w * 4);
     }
     img_write(img, w * d, h, 4, path);
 
     free(img);
+    free(data);
 }
 
 ACTION_REGISTER(export_as_png_slices,
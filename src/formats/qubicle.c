@@ -35,11 +35,40 @@ static void apply_orientation(int orientation, int pos[3])
     }
 }
 
+// Compute the box of a matrix after orientation.
+static void get_oriented_box(int orientation, const int pos[3],
+                             const int size[3], int tpos[3], int tsize[3])
+{
+    int i, a[3], b[3];
+    for (i = 0; i < 3; i++) {
+        a[i] = pos[i];
+        b[i] = pos[i] + size[i] - 1;
+    }
+    apply_orientation(orientation, a);
+    apply_orientation(orientation, b);
+    for (i = 0; i < 3; i++) {
+        tpos[i] = min(a[i], b[i]);
+        tsize[i] = abs(b[i] - a[i]) + 1;
+    }
+}
+
+// Set a voxel in the array we then write into the mesh.
+static void cube_set(uint8_t (*cube)[4], const int tpos[3],
+                     const int tsize[3], const int vpos[3],
+                     const uint8_t v[4])
+{
+    int x = vpos[0] - tpos[0], y = vpos[1] - tpos[1], z = vpos[2] - tpos[2];
+    if (    x < 0 || x >= tsize[0] || y < 0 || y >= tsize[1] ||
+            z < 0 || z >= tsize[2]) return;
+    memcpy(cube[x + y * tsize[0] + z * tsize[0] * tsize[1]], v, 4);
+}
+
 static void qubicle_import(const char *path)
 {
     FILE *file;
     int version, color_format, orientation, compression, vmask, mat_count;
     int i, j, r, index, len, w, h, d, pos[3], vpos[3], x, y, z, bbox[2][3];
+    int tpos[3], tsize[3];
     union {
         uint8_t v[4];
         uint32_t uint32;
@@ -50,7 +79,7 @@ static void qubicle_import(const char *path)
     const uint32_t CODEFLAG = 2;
     const uint32_t NEXTSLICEFLAG = 6;
     layer_t *layer;
-    mesh_iterator_t iter = {0};
+    uint8_t (*cube)[4];
 
     path = path ?: noc_file_dialog_open(NOC_FILE_DIALOG_OPEN,
                                         NULL, NULL, NULL);
@@ -69,7 +98,6 @@ static void qubicle_import(const char *path)
 
     for (i = 0; i < mat_count; i++) {
         layer = image_add_layer(goxel->image);
-        iter = mesh_get_accessor(layer->mesh);
         memset(layer->name, 0, sizeof(layer->name));
         len = READ(uint8_t, file);
         r = (int)fread(layer->name, len, 1, file);
@@ -88,6 +116,9 @@ static void qubicle_import(const char *path)
         apply_orientation(orientation, bbox[1]);
         bbox_from_aabb(layer->box, bbox);
 
+        get_oriented_box(orientation, pos, (int[]){w, h, d}, tpos, tsize);
+        cube = calloc(w * h * d, sizeof(*cube));
+
         if (compression == 0) {
             for (index = 0; index < w * h * d; index++) {
                 v.uint32 = READ(uint32_t, file);
@@ -97,7 +128,7 @@ static void qubicle_import(const char *path)
                 vpos[1] = pos[1] + (index % (w * h)) / w;
                 vpos[2] = pos[2] + index / (w * h);
                 apply_orientation(orientation, vpos);
-                mesh_set_at(layer->mesh, &iter, vpos, v.v);
+                cube_set(cube, tpos, tsize, vpos, v.v);
             }
         } else {
             for (z = 0; z < d; z++) {
@@ -121,12 +152,14 @@ static void qubicle_import(const char *path)
                         vpos[1] = pos[1] + y;
                         vpos[2] = pos[2] + z;
                         apply_orientation(orientation, vpos);
-                        mesh_set_at(layer->mesh, &iter, vpos, v.v);
+                        cube_set(cube, tpos, tsize, vpos, v.v);
                         index++;
                     }
                 }
             }
         }
+        mesh_write(layer->mesh, tpos, tsize, (uint8_t*)cube);
+        free(cube);
     }
     goxel_update_meshes(goxel, -1);
 }
@@ -71,8 +71,9 @@ static void vox_import_old(const char *path)
         memcpy(cube[i], palette[voxels[i]], 4);
     }
 
-    mesh_blit(goxel->image->active_layer->mesh, (uint8_t*)cube,
-              -w / 2, -h / 2, -d / 2, w, h, d, NULL);
+    mesh_write(goxel->image->active_layer->mesh,
+               (int[]){-w / 2, -h / 2, -d / 2}, (int[]){w, h, d},
+               (uint8_t*)cube);
     free(palette);
     free(voxels);
     free(cube);
@@ -137,10 +138,9 @@ static void vox_import(const char *path)
 {
     FILE *file;
     char magic[4];
-    int version, r, i, x, y, z, c, pos[3];
+    int version, r, i, x, y, z, c, index;
     mesh_t      *mesh;
-    mesh_iterator_t iter = {0};
-    uint8_t color[4];
+    uint8_t (*cube)[4];
     context_t ctx = {};
 
     path = path ?: noc_file_dialog_open(NOC_FILE_DIALOG_OPEN, "vox\0*.vox\0",
@@ -163,24 +163,25 @@ static void vox_import(const char *path)
     read_chunk(file, &ctx);
 
     assert(ctx.voxels);
+    cube = calloc(ctx.w * ctx.h * ctx.d, sizeof(*cube));
     for (i = 0; i < ctx.nb; i++) {
         x = ctx.voxels[i * 4 + 0];
         y = ctx.voxels[i * 4 + 1];
         z = ctx.voxels[i * 4 + 2];
         c = ctx.voxels[i * 4 + 3];
-        pos[0] = x - ctx.w / 2;
-        pos[1] = y - ctx.h / 2;
-        pos[2] = z;
         if (!c) continue; // Not sure what c == 0 means.
+        if (x >= ctx.w || y >= ctx.h || z >= ctx.d) continue;
+        index = x + y * ctx.w + z * ctx.w * ctx.h;
         if (ctx.palette)
-            memcpy(color, ctx.palette[c], 4);
+            memcpy(cube[index], ctx.palette[c], 4);
         else
-            hexcolor(VOX_DEFAULT_PALETTE[c], color);
-        mesh_set_at(mesh, &iter, pos, color);
+            hexcolor(VOX_DEFAULT_PALETTE[c], cube[index]);
     }
+    mesh_write(mesh, (int[]){-ctx.w / 2, -ctx.h / 2, 0},
+               (int[]){ctx.w, ctx.h, ctx.d}, (uint8_t*)cube);
+    free(cube);
     free(ctx.voxels);
     free(ctx.palette);
-    mesh_remove_empty_blocks(mesh, false);
     goxel_update_meshes(goxel, -1);
 }
 
@@ -115,8 +115,9 @@ static int kv6_import(const char *path)
         }
     }
 
-    mesh_blit(goxel->image->active_layer->mesh, (const uint8_t*)cube,
-              -w / 2, -h / 2, -d / 2, w, h, d, NULL);
+    mesh_write(goxel->image->active_layer->mesh,
+               (int[]){-w / 2, -h / 2, -d / 2}, (int[]){w, h, d},
+               (const uint8_t*)cube);
     goxel_update_meshes(goxel, -1);
 end:
     free(cube);
@@ -197,8 +198,9 @@ static int kvx_import(const char *path)
         }
     }
 
-    mesh_blit(goxel->image->active_layer->mesh, (uint8_t*)cube,
-              -w / 2, -h / 2, -d / 2, w, h, d, NULL);
+    mesh_write(goxel->image->active_layer->mesh,
+               (int[]){-w / 2, -h / 2, -d / 2}, (int[]){w, h, d},
+               (uint8_t*)cube);
     goxel_update_meshes(goxel, -1);
 
 end:
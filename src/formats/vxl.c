@@ -120,8 +120,9 @@ static int vxl_import(const char *path)
         }
     }
 
-    mesh_blit(goxel->image->active_layer->mesh, (uint8_t*)cube,
-              -w / 2, -h / 2, -d / 2, w, h, d, NULL);
+    mesh_write(goxel->image->active_layer->mesh,
+               (int[]){-w / 2, -h / 2, -d / 2}, (int[]){w, h, d},
+               (uint8_t*)cube);
     goxel_update_meshes(goxel, -1);
     if (box_is_null(goxel->image->box)) {
         bbox_from_extents(goxel->image->box, vec3_zero, w / 2, h / 2, d / 2);
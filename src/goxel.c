@@ -24,12 +24,13 @@ goxel_t *goxel = NULL;
 static void unpack_pos_data(uint32_t v, int pos[3], int *face,
                             int *cube_id)
 {
-    assert(BLOCK_SIZE == 16);
+    const int b = POS_DATA_BITS;
+    const int mask = (1 << b) - 1;
     int x, y, z, f, i;
-    x = v >> 28;
-    y = (v >> 24) & 0x0f;
-    z = (v >> 20) & 0x0f;
-    f = (v >> 16) & 0x0f;
+    x = v >> (32 - b);
+    y = (v >> (32 - 2 * b)) & mask;
+    z = (v >> (32 - 3 * b)) & mask;
+    f = POS_DATA_HAS_FACE ? (v >> 16) & ((1 << (16 - 3 * b)) - 1) : 0;
     i = v & 0xffff;
     assert(f < 6);
     pos[0] = x;
@@ -137,6 +138,7 @@ bool goxel_unproject_on_mesh(goxel_t *goxel, const float view[4],
     int voxel_pos[3];
     int face, block_id, block_pos[3];
     int x, y;
+    float box[4][4], p[3], n[3];
     int rect[4] = {0, 0, view_size[0], view_size[1]};
     uint8_t clear_color[4] = {0, 0, 0, 0};
 
@@ -159,6 +161,14 @@ bool goxel_unproject_on_mesh(goxel_t *goxel, const float view[4],
     out[0] = block_pos[0] + voxel_pos[0] + 0.5;
     out[1] = block_pos[1] + voxel_pos[1] + 0.5;
     out[2] = block_pos[2] + voxel_pos[2] + 0.5;
+    if (!POS_DATA_HAS_FACE) {
+        // The face is not in the pick buffer, so we get it from the
+        // intersection of the ray with the voxel.
+        bbox_from_extents(box, out, 0.5, 0.5, 0.5);
+        if (!goxel_unproject_on_box(goxel, view, pos, box, false,
+                                    p, n, &face))
+            face = 0;
+    }
     normal[0] = FACES_NORMALS[face][0];
     normal[1] = FACES_NORMALS[face][1];
     normal[2] = FACES_NORMALS[face][2];
@@ -336,6 +346,55 @@ void goxel_release(goxel_t *goxel)
     gui_release();
 }
 
+/*
+ * Background pass of blocks deduplication: at each frame we deduplicate
+ * one of the meshes of the image layers and undo history, or of the
+ * meshes we keep for the rendering.  The meshes that didn't change since
+ * the last pass are skipped immediately by mesh_dedup.
+ */
+static void dedup_iter(goxel_t *goxel)
+{
+    image_t *hist;
+    layer_t *layer;
+    mesh_t *mesh = NULL;
+    int i = 0;
+
+    if (!goxel->dedup || !goxel->image) return;
+    DL_FOREACH2(goxel->image->history, hist, history_next) {
+        DL_FOREACH(hist->layers, layer) {
+            if (i++ == goxel->dedup_cursor) mesh = layer->mesh;
+        }
+    }
+    if (i++ == goxel->dedup_cursor) mesh = goxel->layers_mesh;
+    if (i++ == goxel->dedup_cursor) mesh = goxel->render_mesh;
+    if (i++ == goxel->dedup_cursor) mesh = goxel->clipboard.mesh;
+    goxel->dedup_cursor = (goxel->dedup_cursor + 1) % i;
+    if (mesh) mesh_dedup(mesh);
+}
+
+/*
+ * Set the memory budget of the blocks (see mesh_set_paging).  The paging
+ * only evicts the data it knows about, so we also register all the meshes
+ * we already have, in case the paging just got enabled.
+ */
+bool goxel_set_paging_budget(goxel_t *goxel, int budget)
+{
+    image_t *hist;
+    layer_t *layer;
+
+    goxel->paging_budget = budget;
+    if (!mesh_set_paging(NULL, (size_t)budget << 20)) return false;
+    if (goxel->image) {
+        DL_FOREACH2(goxel->image->history, hist, history_next) {
+            DL_FOREACH(hist->layers, layer) mesh_paging_add(layer->mesh);
+        }
+    }
+    if (goxel->layers_mesh) mesh_paging_add(goxel->layers_mesh);
+    if (goxel->render_mesh) mesh_paging_add(goxel->render_mesh);
+    if (goxel->clipboard.mesh) mesh_paging_add(goxel->clipboard.mesh);
+    return true;
+}
+
 void goxel_iter(goxel_t *goxel, inputs_t *inputs)
 {
     double time = sys_get_time();
@@ -354,6 +413,8 @@ void goxel_iter(goxel_t *goxel, inputs_t *inputs)
     mat4_copy(goxel->camera.view_mat, goxel->rend.view_mat);
     mat4_copy(goxel->camera.proj_mat, goxel->rend.proj_mat);
     gui_iter(goxel, inputs);
+    dedup_iter(goxel);
+    mesh_paging_trim();
     sound_iter();
     goxel->frame_count++;
 }
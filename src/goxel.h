@@ -562,6 +562,10 @@ enum {
 typedef struct shape {
     const char *id;
     float (*func)(const float p[3], const float s[3], float smoothness);
+    // Same as func, for n positions given as arrays of x, y and z
+    // coordinates.  n must be a multiple of 8.
+    void (*func_batch)(int n, const float *x, const float *y, const float *z,
+                       const float s[3], float smoothness, float *out);
 } shape_t;
 
 void shapes_init(void);
@@ -571,12 +575,17 @@ extern shape_t shape_cylinder;
 
 
 // #### Block ##################
-// The block size can only be 16.
-#define BLOCK_SIZE 16
+// BLOCK_SIZE is defined in mesh.h.
 #define VOXEL_TEXTURE_SIZE 8
 // Number of sub position per voxel in the marching
-// cube rendering.
-#define MC_VOXEL_SUB_POS 8 // XXX: try to make it higher (up to 16!)
+// cube rendering.  The vertices positions are stored on 8 bits, so this
+// depends on the block size (8 with the default size of 16).
+#define MC_VOXEL_SUB_POS (128 / BLOCK_SIZE)
+// Number of bits used to store each coordinate of a voxel in the
+// vertices pos_data, used for picking.  With blocks of 32 there is no
+// room left for the face, that we then get from the picking ray.
+#define POS_DATA_BITS (BLOCK_SIZE == 8 ? 3 : BLOCK_SIZE == 16 ? 4 : 5)
+#define POS_DATA_HAS_FACE (3 * POS_DATA_BITS + 3 <= 16)
 
 // Structure used for the OpenGL array data of blocks.
 // XXX: we can probably make it smaller.
@@ -644,6 +653,8 @@ void mesh_get_box(const mesh_t *mesh, bool exact, float box[4][4]);
  * Apply a paint operation to a mesh.
  * This function render geometrical 3d shapes into a mesh.
  * The shape, mode and color are defined in the painter argument.
+ * The blocks are processed in parallel on the workers when there are
+ * enough of them, with the same result as a single thread.
  *
  * Parameters:
  *   mesh    - The mesh we paint into.
@@ -664,7 +675,7 @@ void mesh_extrude(mesh_t *mesh,
 /* Function: mesh_blit
  *
  * Blit voxel data into a mesh.
- * This is the fastest way to quickly put data into a mesh.
+ * Same as <mesh_write>.
  *
  * Parameters:
  *   mesh - The mesh we blit into.
@@ -675,11 +686,9 @@ void mesh_extrude(mesh_t *mesh,
  *   w    - Width of the data.
  *   h    - Height of the data.
  *   d    - Depth of the data.
- *   iter - Optional iterator for optimized access.
  */
 void mesh_blit(mesh_t *mesh, const uint8_t *data,
-               int x, int y, int z, int w, int h, int d,
-               mesh_iterator_t *iter);
+               int x, int y, int z, int w, int h, int d);
 
 void mesh_move(mesh_t *mesh, const float mat[4][4]);
 
@@ -697,6 +706,11 @@ int mesh_select(const mesh_t *mesh,
 void mesh_merge(mesh_t *mesh, const mesh_t *other, int op,
                 const uint8_t color[4]);
 
+// Merge several meshes in a single pass over their blocks, with the same
+// result as calling mesh_merge with each of them in order.
+void mesh_merge_all(mesh_t *mesh, const mesh_t *const *others, int nb,
+                    int op);
+
 int mesh_generate_vertices(const mesh_t *mesh, const int block_pos[3],
                            int effects, voxel_vertex_t *out);
 
@@ -1032,6 +1046,9 @@ void image_move_layer(image_t *img, layer_t *layer, int d);
 layer_t *image_duplicate_layer(image_t *img, layer_t *layer);
 void image_merge_visible_layers(image_t *img);
 void image_history_push(image_t *img);
+// Memory used by the blocks of an undo history step that are not shared
+// with the next step.
+size_t image_get_history_step_mem(const image_t *step);
 void image_undo(image_t *img);
 void image_redo(image_t *img);
 bool image_layer_can_edit(const image_t *img, const layer_t *layer);
@@ -1214,6 +1231,12 @@ typedef struct goxel
     double     fps;         // Average fps.
     bool       quit;        // Set to true to quit the application.
 
+    // Background deduplication of the meshes blocks (see mesh_dedup).
+    bool       dedup;
+    int        dedup_cursor; // Index of the next mesh to deduplicate.
+    // Memory budget of the blocks in MiB (see mesh_set_paging), 0 for none.
+    int        paging_budget;
+
     struct {
         gesture_t drag;
         gesture_t pan;
@@ -1254,6 +1277,8 @@ bool goxel_unproject_on_box(goxel_t *goxel, const float viewport[4],
 // Recompute the meshes.  mask from MESH_ enum.
 void goxel_update_meshes(goxel_t *goxel, int mask);
 
+bool goxel_set_paging_budget(goxel_t *goxel, int budget);
+
 void goxel_set_help_text(goxel_t *goxel, const char *msg, ...);
 void goxel_set_hint_text(goxel_t *goxel, const char *msg, ...);
 
@@ -1456,6 +1481,20 @@ void cache_add(cache_t *cache, const void *key, int keylen, void *data,
 //  the cache.
 void *cache_get(cache_t *cache, const void *key, int keylen);
 
+// ####### Workers ###############################
+// Pool of threads used to run independent tasks in parallel.
+
+// Return the number of workers, by default the number of cpu cores.
+int workers_get_count(void);
+// Set the number of workers, 0 to use the number of cpu cores.
+void workers_set_count(int nb);
+// Call func(i, worker, user) for all i in [0, n), in parallel, and return
+// once all the calls are done.  worker is the index of the worker running
+// the task (from 0 to workers_get_count() - 1), so that the tasks can use
+// per worker data.  Nested calls run on the calling thread only.
+void workers_run(int n, void (*func)(int i, int worker, void *user),
+                 void *user);
+
 // ####### Sound #################################
 void sound_init(void);
 void sound_play(const char *sound);
@@ -1467,5 +1506,14 @@ void sound_iter(void);
  * Run all the unit tests */
 void tests_run(void);
 
+/* Function: bench_run
+ * Run the mesh benchmarks and log the results.
+ *
+ * Parameters:
+ *   filter - If not NULL, only run the benchmarks whose name contains
+ *            this string.
+ */
+void bench_run(const char *filter);
+
 
 #endif // GOXEL_H
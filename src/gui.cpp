@@ -996,7 +996,16 @@ static void cameras_panel(goxel_t *goxel)
 
 static void debug_panel(goxel_t *goxel)
 {
+    image_t *hist;
+    int i = 0;
     ImGui::Text("FPS: %d", (int)round(goxel->fps));
+    if (ImGui::CollapsingHeader("History memory")) {
+        DL_FOREACH2(goxel->image->history, hist, history_next) {
+            ImGui::Text("%d%s: %zu KiB", i++,
+                        hist == goxel->image ? "*" : "",
+                        image_get_history_step_mem(hist) / 1024);
+        }
+    }
 }
 
 static void import_image_plane(goxel_t *goxel)
@@ -44,6 +44,13 @@ bool gui_settings_popup(void *data)
 
     free(names);
 
+    gui_checkbox("Deduplicate blocks", &goxel->dedup,
+                 "Share the memory of the identical blocks of all the "
+                 "layers and undo history");
+    gui_text("Memory budget (MiB, 0 for none)");
+    if (gui_input_int("##paging_budget", &goxel->paging_budget, 0, 1 << 20))
+        goxel_set_paging_budget(goxel, goxel->paging_budget);
+
     // For the moment I disable the theme editor!
 #if 0
     int group, color;
@@ -89,6 +96,15 @@ static int settings_ini_handler(void *user, const char *section,
             theme_set(value);
         }
     }
+    if (strcmp(section, "memory") == 0) {
+        if (strcmp(name, "dedup") == 0) {
+            goxel->dedup = atoi(value);
+        }
+        if (strcmp(name, "paging_budget") == 0) {
+            if (!goxel_set_paging_budget(goxel, atoi(value)))
+                LOG_W("Cannot create the paging file");
+        }
+    }
     return 0;
 }
 
@@ -112,6 +128,9 @@ static void settings_save(void)
     file = fopen(path, "w");
     fprintf(file, "[ui]\n");
     fprintf(file, "theme=%s\n", theme_get()->name);
+    fprintf(file, "[memory]\n");
+    fprintf(file, "dedup=%d\n", goxel->dedup);
+    fprintf(file, "paging_budget=%d\n", goxel->paging_budget);
     fclose(file);
     free(path);
 }
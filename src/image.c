@@ -48,16 +48,24 @@
 
 */
 
-static layer_t *img_get_layer(const image_t *img, int id)
+// Find the layer with a given id in an image, or NULL.
+static layer_t *img_find_layer(const image_t *img, int id)
 {
     layer_t *layer;
-    if (id == 0) return NULL;
     DL_FOREACH(img->layers, layer)
         if (layer->id == id) return layer;
-    assert(false);
     return NULL;
 }
 
+static layer_t *img_get_layer(const image_t *img, int id)
+{
+    layer_t *layer;
+    if (id == 0) return NULL;
+    layer = img_find_layer(img, id);
+    assert(layer);
+    return layer;
+}
+
 static int img_get_new_id(const image_t *img)
 {
     int id;
@@ -385,6 +393,42 @@ static void debug_print_history(image_t *img)
 static void debug_print_history(image_t *img) {}
 #endif
 
+/*
+ * The undo history steps that are more than HISTORY_COMPRESS_DEPTH steps
+ * behind the current image get their blocks compressed in memory, except
+ * for the blocks that didn't change since.
+ */
+#define HISTORY_COMPRESS_DEPTH 4
+
+static void history_compress(image_t *img)
+{
+    image_t *hist = img;
+    layer_t *layer, *current;
+    int i;
+
+    for (i = 0; i < HISTORY_COMPRESS_DEPTH; i++) {
+        if (hist == img->history) return;
+        hist = hist->history_prev;
+    }
+    DL_FOREACH(hist->layers, layer) {
+        current = img_find_layer(img, layer->id);
+        mesh_compress(layer->mesh, current ? current->mesh : NULL);
+    }
+}
+
+size_t image_get_history_step_mem(const image_t *step)
+{
+    const image_t *next = step->history_next;
+    const layer_t *layer, *other;
+    size_t ret = 0;
+
+    DL_FOREACH(step->layers, layer) {
+        other = next ? img_find_layer(next, layer->id) : NULL;
+        ret += mesh_get_unshared_mem(layer->mesh, other ? other->mesh : NULL);
+    }
+    return ret;
+}
+
 void image_history_push(image_t *img)
 {
     image_t *snap = image_snap(img);
@@ -404,6 +448,7 @@ void image_history_push(image_t *img)
     DL_DELETE2(img->history, img,  history_prev, history_next);
     DL_APPEND2(img->history, snap, history_prev, history_next);
     DL_APPEND2(img->history, img,  history_prev, history_next);
+    history_compress(img);
     debug_print_history(img);
 }
 
@@ -57,6 +57,8 @@ typedef struct
     char *input;
     char *export;
     float scale;
+    bool bench;
+    char *bench_filter;
 } args_t;
 
 #ifndef NO_ARGP
@@ -69,6 +71,8 @@ static char args_doc[] = "[INPUT]";
 static struct argp_option options[] = {
     {"export",   'e', "FILENAME", 0, "Export the model to a file" },
     {"scale",    's', "FLOAT", 0, "Set UI scale (for retina display)"},
+    {"bench",    'b', "NAME", OPTION_ARG_OPTIONAL,
+                 "Run the mesh benchmarks and exit"},
     {},
 };
 
@@ -85,6 +89,10 @@ static error_t parse_opt(int key, char *arg, struct argp_state *state)
     case 's':
         args->scale = atof(arg);
         break;
+    case 'b':
+        args->bench = true;
+        args->bench_filter = arg;
+        break;
     case ARGP_KEY_ARG:
         if (state->arg_num >= 1)
             argp_usage(state);
@@ -226,6 +234,11 @@ int main(int argc, char **argv)
     // Run the unit tests in debug.
     if (DEBUG) tests_run();
 
+    if (args.bench) {
+        bench_run(args.bench_filter);
+        goto end;
+    }
+
     if (args.input)
         action_exec2("import", "p", args.input);
     if (args.export) {
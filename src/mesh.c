@@ -17,10 +17,12 @@
  */
 
 #include "mesh.h"
-#include "uthash.h"
 #include <assert.h>
 #include <limits.h>
 #include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
 
 #define min(a, b) ({ \
       __typeof__ (a) _a = (a); \
@@ -39,45 +41,234 @@ enum {
     MESH_ITER_FINISHED                  = 1 << 9,
     MESH_ITER_BOX                       = 1 << 10,
     MESH_ITER_MESH2                     = 1 << 11,
+    MESH_ITER_NEIGHBORS_PHASE           = 1 << 12,
+    MESH_ITER_SORTED_UNION              = 1 << 13,
 };
 
 typedef struct block_data block_data_t;
+
+// Bits per voxel value for blocks that are not palette encoded.
+#define RAW_BITS 32
+
+// Number of 64 bits words in a block occupancy mask.
+#define MASK_SIZE (N * N * N / 64)
+
+// Number of palette indices per brick, and number of bricks per block.
+#define BRICK_VOXELS 512
+#define NB_BRICKS (N * N * N / BRICK_VOXELS)
+// Size in bytes of a brick.
+#define BRICK_SIZE(bits) (BRICK_VOXELS * (bits) / 8)
+
+typedef struct {
+    uint8_t     v[4];
+    uint16_t    count;      // Number of voxels using this color.
+} palette_entry_t;
+
+/*
+ * The voxels data of a block.
+ *
+ * Most blocks only use a handful of colors, so instead of storing the RGBA
+ * value of each voxel, we keep a small palette and, for each voxel, the
+ * index of its color in the palette, packed on 1, 2, 4 or 8 bits.  The
+ * number of bits grows as colors are added, and if a block ends up with
+ * more than 256 colors we switch to raw RGBA values (bits == RAW_BITS).
+ *
+ * Blocks where all the voxels have the same value (typically the inside of
+ * a large model, or an empty block) are 'uniform': a palette of a single
+ * color and zero bits per voxel, so no indices array at all.
+ *
+ * The indices are split into bricks of BRICK_VOXELS successive indices
+ * (8x8x8 voxels with the Morton layout, a 16x16x2 slab with the linear
+ * one).  The bricks are shared by the copies of a data, and only copied
+ * when they get modified, so that a small edit of a block shared with the
+ * undo history doesn't duplicate all of its indices.
+ *
+ * For palette blocks, the voxels array can also be allocated by
+ * mesh_get_block_data, as a decoded copy of the data, that we release at
+ * the next write.
+ *
+ * All the blocks also keep the number of non transparent voxels, and
+ * except for the uniform blocks, an occupancy mask with one bit per non
+ * transparent voxel, so that we can skip the empty parts without looking
+ * at the voxels values.
+ */
 struct block_data
 {
-    int         ref;
-    uint64_t    id;
-    uint8_t     voxels[BLOCK_SIZE * BLOCK_SIZE * BLOCK_SIZE][4]; // RGBA voxels.
+    int             ref;
+    uint64_t        id;
+    uint64_t        compact_id; // Value of id when we last compacted it.
+    uint64_t        edit_id;    // Edit session that last set the id.
+    int             bits;       // Bits per voxel, 0 for uniform blocks.
+    int             nb_colors;  // Number of entries in the palette.
+    palette_entry_t *palette;   // Allocated to 1 << bits entries.
+    uint8_t         **bricks;   // Packed palette indices, NB_BRICKS bricks.
+    uint8_t         (*voxels)[4];
+    int             nb_voxels;  // Number of non transparent voxels.
+    uint64_t        *mask;      // Occupancy mask, NULL for uniform blocks.
+    uint64_t        bbox;       // Cached packed bbox, 0 if not computed.
+    uint64_t        hash;       // Content hash, 0 if not computed.
+    bool            in_store;   // Set if the data is in the dedup store.
+    // Cold state, see mesh_set_paging and mesh_compress.
+    uint8_t         cold;       // DATA_PAGED or DATA_PACKED if not in memory.
+    uint32_t        tick;       // Paging tick of the last access.
+    union {
+        uint64_t    page;       // Offset + 1 of the copy in the spill file.
+        uint8_t     *packed;    // Compressed payload, for DATA_PACKED.
+    };
+    int             index;      // Index + 1 in the paging list, 0 if none.
 };
 
 struct block
 {
-    UT_hash_handle  hh;     // The hash table of pos -> blocks in a mesh.
     block_data_t    *data;
     int             pos[3];
-    uint64_t        id;
 };
 
+/*
+ * The blocks of a mesh are stored in a persistent table, so that copying a
+ * mesh is O(1), and the first modification after a copy only duplicates the
+ * nodes on the path to the modified block instead of the whole table.
+ *
+ * The blocks themselves live in a persistent vector, in insertion order:
+ * a trie with TABLE_WIDTH children per node, indexed by the block index.
+ * The block positions are indexed by a hash array mapped trie (HAMT) that
+ * maps the packed positions to the blocks indices.  Each HAMT node only
+ * stores the entries present, and a bitmap of them.
+ *
+ * All the nodes are reference counted.  A node can be modified in place
+ * only if it's referenced once and all its parents too, otherwise we copy
+ * it first, and the copy takes a new reference to each of its children.
+ *
+ * Blocks are never removed one by one: we always filter all the blocks and
+ * rebuild the tries.
+ *
+ * On top of that we keep a second HAMT of 'superblocks': groups of 4x4x4
+ * blocks with one bit per block present in the table.  This is used by the
+ * box iterators to skip the empty regions without looking up each block
+ * position.
+ *
+ * We also remember if the blocks happen to be in Morton order, as after
+ * mesh_sort_blocks, or if they were added in that order.  The union of
+ * sorted tables can then be iterated with a simple merge.
+ */
+#define TABLE_BITS 6
+#define TABLE_WIDTH (1 << TABLE_BITS)
+
+typedef struct table_node table_node_t;
+struct table_node
+{
+    int ref;
+    int nb;     // Number of children or blocks.
+    union {
+        table_node_t    *children[TABLE_WIDTH];
+        block_t         blocks[TABLE_WIDTH]; // Only for the leaves.
+    };
+};
+
+typedef struct table_map table_map_t;
+
+typedef struct {
+    uint64_t key;
+    union {
+        uint64_t    value;
+        table_map_t *node;
+    };
+} table_map_entry_t;
+
+struct table_map
+{
+    int         ref;
+    uint64_t    bitmap;     // Entries present in the node.
+    uint64_t    nodes;      // Entries that are sub nodes.
+    table_map_entry_t entries[]; // One per bit set in the bitmap.
+};
+
+typedef struct table
+{
+    int             ref;        // Used to implement copy on write.
+    uint64_t        id;         // Changed every time the blocks move.
+    int             nb;         // Number of blocks.
+    int             depth;      // Number of levels above the leaves.
+    bool            unsorted;   // Set if the blocks are not in Morton order.
+    table_node_t    *blocks;    // Root of the blocks vector.
+    table_map_t     *slots;     // Packed position -> block index.
+    table_map_t     *supers;    // Packed superblock position -> mask.
+} table_t;
+
 struct mesh
 {
-    block_t *blocks;
-    int *ref;   // Used to implement copy on write of the blocks.
+    table_t *table; // Can be NULL if the mesh has no blocks.
     uint64_t key; // Two meshes with the same key have the same value.
+    // Edit session, see mesh_begin_edit.  Inside a session the key is set
+    // to zero after a modification, and only updated when we need it.
+    int edit_depth;
+    uint64_t edit_id;
+    // Cached exact bounding box, valid if bbox_key is equal to the key.
+    uint64_t bbox_key;
+    int bbox[2][3];
+    uint64_t dedup_key; // Value of the key after the last mesh_dedup.
 };
 
 static uint64_t g_uid = 2; // Global id counter.
 
+/*
+ * Atomic operations, so that meshes sharing some data can be used from
+ * different threads.  See the concurrency notes in mesh.h.
+ */
+#define ATOMIC_INC(x) __atomic_add_fetch(&(x), 1, __ATOMIC_RELAXED)
+#define ATOMIC_DEC(x) __atomic_sub_fetch(&(x), 1, __ATOMIC_ACQ_REL)
+#define ATOMIC_GET(x) __atomic_load_n(&(x), __ATOMIC_ACQUIRE)
+#define ATOMIC_CAS(x, expected, v) __atomic_compare_exchange_n( \
+        &(x), &(expected), v, false, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)
+
+static uint64_t new_uid(void)
+{
+    return __atomic_add_fetch(&g_uid, 1, __ATOMIC_RELAXED);
+}
+
 #define N BLOCK_SIZE
 
 #define vec3_copy(a, b) do {b[0] = a[0]; b[1] = a[1]; b[2] = a[2];} while (0)
 #define vec3_equal(a, b) (b[0] == a[0] && b[1] == a[1] && b[2] == a[2])
 
-#define BLOCK_ITER(x, y, z) \
-    for (z = 0; z < N; z++) \
-        for (y = 0; y < N; y++) \
-            for (x = 0; x < N; x++)
+/*
+ * Order of the palette indices inside a block, selected at compile time
+ * with BLOCK_LAYOUT (scons block_layout=N):
+ *
+ *   0 - Linear, x major.
+ *   1 - Morton (Z-order) curve.
+ *   2 - Bricks of 4x4x4 voxels, the bricks and the voxels inside them
+ *       being in linear order.
+ *
+ * This is experimental: the voxels arrays (raw blocks and decoded data)
+ * and the occupancy masks always use the linear order, since this is what
+ * mesh_read and mesh_get_block_data return.
+ */
+// Insert two zero bits between each bit of a 21 bits value.
+static inline uint64_t spread_bits(uint64_t x)
+{
+    x &= 0x1fffff;
+    x = (x | (x << 32)) & 0x1f00000000ffffULL;
+    x = (x | (x << 16)) & 0x1f0000ff0000ffULL;
+    x = (x | (x << 8)) & 0x100f00f00f00f00fULL;
+    x = (x | (x << 4)) & 0x10c30c30c30c30c3ULL;
+    x = (x | (x << 2)) & 0x1249249249249249ULL;
+    return x;
+}
+
+#if BLOCK_LAYOUT == 0
+#   define DATA_INDEX(x, y, z) ((x) + (y) * N + (z) * N * N)
+#elif BLOCK_LAYOUT == 1
+#   define DATA_INDEX(x, y, z) \
+        (spread_bits(x) | spread_bits(y) << 1 | spread_bits(z) << 2)
+#elif BLOCK_LAYOUT == 2
+#   define DATA_INDEX(x, y, z) \
+        (((x) & 3) + ((y) & 3) * 4 + ((z) & 3) * 16 + \
+         ((x) / 4 + (y) / 4 * (N / 4) + (z) / 4 * (N / 4) * (N / 4)) * 64)
+#endif
 
-#define DATA_AT(d, x, y, z) (d->voxels[x + y * N + z * N * N])
-#define BLOCK_AT(c, x, y, z) (DATA_AT(c->data, x, y, z))
+// Convert a linear voxel index into a palette index position.
+#define DATA_INDEX_LINEAR(i) DATA_INDEX((i) % N, (i) / N % N, (i) / (N * N))
 
 static void mat4_mul_vec4(float mat[4][4], const float v[4], float out[4])
 {
@@ -127,100 +318,1824 @@ static void bbox_intersection(int a[2][3], int b[2][3], int out[2][3])
     }
 }
 
-static block_data_t *get_empty_data(void)
+/*
+ * Pool allocator for the blocks data.
+ *
+ * Editing a mesh allocates and releases a lot of blocks data of only a
+ * few different sizes, so instead of going through malloc every time, we
+ * round the sizes up to a power of two and keep a pool of fixed size
+ * objects for each size.
+ *
+ * The objects are allocated by slabs, each slab keeping its own free list,
+ * so that we can give the memory back to the system as soon as all the
+ * objects of a slab are released.  Each object is preceded by a pointer to
+ * its slab.
+ *
+ * The pools are shared by all the threads, and protected by a spin lock.
+ *
+ * Objects can also be shared, with pool_ref and pool_unref.  Their
+ * reference counts are kept in an array of the slab, only allocated the
+ * first time one of its objects gets shared, so that the objects don't need
+ * any header.  This is used for the bricks of the blocks data.
+ */
+#define POOL_MIN_SIZE 16
+#define NB_POOLS 14 // From 16 bytes to 128 KiB.
+#define SLAB_SIZE (256 * 1024)
+
+typedef struct pool pool_t;
+typedef struct slab slab_t;
+
+struct slab
+{
+    pool_t      *pool;
+    slab_t      *prev, *next;   // List of the pool slabs with free objects.
+    void        *free_list;     // Released objects.
+    int         nb_used;
+    int         nb_init;        // Number of objects used at least once.
+    int         *refs;          // Extra references of each object, or NULL.
+};
+
+struct pool
+{
+    int         size;           // Size of the objects.
+    int         nb_per_slab;
+    slab_t      *slabs;         // Slabs that have some free objects.
+};
+
+static pool_t g_pools[NB_POOLS];
+static bool g_pool_lock = false;
+
+static struct {
+    int         nb_datas;       // Number of live block data.
+    size_t      used;           // Bytes used by the live objects.
+    size_t      allocated;      // Bytes allocated for the slabs.
+    size_t      peak;           // Peak value of allocated.
+} g_pool_stats;
+
+static void pool_lock(void)
+{
+    while (__atomic_test_and_set(&g_pool_lock, __ATOMIC_ACQUIRE)) {}
+}
+
+static void pool_unlock(void)
+{
+    __atomic_clear(&g_pool_lock, __ATOMIC_RELEASE);
+}
+
+// Return the index of the pool used for a given size.
+static int pool_index(size_t size)
+{
+    int i = 0;
+    if (size > POOL_MIN_SIZE)
+        i = 32 - __builtin_clz(size - 1) - __builtin_ctz(POOL_MIN_SIZE);
+    assert(i < NB_POOLS);
+    return i;
+}
+
+// Must be called with the lock held.
+static pool_t *get_pool(size_t size)
 {
-    static block_data_t *data = NULL;
-    if (!data) {
-        data = calloc(1, sizeof(*data));
-        data->ref = 1;
-        data->id = 0;
+    int i = pool_index(size);
+    pool_t *pool = &g_pools[i];
+    if (!pool->size) {
+        pool->size = POOL_MIN_SIZE << i;
+        pool->nb_per_slab = max(8, SLAB_SIZE / (pool->size + sizeof(void*)));
     }
-    return data;
+    return pool;
 }
 
-static bool block_is_empty(const block_t *block, bool fast)
+static void slab_unlink(pool_t *pool, slab_t *slab)
 {
-    int x, y, z;
-    if (!block) return true;
-    if (block->data->id == 0) return true;
-    if (fast) return false;
+    if (slab->prev) slab->prev->next = slab->next;
+    else pool->slabs = slab->next;
+    if (slab->next) slab->next->prev = slab->prev;
+    slab->prev = slab->next = NULL;
+}
+
+static void slab_link(pool_t *pool, slab_t *slab)
+{
+    slab->prev = NULL;
+    slab->next = pool->slabs;
+    if (pool->slabs) pool->slabs->prev = slab;
+    pool->slabs = slab;
+}
+
+static size_t slab_get_size(const pool_t *pool)
+{
+    return sizeof(slab_t) + pool->nb_per_slab * (pool->size + sizeof(void*));
+}
+
+// Index of an object in its slab.
+static int slab_get_index(const slab_t *slab, const void *ptr)
+{
+    return ((const char*)ptr - sizeof(void*) - (const char*)(slab + 1)) /
+           (slab->pool->size + sizeof(void*));
+}
 
-    BLOCK_ITER(x, y, z) {
-        if (BLOCK_AT(block, x, y, z)[3]) return false;
+static void *pool_alloc(size_t size)
+{
+    pool_t *pool;
+    slab_t *slab;
+    void **obj;
+
+    pool_lock();
+    pool = get_pool(size);
+    slab = pool->slabs;
+    if (!slab) {
+        slab = calloc(1, slab_get_size(pool));
+        slab->pool = pool;
+        slab_link(pool, slab);
+        g_pool_stats.allocated += slab_get_size(pool);
+        g_pool_stats.peak = max(g_pool_stats.peak, g_pool_stats.allocated);
     }
-    return true;
+    if (slab->free_list) {
+        obj = slab->free_list;
+        slab->free_list = *(void**)obj;
+    } else {
+        obj = (void*)((char*)(slab + 1) +
+                      slab->nb_init++ * (pool->size + sizeof(void*)));
+        *obj++ = slab;
+    }
+    if (++slab->nb_used == pool->nb_per_slab) slab_unlink(pool, slab);
+    g_pool_stats.used += pool->size;
+    pool_unlock();
+    return obj;
 }
 
-static block_t *block_new(const int pos[3])
+static void *pool_calloc(size_t size)
 {
-    block_t *block = calloc(1, sizeof(*block));
-    memcpy(block->pos, pos, sizeof(block->pos));
-    block->data = get_empty_data();
-    block->data->ref++;
-    block->id = g_uid++;
-    return block;
+    void *ret = pool_alloc(size);
+    memset(ret, 0, size);
+    return ret;
 }
 
-static void block_delete(block_t *block)
+static void pool_free(void *ptr)
 {
-    block->data->ref--;
-    if (block->data->ref == 0) {
-        free(block->data);
+    slab_t *slab;
+    pool_t *pool;
+    if (!ptr) return;
+    pool_lock();
+    slab = ((slab_t**)ptr)[-1];
+    pool = slab->pool;
+    if (slab->nb_used == pool->nb_per_slab) slab_link(pool, slab);
+    *(void**)ptr = slab->free_list;
+    slab->free_list = ptr;
+    slab->nb_used--;
+    g_pool_stats.used -= pool->size;
+    // Release the slab, unless it's the last one with free objects.
+    if (slab->nb_used == 0 && (slab->prev || slab->next)) {
+        slab_unlink(pool, slab);
+        g_pool_stats.allocated -= slab_get_size(pool);
+        if (slab->refs)
+            g_pool_stats.allocated -= pool->nb_per_slab * sizeof(int);
+        free(slab->refs);
+        free(slab);
     }
-    free(block);
+    pool_unlock();
 }
 
-static block_t *block_copy(const block_t *other)
+// Add a reference to a pool object.
+static void pool_ref(void *ptr)
 {
-    block_t *block = malloc(sizeof(*block));
-    *block = *other;
-    memset(&block->hh, 0, sizeof(block->hh));
-    block->data->ref++;
-    block->id = g_uid++;
-    return block;
+    slab_t *slab = ((slab_t**)ptr)[-1];
+    int *refs = ATOMIC_GET(slab->refs);
+    if (!refs) {
+        pool_lock();
+        if (!slab->refs) {
+            refs = calloc(slab->pool->nb_per_slab, sizeof(int));
+            __atomic_store_n(&slab->refs, refs, __ATOMIC_RELEASE);
+            g_pool_stats.allocated += slab->pool->nb_per_slab * sizeof(int);
+        }
+        refs = slab->refs;
+        pool_unlock();
+    }
+    ATOMIC_INC(refs[slab_get_index(slab, ptr)]);
 }
 
-static void block_set_data(block_t *block, block_data_t *data)
+// Release a reference to a pool object, freeing it if it was the last one.
+static void pool_unref(void *ptr)
 {
-    block->data->ref--;
-    if (block->data->ref == 0) {
-        free(block->data);
+    slab_t *slab;
+    int *refs, i;
+    if (!ptr) return;
+    slab = ((slab_t**)ptr)[-1];
+    refs = ATOMIC_GET(slab->refs);
+    if (refs) {
+        i = slab_get_index(slab, ptr);
+        if (__atomic_fetch_sub(&refs[i], 1, __ATOMIC_ACQ_REL) > 0) return;
+        refs[i] = 0;
     }
-    block->data = data;
-    data->ref++;
+    pool_free(ptr);
 }
 
-// Copy the data if there are any other blocks having reference to it.
-static void block_prepare_write(block_t *block)
+// Return the number of references to a pool object.
+static int pool_get_refs(const void *ptr)
+{
+    const slab_t *slab = ((slab_t**)ptr)[-1];
+    int *refs = ATOMIC_GET(slab->refs);
+    return refs ? ATOMIC_GET(refs[slab_get_index(slab, ptr)]) + 1 : 1;
+}
+
+static void *pool_realloc(void *ptr, size_t size)
+{
+    void *ret;
+    int old_size;
+    if (!ptr) return pool_alloc(size);
+    // Objects are only ever reallocated by the thread that owns them, so
+    // we don't need the lock to get their size.
+    old_size = ((slab_t**)ptr)[-1]->pool->size;
+    if ((POOL_MIN_SIZE << pool_index(size)) == old_size) return ptr;
+    ret = pool_alloc(size);
+    memcpy(ret, ptr, min(size, old_size));
+    pool_free(ptr);
+    return ret;
+}
+
+/*
+ * Cold blocks data.
+ *
+ * The payload of a data (occupancy mask, palette and indices, or raw
+ * voxels) can be moved out of memory, keeping only the block_data_t, until
+ * the next access to its voxels.  This is done in two ways:
+ *
+ * - Paging to a spill file, see mesh_set_paging.  When the paging is
+ *   enabled, all the new data are added to a global list, so that we can
+ *   evict the least recently used ones when we go over the budget.  The
+ *   file is split into slots of power of two sizes, with a free list for
+ *   each size.  A data read back keeps its slot until it gets modified, so
+ *   that evicting it again doesn't need to write anything.
+ *
+ * - Compression in memory, see mesh_compress, using a simple run length
+ *   encoding, which works well enough on the palette indices.
+ *
+ * Any thread can bring back a data, under the paging lock.  Making a data
+ * cold is only done when no other thread can access it: in
+ * mesh_paging_trim and mesh_compress, or by mesh_write on the data it
+ * just created.
+ */
+#define PAGING_MIN_SLOT 64
+#define PAGING_NB_CLASSES 16 // Up to 2 MiB slots.
+
+// Where the payload of a cold data is.
+enum {
+    DATA_PAGED = 1,     // In the spill file.
+    DATA_PACKED,        // Compressed in memory.
+};
+
+// Free slots of a given size in the spill file.
+typedef struct {
+    uint64_t        *offsets;
+    int             nb;
+    int             allocated;
+} paging_slots_t;
+
+static struct {
+    bool            enabled;
+    bool            lock;
+    FILE            *file;
+    size_t          budget;     // Zero for no limit.
+    uint32_t        tick;       // Incremented at each trim.
+    block_data_t    **datas;    // All the data created since enabled.
+    int             nb_datas;
+    int             allocated;
+    uint64_t        file_size;
+    int             nb_paged;   // Number of data currently paged out.
+    paging_slots_t  free_slots[PAGING_NB_CLASSES];
+} g_paging;
+
+static void paging_lock(void)
+{
+    while (__atomic_test_and_set(&g_paging.lock, __ATOMIC_ACQUIRE)) {}
+}
+
+static void paging_unlock(void)
+{
+    __atomic_clear(&g_paging.lock, __ATOMIC_RELEASE);
+}
+
+static bool paging_is_enabled(void)
+{
+    return __atomic_load_n(&g_paging.enabled, __ATOMIC_RELAXED);
+}
+
+// Test if the blocks data use more memory than a fraction of the budget.
+static bool paging_over_budget(int num, int den)
+{
+    bool ret;
+    if (!g_paging.budget) return false;
+    pool_lock();
+    ret = g_pool_stats.used > g_paging.budget / den * num;
+    pool_unlock();
+    return ret;
+}
+
+// Size of the payload of a data.
+static int data_get_payload_size(const block_data_t *data)
+{
+    int ret = MASK_SIZE * sizeof(*data->mask);
+    if (data->bits == RAW_BITS) return ret + N * N * N * 4;
+    return ret + (1 << data->bits) * sizeof(*data->palette) +
+           N * N * N * data->bits / 8;
+}
+
+// Copy the payload of a data into a buffer of the payload size.
+static void data_save_payload(const block_data_t *data, uint8_t *buf)
 {
-    if (block->data->ref == 1) {
-        block->data->id = ++g_uid;
+    int i, n = MASK_SIZE * sizeof(*data->mask);
+    memcpy(buf, data->mask, n);
+    buf += n;
+    if (data->bits == RAW_BITS) {
+        memcpy(buf, data->voxels, N * N * N * 4);
         return;
     }
-    block->data->ref--;
-    block_data_t *data;
-    data = calloc(1, sizeof(*block->data));
-    memcpy(data->voxels, block->data->voxels, N * N * N * 4);
-    data->ref = 1;
-    block->data = data;
-    block->data->id = ++g_uid;
+    n = (1 << data->bits) * sizeof(*data->palette);
+    memcpy(buf, data->palette, n);
+    buf += n;
+    for (i = 0; i < NB_BRICKS; i++)
+        memcpy(buf + i * BRICK_SIZE(data->bits), data->bricks[i],
+               BRICK_SIZE(data->bits));
 }
 
-static void block_get_at(const block_t *block, const int pos[3],
-                         uint8_t out[4])
+// Allocate the payload of a data from a buffer set by data_save_payload.
+static void data_restore_payload(block_data_t *data, const uint8_t *buf)
 {
-    int x, y, z;
-    if (!block) {
-        memset(out, 0, 4);
+    int i, n = MASK_SIZE * sizeof(*data->mask);
+    data->mask = pool_alloc(n);
+    memcpy(data->mask, buf, n);
+    buf += n;
+    if (data->bits == RAW_BITS) {
+        data->voxels = pool_alloc(N * N * N * 4);
+        memcpy(data->voxels, buf, N * N * N * 4);
         return;
     }
-    x = pos[0] - block->pos[0];
-    y = pos[1] - block->pos[1];
-    z = pos[2] - block->pos[2];
-    assert(x >= 0 && x < N);
-    assert(y >= 0 && y < N);
-    assert(z >= 0 && z < N);
-    memcpy(out, BLOCK_AT(block, x, y, z), 4);
+    n = (1 << data->bits) * sizeof(*data->palette);
+    data->palette = pool_alloc(n);
+    memcpy(data->palette, buf, n);
+    buf += n;
+    data->bricks = pool_alloc(NB_BRICKS * sizeof(*data->bricks));
+    for (i = 0; i < NB_BRICKS; i++) {
+        data->bricks[i] = pool_alloc(BRICK_SIZE(data->bits));
+        memcpy(data->bricks[i], buf + i * BRICK_SIZE(data->bits),
+               BRICK_SIZE(data->bits));
+    }
+}
+
+// Allocate the bricks of palette indices, set to zero.
+static uint8_t **bricks_new(int bits)
+{
+    int i;
+    uint8_t **bricks = pool_alloc(NB_BRICKS * sizeof(*bricks));
+    for (i = 0; i < NB_BRICKS; i++)
+        bricks[i] = pool_calloc(BRICK_SIZE(bits));
+    return bricks;
+}
+
+static void bricks_release(uint8_t **bricks)
+{
+    int i;
+    if (!bricks) return;
+    for (i = 0; i < NB_BRICKS; i++) pool_unref(bricks[i]);
+    pool_free(bricks);
+}
+
+static void data_free_payload(block_data_t *data)
+{
+    pool_free(data->mask);
+    pool_free(data->palette);
+    bricks_release(data->bricks);
+    pool_free(data->voxels);
+    data->mask = NULL;
+    data->palette = NULL;
+    data->bricks = NULL;
+    data->voxels = NULL;
+}
+
+/*
+ * PackBits run length encoding.  Each run starts with a header byte h:
+ * if h < 128 it is followed by h + 1 literal bytes, otherwise by a single
+ * byte repeated 257 - h times.  Return the encoded size, or -1 if it
+ * would be bigger than max.
+ */
+static int rle_encode(const uint8_t *src, int size, uint8_t *dst, int max)
+{
+    int i = 0, n, ret = 0;
+    while (i < size) {
+        for (n = 1; i + n < size && n < 128 && src[i + n] == src[i]; n++) {}
+        if (n >= 2) {
+            if (ret + 2 > max) return -1;
+            dst[ret++] = 257 - n;
+            dst[ret++] = src[i];
+            i += n;
+            continue;
+        }
+        // Literal bytes until the next repeated bytes.
+        for (n = 1; i + n < size && n < 128; n++) {
+            if (i + n + 1 < size && src[i + n] == src[i + n + 1]) break;
+        }
+        if (ret + 1 + n > max) return -1;
+        dst[ret++] = n - 1;
+        memcpy(dst + ret, src + i, n);
+        ret += n;
+        i += n;
+    }
+    return ret;
+}
+
+static void rle_decode(const uint8_t *src, uint8_t *dst, int size)
+{
+    int i = 0, n;
+    while (i < size) {
+        if (*src < 128) {
+            n = *src++ + 1;
+            memcpy(dst + i, src, n);
+            src += n;
+        } else {
+            n = 257 - *src++;
+            memset(dst + i, *src++, n);
+        }
+        i += n;
+    }
+}
+
+// Return the free slots list for the payload of a data.
+static paging_slots_t *paging_get_slots(const block_data_t *data, int *size)
+{
+    int c = 0;
+    while (PAGING_MIN_SLOT << c < data_get_payload_size(data)) c++;
+    assert(c < PAGING_NB_CLASSES);
+    if (size) *size = PAGING_MIN_SLOT << c;
+    return &g_paging.free_slots[c];
+}
+
+static void paging_add(block_data_t *data)
+{
+    if (!paging_is_enabled()) return;
+    paging_lock();
+    if (data->index) { // Already added, see mesh_paging_add.
+        paging_unlock();
+        return;
+    }
+    if (g_paging.nb_datas == g_paging.allocated) {
+        g_paging.allocated = max(1024, g_paging.allocated * 2);
+        g_paging.datas = realloc(g_paging.datas,
+                                 g_paging.allocated * sizeof(*g_paging.datas));
+    }
+    g_paging.datas[g_paging.nb_datas++] = data;
+    data->index = g_paging.nb_datas;
+    paging_unlock();
+}
+
+// Give back the spill file slot of a data.  Must be called with the lock.
+static void paging_free_slot(block_data_t *data)
+{
+    paging_slots_t *slots;
+    if (!data->page || data->cold == DATA_PACKED) return;
+    slots = paging_get_slots(data, NULL);
+    if (slots->nb == slots->allocated) {
+        slots->allocated = max(64, slots->allocated * 2);
+        slots->offsets = realloc(slots->offsets,
+                                 slots->allocated * sizeof(*slots->offsets));
+    }
+    slots->offsets[slots->nb++] = data->page - 1;
+    data->page = 0;
+}
+
+// Remove a released data from the paging list.
+static void paging_remove(block_data_t *data)
+{
+    block_data_t *last;
+    if (!paging_is_enabled()) return;
+    paging_lock();
+    if (!data->index) { // Created before the paging was enabled.
+        paging_unlock();
+        return;
+    }
+    last = g_paging.datas[--g_paging.nb_datas];
+    g_paging.datas[data->index - 1] = last;
+    last->index = data->index;
+    paging_free_slot(data);
+    if (data->cold == DATA_PAGED) g_paging.nb_paged--;
+    paging_unlock();
+}
+
+// Write the payload of a data into a new slot of the spill file.
+static bool paging_write(block_data_t *data)
+{
+    int size;
+    paging_slots_t *slots = paging_get_slots(data, &size);
+    uint8_t *buf;
+    bool ok;
+
+    if (slots->nb) {
+        data->page = slots->offsets[--slots->nb] + 1;
+    } else {
+        data->page = g_paging.file_size + 1;
+        g_paging.file_size += size;
+    }
+    size = data_get_payload_size(data);
+    buf = malloc(size);
+    data_save_payload(data, buf);
+    ok = fseeko(g_paging.file, data->page - 1, SEEK_SET) == 0 &&
+         fwrite(buf, size, 1, g_paging.file) == 1;
+    free(buf);
+    if (!ok) paging_free_slot(data);
+    return ok;
+}
+
+/*
+ * Evict the payload of a data to the spill file.  No other thread should
+ * be able to access the data at the same time.  If the write fails, the
+ * data just stays in memory.
+ */
+static void data_page_out(block_data_t *data)
+{
+    assert(data->bits && !data->cold);
+    paging_lock();
+    if (!data->page && !paging_write(data)) {
+        paging_unlock();
+        return;
+    }
+    data_free_payload(data);
+    g_paging.nb_paged++;
+    __atomic_store_n(&data->cold, DATA_PAGED, __ATOMIC_RELEASE);
+    paging_unlock();
+}
+
+/*
+ * Compress the payload of a data in memory, if it's worth it.  No other
+ * thread should be able to access the data at the same time.
+ */
+static void data_pack(block_data_t *data)
+{
+    int size, n;
+    uint8_t *buf;
+
+    if (!data->bits || data->cold) return;
+    size = data_get_payload_size(data);
+    buf = malloc(size * 2);
+    data_save_payload(data, buf);
+    // Only keep the result if it saves at least half of the memory.
+    n = rle_encode(buf, size, buf + size, size / 2 - sizeof(int));
+    if (n >= 0) {
+        paging_lock();
+        paging_free_slot(data);
+        data_free_payload(data);
+        data->packed = pool_alloc(sizeof(int) + n);
+        memcpy(data->packed, &n, sizeof(int));
+        memcpy(data->packed + sizeof(int), buf + size, n);
+        __atomic_store_n(&data->cold, DATA_PACKED, __ATOMIC_RELEASE);
+        paging_unlock();
+    }
+    free(buf);
+}
+
+// Bring back the payload of a cold data.
+static void data_warm_up(block_data_t *data)
+{
+    int size;
+    uint8_t *buf;
+    bool ok = true;
+
+    paging_lock();
+    if (!data->cold) { // Another thread did it.
+        paging_unlock();
+        return;
+    }
+    size = data_get_payload_size(data);
+    buf = malloc(size);
+    if (data->cold == DATA_PACKED) {
+        rle_decode(data->packed + sizeof(int), buf, size);
+        pool_free(data->packed);
+        data->packed = NULL;
+    } else {
+        ok = fseeko(g_paging.file, data->page - 1, SEEK_SET) == 0 &&
+             fread(buf, size, 1, g_paging.file) == 1;
+        // We can't recover from losing some blocks.
+        if (!ok) abort();
+        g_paging.nb_paged--;
+    }
+    data_restore_payload(data, buf);
+    free(buf);
+    __atomic_store_n(&data->cold, 0, __ATOMIC_RELEASE);
+    paging_unlock();
+}
+
+// Make sure the payload of a data is in memory, and mark it as used.
+static inline void data_load(const block_data_t *data)
+{
+    block_data_t *d = (block_data_t*)data;
+    uint32_t tick;
+    if (paging_is_enabled()) {
+        tick = __atomic_load_n(&g_paging.tick, __ATOMIC_RELAXED);
+        if (__atomic_load_n(&d->tick, __ATOMIC_RELAXED) != tick)
+            __atomic_store_n(&d->tick, tick, __ATOMIC_RELAXED);
+    }
+    if (ATOMIC_GET(d->cold)) data_warm_up(d);
+}
+
+// Return the number of bits per voxel needed for a palette of a given size.
+static int palette_bits(int nb_colors)
+{
+    if (nb_colors <= 1) return 0;
+    if (nb_colors <= 2) return 1;
+    if (nb_colors <= 4) return 2;
+    if (nb_colors <= 16) return 4;
+    return 8;
+}
+
+static int data_get_index(const block_data_t *data, int i)
+{
+    const uint8_t *brick;
+    int bit = (i % BRICK_VOXELS) * data->bits;
+    if (data->bits == 0) return 0;
+    brick = data->bricks[i / BRICK_VOXELS];
+    return (brick[bit / 8] >> (bit % 8)) & ((1 << data->bits) - 1);
+}
+
+// Set a palette index.  Its brick should not be shared, see data_own_brick.
+static void data_set_index(block_data_t *data, int i, int index)
+{
+    uint8_t *brick = data->bricks[i / BRICK_VOXELS];
+    int bit = (i % BRICK_VOXELS) * data->bits;
+    uint8_t mask = ((1 << data->bits) - 1) << (bit % 8);
+    brick[bit / 8] = (brick[bit / 8] & ~mask) | (index << (bit % 8));
+}
+
+// Copy the brick of the palette index i if it is shared with other data.
+static void data_own_brick(block_data_t *data, int i)
+{
+    uint8_t **brick = &data->bricks[i / BRICK_VOXELS];
+    uint8_t *copy;
+    if (pool_get_refs(*brick) == 1) return;
+    copy = pool_alloc(BRICK_SIZE(data->bits));
+    memcpy(copy, *brick, BRICK_SIZE(data->bits));
+    pool_unref(*brick);
+    *brick = copy;
+}
+
+// Memory used by a data, the shared bricks being divided by their number
+// of owners.
+static size_t data_get_size(const block_data_t *data)
+{
+    size_t ret = sizeof(*data);
+    int cold = ATOMIC_GET(data->cold), n, i;
+    if (cold == DATA_PAGED) return ret;
+    if (cold == DATA_PACKED) {
+        memcpy(&n, data->packed, sizeof(n));
+        return ret + sizeof(n) + n;
+    }
+    if (ATOMIC_GET(data->voxels)) ret += N * N * N * 4;
+    if (data->mask) ret += MASK_SIZE * sizeof(*data->mask);
+    if (data->bits == RAW_BITS) return ret;
+    ret += (1 << data->bits) * sizeof(*data->palette);
+    if (!data->bits) return ret;
+    ret += NB_BRICKS * sizeof(*data->bricks);
+    for (i = 0; i < NB_BRICKS; i++)
+        ret += BRICK_SIZE(data->bits) / pool_get_refs(data->bricks[i]);
+    return ret;
+}
+
+// Set the data to the uniform representation.
+static void data_set_uniform(block_data_t *data, const uint8_t v[4])
+{
+    bricks_release(data->bricks);
+    pool_free(data->voxels);
+    pool_free(data->mask);
+    data->bricks = NULL;
+    data->voxels = NULL;
+    data->mask = NULL;
+    data->bits = 0;
+    data->nb_colors = 1;
+    data->palette = pool_realloc(data->palette, sizeof(*data->palette));
+    memcpy(data->palette[0].v, v, 4);
+    data->palette[0].count = N * N * N;
+    data->nb_voxels = v[3] ? N * N * N : 0;
+    data->bbox = 0;
+}
+
+// Compute the occupancy mask and the voxels count from RGBA values.
+static void data_set_mask(block_data_t *data, const uint8_t (*voxels)[4])
+{
+    int i;
+    if (!data->mask) data->mask = pool_alloc(MASK_SIZE * sizeof(*data->mask));
+    memset(data->mask, 0, MASK_SIZE * sizeof(*data->mask));
+    data->nb_voxels = 0;
+    data->bbox = 0;
+    for (i = 0; i < N * N * N; i++) {
+        if (!voxels[i][3]) continue;
+        data->mask[i / 64] |= 1ULL << (i % 64);
+        data->nb_voxels++;
+    }
+}
+
+// Update the occupancy mask after voxel i changed from value a to b.
+static void data_update_mask(block_data_t *data, int i,
+                             const uint8_t a[4], const uint8_t b[4])
+{
+    if (!data->mask) { // The block was uniform.
+        data->mask = pool_alloc(MASK_SIZE * sizeof(*data->mask));
+        memset(data->mask, a[3] ? 0xff : 0,
+               MASK_SIZE * sizeof(*data->mask));
+    }
+    if (!a[3] == !b[3]) return;
+    data->mask[i / 64] ^= 1ULL << (i % 64);
+    data->nb_voxels += b[3] ? 1 : -1;
+    data->bbox = 0;
+}
+
+/*
+ * Get the bounding box of the non transparent voxels of a block data,
+ * relative to the block position.  The data should not be empty.
+ *
+ * The box is computed from the occupancy mask and then cached into the
+ * data.  Since the data can be shared by several meshes, the cache is
+ * set with an atomic operation, all the threads computing the same value.
+ */
+static void data_get_bbox(const block_data_t *data, int bbox[2][3])
+{
+    uint64_t packed = ATOMIC_GET(data->bbox), w, row, rows = 0;
+    int ret[2][3] = {{N, N, N}, {0, 0, 0}};
+    int i, k, r, y, z;
+
+    assert(data->nb_voxels);
+    if (!data->bits) { // Uniform block.
+        memcpy(bbox, (int[2][3]){{0, 0, 0}, {N, N, N}}, sizeof(ret));
+        return;
+    }
+    if (!packed) {
+        data_load(data);
+        for (k = 0; k < MASK_SIZE; k++) {
+            if (!(w = data->mask[k])) continue;
+            for (r = 0; r < 64 / N; r++) {
+                row = (w >> (r * N)) & ((1ULL << N) - 1);
+                if (!row) continue;
+                rows |= row;
+                y = (k * 64 / N + r) % N;
+                z = (k * 64 + r * N) / (N * N);
+                ret[0][1] = min(ret[0][1], y);
+                ret[1][1] = max(ret[1][1], y + 1);
+                ret[0][2] = min(ret[0][2], z);
+                ret[1][2] = max(ret[1][2], z + 1);
+            }
+        }
+        ret[0][0] = __builtin_ctzll(rows);
+        ret[1][0] = 64 - __builtin_clzll(rows);
+        packed = 1ULL << 63;
+        for (i = 0; i < 6; i++)
+            packed |= (uint64_t)ret[i / 3][i % 3] << (i * 8);
+        __atomic_store_n(&((block_data_t*)data)->bbox, packed,
+                         __ATOMIC_RELEASE);
+    }
+    for (i = 0; i < 6; i++)
+        bbox[i / 3][i % 3] = (packed >> (i * 8)) & 0xff;
+}
+
+/*
+ * Content addressed store of blocks data, used by mesh_dedup.
+ *
+ * An open addressing hash set of the data passed to mesh_dedup, indexed by
+ * the hash of their voxels.  The store doesn't own any reference: a data
+ * is removed from it when it is released, or just before it gets modified
+ * in place.  Since other threads can find a data in the store, the
+ * lookups only take a new reference if the data is still alive, and all
+ * the accesses are protected by a spin lock.
+ */
+static struct {
+    block_data_t    **slots;
+    int             capacity;   // Always a power of two.
+    int             nb;
+    bool            lock;
+    int             nb_deduped; // Number of blocks whose data got replaced.
+    size_t          mem_saved;  // Memory released by the deduplication.
+} g_store;
+
+static void store_lock(void)
+{
+    while (__atomic_test_and_set(&g_store.lock, __ATOMIC_ACQUIRE)) {}
+}
+
+static void store_unlock(void)
+{
+    __atomic_clear(&g_store.lock, __ATOMIC_RELEASE);
+}
+
+// Remove a data from the store.  Must be called with the lock held.
+static void store_remove(block_data_t *data)
+{
+    int mask = g_store.capacity - 1, i, j, k;
+
+    for (i = ATOMIC_GET(data->hash) & mask; g_store.slots[i] != data;
+         i = (i + 1) & mask)
+        assert(g_store.slots[i]);
+    // Backward shift deletion: move up the following entries of the
+    // cluster that can't be reached anymore.
+    for (j = (i + 1) & mask; g_store.slots[j]; j = (j + 1) & mask) {
+        k = ATOMIC_GET(g_store.slots[j]->hash) & mask;
+        if (((j - k) & mask) < ((j - i) & mask)) continue;
+        g_store.slots[i] = g_store.slots[j];
+        i = j;
+    }
+    g_store.slots[i] = NULL;
+    g_store.nb--;
+    __atomic_store_n(&data->in_store, false, __ATOMIC_RELAXED);
+}
+
+static block_data_t *data_new_uniform(const uint8_t v[4])
+{
+    block_data_t *data = pool_calloc(sizeof(*data));
+    data->ref = 1;
+    ATOMIC_INC(g_pool_stats.nb_datas);
+    data_set_uniform(data, v);
+    paging_add(data);
+    return data;
+}
+
+static void data_release(block_data_t *data)
+{
+    if (ATOMIC_DEC(data->ref) == 0) {
+        if (ATOMIC_GET(data->in_store)) {
+            store_lock();
+            store_remove(data);
+            store_unlock();
+        }
+        paging_remove(data);
+        if (data->cold == DATA_PACKED) pool_free(data->packed);
+        data_free_payload(data);
+        pool_free(data);
+        ATOMIC_DEC(g_pool_stats.nb_datas);
+    }
+}
+
+static block_data_t *get_empty_data(void)
+{
+    static block_data_t *g_data = NULL;
+    block_data_t *data, *expected = NULL;
+    data = ATOMIC_GET(g_data);
+    if (data) return data;
+    data = data_new_uniform((uint8_t[4]){0});
+    data->id = 0;
+    // Another thread could have created it in the meantime.
+    if (!ATOMIC_CAS(g_data, expected, data)) {
+        data_release(data);
+        data = expected;
+    }
+    return data;
+}
+
+static block_data_t *data_copy(const block_data_t *other)
+{
+    block_data_t *data = pool_calloc(sizeof(*data));
+    int size, i;
+    data_load(other);
+    data->ref = 1;
+    ATOMIC_INC(g_pool_stats.nb_datas);
+    paging_add(data);
+    data->bits = other->bits;
+    data->nb_colors = other->nb_colors;
+    data->nb_voxels = other->nb_voxels;
+    data->bbox = ATOMIC_GET(other->bbox);
+    if (other->mask) {
+        data->mask = pool_alloc(MASK_SIZE * sizeof(*data->mask));
+        memcpy(data->mask, other->mask, MASK_SIZE * sizeof(*data->mask));
+    }
+    if (other->bits == RAW_BITS) {
+        data->voxels = pool_alloc(N * N * N * 4);
+        memcpy(data->voxels, other->voxels, N * N * N * 4);
+        return data;
+    }
+    size = (1 << other->bits) * sizeof(*data->palette);
+    data->palette = pool_alloc(size);
+    memcpy(data->palette, other->palette, size);
+    // Share the bricks, they only get copied when modified.
+    if (other->bits) {
+        data->bricks = pool_alloc(NB_BRICKS * sizeof(*data->bricks));
+        for (i = 0; i < NB_BRICKS; i++) {
+            pool_ref(other->bricks[i]);
+            data->bricks[i] = other->bricks[i];
+        }
+    }
+    return data;
+}
+
+// Make sure the voxels array is allocated, decoding the palette if needed.
+// This can be called on shared data from several threads at the same time.
+static void data_decode(block_data_t *data)
+{
+    int i;
+    uint8_t (*voxels)[4], (*expected)[4] = NULL;
+    data_load(data);
+    if (ATOMIC_GET(data->voxels)) return;
+    voxels = pool_alloc(N * N * N * 4);
+    for (i = 0; i < N * N * N; i++) {
+        memcpy(voxels[i],
+               data->palette[data_get_index(data, DATA_INDEX_LINEAR(i))].v,
+               4);
+    }
+    if (!ATOMIC_CAS(data->voxels, expected, voxels))
+        pool_free(voxels);
+}
+
+/*
+ * Encode some RGBA values into a palette, with the minimum number of bits.
+ * Return false if there are too many colors, in which case the data is
+ * left untouched.  The voxels can be the data own raw voxels array.
+ */
+static bool data_encode(block_data_t *data, const uint8_t (*voxels)[4])
+{
+    // Small hash table of the colors to their index + 1 in the palette.
+    int16_t slots[512] = {0};
+    palette_entry_t palette[256];
+    uint8_t *tmp;
+    uint32_t v;
+    int i, h, nb = 0, bits;
+
+    tmp = malloc(N * N * N);
+    for (i = 0; i < N * N * N; i++) {
+        memcpy(&v, voxels[i], 4);
+        for (h = (v * 2654435761u) >> 23; slots[h]; h = (h + 1) % 512) {
+            if (memcmp(palette[slots[h] - 1].v, voxels[i], 4) == 0) break;
+        }
+        if (!slots[h]) {
+            if (nb == 256) {
+                free(tmp);
+                return false;
+            }
+            memcpy(palette[nb].v, voxels[i], 4);
+            palette[nb].count = 0;
+            slots[h] = ++nb;
+        }
+        tmp[i] = slots[h] - 1;
+        palette[tmp[i]].count++;
+    }
+
+    if (nb == 1) {
+        data_set_uniform(data, palette[0].v);
+        free(tmp);
+        return true;
+    }
+
+    bits = palette_bits(nb);
+    bricks_release(data->bricks);
+    data->bricks = bricks_new(bits);
+    data->bits = bits;
+    data->nb_colors = nb;
+    data->palette = pool_realloc(data->palette,
+                                 (1 << bits) * sizeof(*palette));
+    memcpy(data->palette, palette, nb * sizeof(*palette));
+    for (i = 0; i < N * N * N; i++)
+        data_set_index(data, DATA_INDEX_LINEAR(i), tmp[i]);
+    free(tmp);
+    data_set_mask(data, voxels);
+    pool_free(data->voxels);
+    data->voxels = NULL;
+    return true;
+}
+
+// Create a new block data from some raw RGBA values.
+static block_data_t *data_new_from_voxels(const uint8_t (*voxels)[4])
+{
+    block_data_t *data = pool_calloc(sizeof(*data));
+    data->ref = 1;
+    data->id = new_uid();
+    ATOMIC_INC(g_pool_stats.nb_datas);
+    if (!data_encode(data, voxels)) {
+        data->bits = RAW_BITS;
+        data->voxels = pool_alloc(N * N * N * 4);
+        memcpy(data->voxels, voxels, N * N * N * 4);
+        data_set_mask(data, voxels);
+    }
+    paging_add(data);
+    return data;
+}
+
+// Switch a palette encoded data to raw RGBA values.
+static void data_to_raw(block_data_t *data)
+{
+    data_decode(data);
+    pool_free(data->palette);
+    bricks_release(data->bricks);
+    data->palette = NULL;
+    data->bricks = NULL;
+    data->nb_colors = 0;
+    data->bits = RAW_BITS;
+}
+
+// Repack the palette indices with a bigger number of bits.
+static void data_grow(block_data_t *data, int bits)
+{
+    int i;
+    block_data_t old = *data;
+    data->bits = bits;
+    data->palette = pool_realloc(data->palette,
+                                 (1 << bits) * sizeof(*data->palette));
+    data->bricks = bricks_new(bits);
+    if (old.bits) {
+        for (i = 0; i < N * N * N; i++)
+            data_set_index(data, i, data_get_index(&old, i));
+    }
+    bricks_release(old.bricks);
+}
+
+/*
+ * Return the palette index of a color, adding it to the palette if needed.
+ * This can switch the data to raw values, in which case we return -1.
+ */
+static int data_get_color_index(block_data_t *data, const uint8_t v[4])
+{
+    int i, unused = -1;
+    for (i = 0; i < data->nb_colors; i++) {
+        if (memcmp(data->palette[i].v, v, 4) == 0) return i;
+        if (unused == -1 && data->palette[i].count == 0) unused = i;
+    }
+    if (unused != -1) {
+        memcpy(data->palette[unused].v, v, 4);
+        return unused;
+    }
+    if (data->nb_colors == 1 << data->bits) {
+        if (data->bits == 8) {
+            data_to_raw(data);
+            return -1;
+        }
+        data_grow(data, data->bits ? data->bits * 2 : 1);
+    }
+    i = data->nb_colors++;
+    memcpy(data->palette[i].v, v, 4);
+    data->palette[i].count = 0;
+    return i;
+}
+
+// Read n successive voxels along the x axis.
+static void data_read_row(const block_data_t *data, int x, int y, int z,
+                          int n, uint8_t *out)
+{
+    int i, j = x + y * N + z * N * N;
+    uint8_t (*voxels)[4];
+    data_load(data);
+    voxels = ATOMIC_GET(data->voxels);
+    if (voxels) {
+        memcpy(out, voxels[j], n * 4);
+        return;
+    }
+    for (i = 0; i < n; i++) {
+        memcpy(out + i * 4,
+               data->palette[data_get_index(data,
+                                            DATA_INDEX(x + i, y, z))].v, 4);
+    }
+}
+
+static void data_get_at(const block_data_t *data, int x, int y, int z,
+                        uint8_t out[4])
+{
+    int i = x + y * N + z * N * N;
+    data_load(data);
+    if (data->bits == RAW_BITS)
+        memcpy(out, data->voxels[i], 4);
+    else
+        memcpy(out, data->palette[data_get_index(data,
+                                  DATA_INDEX(x, y, z))].v, 4);
+}
+
+static void data_set_at(block_data_t *data, int x, int y, int z,
+                        const uint8_t v[4])
+{
+    int i = x + y * N + z * N * N, j = DATA_INDEX(x, y, z), old, new;
+    uint8_t prev[4];
+
+    if (data->bits == RAW_BITS) {
+        data_update_mask(data, i, data->voxels[i], v);
+        memcpy(data->voxels[i], v, 4);
+        return;
+    }
+    old = data_get_index(data, j);
+    if (memcmp(data->palette[old].v, v, 4) == 0) return;
+    memcpy(prev, data->palette[old].v, 4);
+    // Release the decoded voxels.
+    pool_free(data->voxels);
+    data->voxels = NULL;
+
+    new = data_get_color_index(data, v);
+    if (new == -1) { // Switched to raw values.
+        memcpy(data->voxels[i], v, 4);
+        data_update_mask(data, i, prev, v);
+        return;
+    }
+    data->palette[old].count--;
+    data->palette[new].count++;
+    if (data->palette[new].count == N * N * N) {
+        data_set_uniform(data, v);
+        return;
+    }
+    data_own_brick(data, j);
+    data_set_index(data, j, new);
+    data_update_mask(data, i, prev, v);
+}
+
+/*
+ * Re-encode a block data with the smallest possible palette: remove the
+ * unused colors, and try to go back to a palette for raw blocks.
+ */
+static void data_compact(block_data_t *data)
+{
+    int i, nb = 0;
+    uint8_t (*voxels)[4];
+
+    if (data->compact_id == data->id) return;
+    data->compact_id = data->id;
+    if (data->bits == RAW_BITS) {
+        data_encode(data, data->voxels);
+        return;
+    }
+    for (i = 0; i < data->nb_colors; i++) {
+        if (data->palette[i].count) nb++;
+    }
+    if (nb == data->nb_colors && palette_bits(nb) == data->bits) return;
+    data_decode(data);
+    voxels = data->voxels;
+    data->voxels = NULL;
+    data_encode(data, voxels);
+    pool_free(voxels);
+}
+
+// Test if all the voxels of a block data are transparent.
+static bool data_is_empty(const block_data_t *data)
+{
+    return data->nb_voxels == 0;
+}
+
+#define HASH_P1 0x9E3779B185EBCA87ULL
+#define HASH_P2 0xC2B2AE3D27D4EB4FULL
+#define HASH_P3 0x165667B19E3779F9ULL
+
+/*
+ * Compute the hash of the voxels of a block data, using the round and
+ * avalanche functions of xxHash64.  We hash the decoded values, so that
+ * the hash doesn't depend on the representation of the data.  The value
+ * is cached into the data, the same way as the bbox.
+ */
+static uint64_t data_get_hash(const block_data_t *data)
+{
+    uint64_t h = ATOMIC_GET(data->hash), w;
+    uint8_t row[N * 4];
+    int y, z, i;
+
+    if (h) return h;
+    h = HASH_P3;
+    for (z = 0; z < N; z++)
+    for (y = 0; y < N; y++) {
+        data_read_row(data, 0, y, z, N, row);
+        for (i = 0; i < N * 4; i += 8) {
+            memcpy(&w, row + i, 8);
+            h += w * HASH_P2;
+            h = (h << 31) | (h >> 33);
+            h *= HASH_P1;
+        }
+    }
+    h ^= h >> 33;
+    h *= HASH_P2;
+    h ^= h >> 29;
+    h *= HASH_P3;
+    h ^= h >> 32;
+    h = h ?: 1;
+    __atomic_store_n(&((block_data_t*)data)->hash, h, __ATOMIC_RELAXED);
+    return h;
+}
+
+// Test if two blocks data have the same voxels values.
+static bool data_equal(const block_data_t *a, const block_data_t *b)
+{
+    uint8_t row_a[N * 4], row_b[N * 4];
+    int y, z, i;
+    if (a->nb_voxels != b->nb_voxels) return false;
+    data_load(a);
+    data_load(b);
+    // Fast path for the data encoded the same way, which is the common
+    // case for identical blocks.
+    if (    a->bits == b->bits && a->bits != RAW_BITS &&
+            a->nb_colors == b->nb_colors) {
+        for (y = 0; y < a->nb_colors; y++) {
+            if (memcmp(a->palette[y].v, b->palette[y].v, 4)) break;
+        }
+        for (i = 0; y == a->nb_colors && a->bits && i < NB_BRICKS; i++) {
+            if (    a->bricks[i] != b->bricks[i] &&
+                    memcmp(a->bricks[i], b->bricks[i], BRICK_SIZE(a->bits)))
+                break;
+        }
+        if (y == a->nb_colors && (!a->bits || i == NB_BRICKS))
+            return true;
+    }
+    for (z = 0; z < N; z++)
+    for (y = 0; y < N; y++) {
+        data_read_row(a, 0, y, z, N, row_a);
+        data_read_row(b, 0, y, z, N, row_b);
+        if (memcmp(row_a, row_b, sizeof(row_a))) return false;
+    }
+    return true;
+}
+
+static void store_grow(void)
+{
+    block_data_t **old = g_store.slots, *data;
+    int i, j, capacity = g_store.capacity, mask;
+
+    g_store.capacity = capacity ? capacity * 2 : 1024;
+    g_store.slots = calloc(g_store.capacity, sizeof(*g_store.slots));
+    mask = g_store.capacity - 1;
+    for (i = 0; i < capacity; i++) {
+        if (!(data = old[i])) continue;
+        for (j = ATOMIC_GET(data->hash) & mask; g_store.slots[j];
+             j = (j + 1) & mask) {}
+        g_store.slots[j] = data;
+    }
+    free(old);
+}
+
+/*
+ * Look for a data with the same voxels in the store.  If we find one we
+ * return it with a new reference, otherwise we add the data to the store
+ * and return NULL.
+ */
+static block_data_t *store_get_or_add(block_data_t *data)
+{
+    uint64_t hash = data_get_hash(data);
+    block_data_t *other;
+    int i, mask, ref;
+
+    store_lock();
+    if ((g_store.nb + 1) * 2 > g_store.capacity) store_grow();
+    mask = g_store.capacity - 1;
+    for (i = hash & mask; (other = g_store.slots[i]); i = (i + 1) & mask) {
+        // Comparing with a cold data would bring it back in memory.
+        if (    ATOMIC_GET(other->hash) != hash ||
+                ATOMIC_GET(other->cold) || !data_equal(data, other))
+            continue;
+        // Only take a reference if the data is not being released.
+        ref = ATOMIC_GET(other->ref);
+        while (ref && !ATOMIC_CAS(other->ref, ref, ref + 1)) {}
+        if (!ref) continue;
+        store_unlock();
+        return other;
+    }
+    g_store.slots[i] = data;
+    g_store.nb++;
+    __atomic_store_n(&data->in_store, true, __ATOMIC_RELAXED);
+    store_unlock();
+    return NULL;
+}
+
+static bool block_is_empty(const block_t *block, bool fast)
+{
+    if (!block) return true;
+    if (block->data->id == 0) return true;
+    if (fast) return false;
+    return data_is_empty(block->data);
+}
+
+static void block_init(block_t *block, const int pos[3])
+{
+    memcpy(block->pos, pos, sizeof(block->pos));
+    block->data = get_empty_data();
+    ATOMIC_INC(block->data->ref);
+}
+
+static void block_release(block_t *block)
+{
+    data_release(block->data);
+}
+
+static void block_set_data(block_t *block, block_data_t *data)
+{
+    ATOMIC_INC(data->ref);
+    data_release(block->data);
+    block->data = data;
+}
+
+// Copy the data if there are any other blocks having reference to it.
+static void block_prepare_write(const mesh_t *mesh, block_t *block)
+{
+    block_data_t *data = block->data;
+    bool copy;
+    data_load(data);
+    // Other threads could get the data from the dedup store, so the
+    // decision to modify it in place is taken under the store lock, and
+    // we remove it from the store in that case.
+    // If we are the only owner of a data not in the store, no other thread
+    // can get a new reference to it, so the test is safe.
+    if (ATOMIC_GET(data->in_store)) {
+        store_lock();
+        copy = ATOMIC_GET(data->ref) > 1;
+        if (!copy) store_remove(data);
+        store_unlock();
+    } else {
+        copy = ATOMIC_GET(data->ref) > 1;
+    }
+    if (copy) {
+        data = data_copy(data);
+        data_release(block->data);
+        block->data = data;
+    }
+    // The hash is used to find the data in the store.
+    assert(!ATOMIC_GET(data->in_store));
+    // In an edit session the data only needs a new id the first time.
+    if (!mesh->edit_id || data->edit_id != mesh->edit_id) {
+        data->id = new_uid();
+        data->edit_id = mesh->edit_id;
+    }
+    data->compact_id = 0;
+    data->hash = 0;
+    // The copy in the spill file is not valid anymore.
+    if (data->page) {
+        paging_lock();
+        paging_free_slot(data);
+        paging_unlock();
+    }
+}
+
+#define KEY_BITS 21
+
+// Pack a block position into a 64 bits key.
+static uint64_t pos_to_key(const int pos[3])
+{
+    const int bias = 1 << (KEY_BITS - 1);
+    uint64_t x = pos[0] / N + bias,
+             y = pos[1] / N + bias,
+             z = pos[2] / N + bias;
+    assert(x < (1 << KEY_BITS) && y < (1 << KEY_BITS) && z < (1 << KEY_BITS));
+    return x | (y << KEY_BITS) | (z << (2 * KEY_BITS));
+}
+
+// Fibonacci hashing of a packed block position.  Since the multiplier is
+// odd, two different keys always give two different hashes.
+static uint64_t key_hash(uint64_t key)
+{
+    return key * 0x9E3779B97F4A7C15ULL;
+}
+
+// Allocate a node of the blocks vector.  The leaves are bigger.
+static table_node_t *node_new(int level)
+{
+    table_node_t *node = calloc(1, level ? sizeof(*node) -
+                sizeof(node->blocks) + sizeof(node->children) :
+                sizeof(*node));
+    node->ref = 1;
+    return node;
+}
+
+static void node_release(table_node_t *node, int level)
+{
+    int i;
+    if (!node || ATOMIC_DEC(node->ref) != 0) return;
+    for (i = 0; i < node->nb; i++) {
+        if (level) node_release(node->children[i], level - 1);
+        else block_release(&node->blocks[i]);
+    }
+    free(node);
+}
+
+// Make sure that we own a node of the blocks vector, or replace it with a
+// copy.
+static table_node_t *node_prepare_write(table_t *table, table_node_t **node,
+                                        int level)
+{
+    int i;
+    table_node_t *copy;
+    // If we are the only owner, no other thread can get a new reference
+    // to the node, so the test is safe.
+    if (ATOMIC_GET((*node)->ref) == 1) return *node;
+    copy = node_new(level);
+    copy->nb = (*node)->nb;
+    for (i = 0; i < copy->nb; i++) {
+        if (level) {
+            copy->children[i] = (*node)->children[i];
+            ATOMIC_INC(copy->children[i]->ref);
+        } else {
+            copy->blocks[i] = (*node)->blocks[i];
+            ATOMIC_INC(copy->blocks[i].data->ref);
+        }
+    }
+    node_release(*node, level);
+    *node = copy;
+    // The blocks moved.
+    table->id = new_uid();
+    return copy;
+}
+
+// Call a function on all the blocks of a vector node.  The owned argument
+// of the callback tells whether the block can be modified in place.
+static void node_visit_blocks(const table_node_t *node, int level, bool owned,
+                              void (*f)(block_t *block, bool owned,
+                                        void *user),
+                              void *user)
+{
+    int i;
+    owned = owned && ATOMIC_GET(node->ref) == 1;
+    for (i = 0; i < node->nb; i++) {
+        if (level)
+            node_visit_blocks(node->children[i], level - 1, owned, f, user);
+        else
+            f((block_t*)&node->blocks[i], owned, user);
+    }
+}
+
+// Get a block from its index.
+static block_t *table_get(const table_t *table, int i)
+{
+    const table_node_t *node = table->blocks;
+    int level;
+    for (level = table->depth; level > 0; level--)
+        node = node->children[(i >> (level * TABLE_BITS)) & (TABLE_WIDTH - 1)];
+    return (block_t*)&node->blocks[i & (TABLE_WIDTH - 1)];
+}
+
+// Get a block from its index, copying all the nodes on its path if needed.
+// The table must be owned.
+static block_t *table_get_mut(table_t *table, int i)
+{
+    table_node_t **ptr = &table->blocks, *node;
+    int level;
+    for (level = table->depth; ; level--) {
+        node = node_prepare_write(table, ptr, level);
+        if (level == 0) break;
+        ptr = &node->children[(i >> (level * TABLE_BITS)) & (TABLE_WIDTH - 1)];
+    }
+    return &node->blocks[i & (TABLE_WIDTH - 1)];
+}
+
+// Append a new uninitialized block at the end of the blocks vector.
+static block_t *table_push(table_t *table)
+{
+    int i = table->nb, level, j;
+    table_node_t **ptr = &table->blocks, *node;
+
+    if (!table->blocks) {
+        table->blocks = node_new(0);
+    } else if (i == TABLE_WIDTH << (table->depth * TABLE_BITS)) {
+        // The trie is full, add a new root level.
+        node = node_new(table->depth + 1);
+        node->nb = 1;
+        node->children[0] = table->blocks;
+        table->blocks = node;
+        table->depth++;
+    }
+    for (level = table->depth; ; level--) {
+        node = node_prepare_write(table, ptr, level);
+        if (level == 0) break;
+        j = (i >> (level * TABLE_BITS)) & (TABLE_WIDTH - 1);
+        if (j == node->nb) node->children[node->nb++] = node_new(level - 1);
+        ptr = &node->children[j];
+    }
+    table->nb++;
+    return &node->blocks[node->nb++];
+}
+
+// Return the index of the entry for a given bit of a map node.
+static int map_entry_index(const table_map_t *node, int bit)
+{
+    return __builtin_popcountll(node->bitmap & ((1ULL << bit) - 1));
+}
+
+static void map_release(table_map_t *node)
+{
+    uint64_t bits;
+    int i;
+    if (!node || ATOMIC_DEC(node->ref) != 0) return;
+    for (bits = node->bitmap, i = 0; bits; bits &= bits - 1, i++) {
+        if (node->nodes & (1ULL << __builtin_ctzll(bits)))
+            map_release(node->entries[i].node);
+    }
+    free(node);
+}
+
+// Index of a hash in a map node at a given level.  The last level uses the
+// four remaining bits of the hash.
+static int map_index(uint64_t hash, int level)
+{
+    assert(level * TABLE_BITS < 64);
+    return (hash << (level * TABLE_BITS)) >> (64 - TABLE_BITS);
+}
+
+static bool map_get(const table_map_t *node, uint64_t key, uint64_t *value)
+{
+    uint64_t hash = key_hash(key);
+    int level, bit;
+    const table_map_entry_t *entry;
+
+    for (level = 0; node; level++) {
+        bit = map_index(hash, level);
+        if (!(node->bitmap & (1ULL << bit))) return false;
+        entry = &node->entries[map_entry_index(node, bit)];
+        if (!(node->nodes & (1ULL << bit))) {
+            if (entry->key != key) return false;
+            *value = entry->value;
+            return true;
+        }
+        node = entry->node;
+    }
+    return false;
+}
+
+// Make sure that we own a map node, or replace it with a copy.  Also make
+// room for nb_add new entries.
+static table_map_t *map_prepare_write(table_map_t **node, int nb_add)
+{
+    table_map_t *copy;
+    uint64_t bits;
+    int i, n = *node ? __builtin_popcountll((*node)->bitmap) : 0;
+    size_t size = sizeof(*copy) + (n + nb_add) * sizeof(copy->entries[0]);
+
+    if (*node && ATOMIC_GET((*node)->ref) == 1) {
+        if (nb_add) *node = realloc(*node, size);
+        return *node;
+    }
+    copy = calloc(1, size);
+    copy->ref = 1;
+    if (*node) {
+        copy->bitmap = (*node)->bitmap;
+        copy->nodes = (*node)->nodes;
+        memcpy(copy->entries, (*node)->entries, n * sizeof(copy->entries[0]));
+        for (bits = copy->bitmap, i = 0; bits; bits &= bits - 1, i++) {
+            if (copy->nodes & (1ULL << __builtin_ctzll(bits)))
+                ATOMIC_INC(copy->entries[i].node->ref);
+        }
+        map_release(*node);
+    }
+    *node = copy;
+    return copy;
+}
+
+// Set the value of a key in a map, copying the nodes on its path if needed.
+static void map_set(table_map_t **ptr, uint64_t key, uint64_t value)
+{
+    uint64_t hash = key_hash(key);
+    int level, bit, i, n;
+    table_map_t *node, *sub;
+    table_map_entry_t *entry;
+
+    for (level = 0; ; level++) {
+        node = map_prepare_write(ptr, 0);
+        bit = map_index(hash, level);
+        i = map_entry_index(node, bit);
+        if (!(node->bitmap & (1ULL << bit))) {
+            n = __builtin_popcountll(node->bitmap);
+            node = map_prepare_write(ptr, 1);
+            memmove(&node->entries[i + 1], &node->entries[i],
+                    (n - i) * sizeof(node->entries[0]));
+            node->bitmap |= 1ULL << bit;
+            node->entries[i].key = key;
+            node->entries[i].value = value;
+            return;
+        }
+        entry = &node->entries[i];
+        if (!(node->nodes & (1ULL << bit))) {
+            if (entry->key == key) {
+                entry->value = value;
+                return;
+            }
+            // Collision: move the current entry into a new sub node.
+            sub = calloc(1, sizeof(*sub) + sizeof(sub->entries[0]));
+            sub->ref = 1;
+            sub->bitmap = 1ULL << map_index(key_hash(entry->key), level + 1);
+            sub->entries[0] = *entry;
+            entry->node = sub;
+            node->nodes |= 1ULL << bit;
+        }
+        ptr = &entry->node;
+    }
+}
+
+static table_t *table_new(void)
+{
+    table_t *table = calloc(1, sizeof(*table));
+    table->ref = 1;
+    table->id = new_uid();
+    return table;
+}
+
+// Release all the blocks of a table.
+static void table_clear(table_t *table)
+{
+    node_release(table->blocks, table->depth);
+    map_release(table->slots);
+    map_release(table->supers);
+    table->blocks = NULL;
+    table->slots = NULL;
+    table->supers = NULL;
+    table->nb = 0;
+    table->depth = 0;
+    table->unsorted = false;
+    table->id = new_uid();
+}
+
+static void table_release(table_t *table)
+{
+    if (ATOMIC_DEC(table->ref) != 0) return;
+    table_clear(table);
+    free(table);
+}
+
+// Copy a table.  This only takes a new reference to the roots of the
+// tries, the nodes are copied later when we modify them.
+// The nodes are now shared, so we also change the id of the source table:
+// the blocks cached as owned in the accessors of the other meshes using
+// it cannot be written in place anymore.
+static table_t *table_copy(const table_t *other)
+{
+    table_t *table = table_new();
+    __atomic_store_n(&((table_t*)other)->id, new_uid(), __ATOMIC_RELEASE);
+    table->nb = other->nb;
+    table->depth = other->depth;
+    table->unsorted = other->unsorted;
+    table->blocks = other->blocks;
+    table->slots = other->slots;
+    table->supers = other->supers;
+    if (table->blocks) ATOMIC_INC(table->blocks->ref);
+    if (table->slots) ATOMIC_INC(table->slots->ref);
+    if (table->supers) ATOMIC_INC(table->supers->ref);
+    return table;
+}
+
+static void table_visit_blocks(
+        const table_t *table,
+        void (*f)(block_t *block, bool owned, void *user), void *user)
+{
+    if (!table || !table->blocks) return;
+    node_visit_blocks(table->blocks, table->depth,
+                      ATOMIC_GET(table->ref) == 1, f, user);
+}
+
+// Get the superblock key of a block, and the block bit in the superblock.
+static uint64_t get_super_key(const int pos[3], int *bit)
+{
+    int b[3] = {pos[0] / N, pos[1] / N, pos[2] / N};
+    *bit = (b[0] & 3) + (b[1] & 3) * 4 + (b[2] & 3) * 16;
+    return pos_to_key((int[]){(b[0] >> 2) * N, (b[1] >> 2) * N,
+                              (b[2] >> 2) * N});
+}
+
+// Return the blocks mask of a superblock.
+static uint64_t table_get_super(const table_t *table, uint64_t key)
+{
+    uint64_t mask = 0;
+    if (table) map_get(table->supers, key, &mask);
+    return mask;
+}
+
+// Add the index and superblock entries of the block at a given index.
+static void table_index_block(table_t *table, const int pos[3], int index)
+{
+    int bit;
+    uint64_t key = get_super_key(pos, &bit);
+    map_set(&table->slots, pos_to_key(pos), index);
+    map_set(&table->supers, key, table_get_super(table, key) | 1ULL << bit);
+}
+
+// Return the index of the block at a given position, or -1.
+static int table_find_index(const table_t *table, const int pos[3])
+{
+    uint64_t index;
+    if (!table || !map_get(table->slots, pos_to_key(pos), &index))
+        return -1;
+    return index;
+}
+
+static block_t *table_find(const table_t *table, const int pos[3])
+{
+    int i = table_find_index(table, pos);
+    return i >= 0 ? table_get(table, i) : NULL;
+}
+
+// Find a block that we can modify in place.  The table must be owned.
+static block_t *table_find_mut(table_t *table, const int pos[3])
+{
+    int i = table_find_index(table, pos);
+    return i >= 0 ? table_get_mut(table, i) : NULL;
+}
+
+static uint64_t block_get_morton_code(const block_t *block);
+
+// Update the sorted state of a table after we appended a block.
+static void table_check_order(table_t *table)
+{
+    if (table->unsorted || table->nb < 2) return;
+    table->unsorted = block_get_morton_code(table_get(table, table->nb - 1)) <
+                      block_get_morton_code(table_get(table, table->nb - 2));
+}
+
+static block_t *table_add(table_t *table, const int pos[3])
+{
+    block_t *block = table_push(table);
+    block_init(block, pos);
+    table_check_order(table);
+    table_index_block(table, pos, table->nb - 1);
+    table->id = new_uid();
+    return block;
+}
+
+// Replace all the blocks of a table.  The table takes the references to
+// the blocks data.
+static void table_set_blocks(table_t *table, const block_t *blocks, int nb)
+{
+    int i;
+    table_clear(table);
+    for (i = 0; i < nb; i++) {
+        *table_push(table) = blocks[i];
+        table_index_block(table, blocks[i].pos, i);
+        table_check_order(table);
+    }
+}
+
+// Return a malloc'ed array of all the blocks of a table, each with a new
+// reference to its data.
+static block_t *table_get_blocks(const table_t *table)
+{
+    int i;
+    block_t *blocks = malloc(max(table->nb, 1) * sizeof(*blocks));
+    for (i = 0; i < table->nb; i++) {
+        blocks[i] = *table_get(table, i);
+        ATOMIC_INC(blocks[i].data->ref);
+    }
+    return blocks;
+}
+
+// Morton code of a block position.
+static uint64_t block_get_morton_code(const block_t *block)
+{
+    uint64_t key = pos_to_key(block->pos);
+    const uint64_t m = (1 << KEY_BITS) - 1;
+    return spread_bits(key & m) |
+           spread_bits((key >> KEY_BITS) & m) << 1 |
+           spread_bits((key >> (2 * KEY_BITS)) & m) << 2;
+}
+
+static int block_morton_cmp(const void *a, const void *b)
+{
+    uint64_t ka = block_get_morton_code(a),
+             kb = block_get_morton_code(b);
+    return ka < kb ? -1 : ka > kb ? +1 : 0;
+}
+
+// Sort the blocks of a table in Morton order.
+static void table_sort(table_t *table)
+{
+    int nb = table->nb;
+    block_t *blocks = table_get_blocks(table);
+    qsort(blocks, nb, sizeof(*blocks), block_morton_cmp);
+    table_set_blocks(table, blocks, nb);
+    free(blocks);
+}
+
+// Remove all the empty blocks of a table.
+static void table_remove_empty_blocks(table_t *table)
+{
+    int i, j, nb = table->nb;
+    block_t *blocks = table_get_blocks(table);
+    for (i = 0, j = 0; i < nb; i++) {
+        if (block_is_empty(&blocks[i], false)) {
+            block_release(&blocks[i]);
+            continue;
+        }
+        blocks[j++] = blocks[i];
+    }
+    table_set_blocks(table, blocks, j);
+    free(blocks);
+}
+
+static void block_get_at(const block_t *block, const int pos[3],
+                         uint8_t out[4])
+{
+    int x, y, z;
+    if (!block) {
+        memset(out, 0, 4);
+        return;
+    }
+    x = pos[0] - block->pos[0];
+    y = pos[1] - block->pos[1];
+    z = pos[2] - block->pos[2];
+    assert(x >= 0 && x < N);
+    assert(y >= 0 && y < N);
+    assert(z >= 0 && z < N);
+    data_get_at(block->data, x, y, z, out);
+}
+
+typedef struct {
+    int     box[2][3];
+    bool    exact;
+} bbox_visit_t;
+
+// Grow a box to include a block, for mesh_get_bbox.
+static void bbox_add_block(block_t *block, bool owned, void *user)
+{
+    bbox_visit_t *visit = user;
+    int b[2][3], i;
+    if (block_is_empty(block, false)) return;
+    if (visit->exact) {
+        data_get_bbox(block->data, b);
+    } else {
+        memcpy(b, (int[2][3]){{0, 0, 0}, {N, N, N}}, sizeof(b));
+    }
+    for (i = 0; i < 3; i++) {
+        visit->box[0][i] = min(visit->box[0][i], block->pos[i] + b[0][i]);
+        visit->box[1][i] = max(visit->box[1][i], block->pos[i] + b[1][i]);
+    }
 }
 
 /*
@@ -243,115 +2158,252 @@ static void block_get_at(const block_t *block, const int pos[3],
  */
 bool mesh_get_bbox(const mesh_t *mesh, int bbox[2][3], bool exact)
 {
-    block_t *block;
-    int ret[2][3] = {{INT_MAX, INT_MAX, INT_MAX},
-                     {INT_MIN, INT_MIN, INT_MIN}};
-    int pos[3];
-    mesh_iterator_t iter;
+    int i;
+    int ret[2][3];
+    bbox_visit_t visit = {
+        .box = {{INT_MAX, INT_MAX, INT_MAX}, {INT_MIN, INT_MIN, INT_MIN}},
+        .exact = exact,
+    };
+    uint64_t key = 0;
     bool empty = false;
 
-    if (!exact) {
-        for (block = mesh->blocks; block; block = block->hh.next) {
-            if (block_is_empty(block, true)) continue;
-            ret[0][0] = min(ret[0][0], block->pos[0]);
-            ret[0][1] = min(ret[0][1], block->pos[1]);
-            ret[0][2] = min(ret[0][2], block->pos[2]);
-            ret[1][0] = max(ret[1][0], block->pos[0] + N);
-            ret[1][1] = max(ret[1][1], block->pos[1] + N);
-            ret[1][2] = max(ret[1][2], block->pos[1] + N);
-        }
-    } else {
-        iter = mesh_get_iterator(mesh, MESH_ITER_SKIP_EMPTY);
-        while (mesh_iter(&iter, pos)) {
-            if (!mesh_get_alpha_at(mesh, &iter, pos)) continue;
-            ret[0][0] = min(ret[0][0], pos[0]);
-            ret[0][1] = min(ret[0][1], pos[1]);
-            ret[0][2] = min(ret[0][2], pos[2]);
-            ret[1][0] = max(ret[1][0], pos[0] + 1);
-            ret[1][1] = max(ret[1][1], pos[1] + 1);
-            ret[1][2] = max(ret[1][2], pos[2] + 1);
+    // The exact bbox is cached.  Since several threads can read the same
+    // mesh, we use atomic operations to access the cache.
+    if (exact) {
+        key = mesh_get_key(mesh);
+        if (ATOMIC_GET(mesh->bbox_key) == key) {
+            for (i = 0; i < 6; i++)
+                ret[i / 3][i % 3] = __atomic_load_n(&mesh->bbox[i / 3][i % 3],
+                                                    __ATOMIC_RELAXED);
+            memcpy(bbox, ret, sizeof(ret));
+            return ret[0][0] < ret[1][0];
         }
     }
+
+    table_visit_blocks(mesh->table, bbox_add_block, &visit);
+    memcpy(ret, visit.box, sizeof(ret));
     empty = ret[0][0] >= ret[1][0];
     if (empty) memset(ret, 0, sizeof(ret));
     memcpy(bbox, ret, sizeof(ret));
+
+    if (exact) {
+        for (i = 0; i < 6; i++)
+            __atomic_store_n(&((mesh_t*)mesh)->bbox[i / 3][i % 3],
+                             ret[i / 3][i % 3], __ATOMIC_RELAXED);
+        __atomic_store_n(&((mesh_t*)mesh)->bbox_key, key, __ATOMIC_RELEASE);
+    }
     return !empty;
 }
 
 static void mesh_prepare_write(mesh_t *mesh)
 {
-    block_t *blocks, *block, *new_block;
-    assert(*mesh->ref > 0);
-    mesh->key = g_uid++;
-    if (*mesh->ref == 1)
+    table_t *table = mesh->table;
+    mesh->key = mesh->edit_depth ? 0 : new_uid();
+    if (!table || ATOMIC_GET(table->ref) == 1)
         return;
-    (*mesh->ref)--;
-    mesh->ref = calloc(1, sizeof(*mesh->ref));
-    *mesh->ref = 1;
-    blocks = mesh->blocks;
-    mesh->blocks = NULL;
-    for (block = blocks; block; block = block->hh.next) {
-        block->id = g_uid++; // Invalidate all accessors.
-        new_block = block_copy(block);
-        HASH_ADD(hh, mesh->blocks, pos, sizeof(new_block->pos), new_block);
-    }
+    mesh->table = table_copy(table);
+    table_release(table);
 }
 
-static block_t *mesh_add_block(mesh_t *mesh, const int pos[3]);
+// Set user to true if the block is empty, for mesh_remove_empty_blocks.
+static void check_empty_block(block_t *block, bool owned, void *user)
+{
+    // Also take the occasion to switch the blocks that happen to be
+    // uniform to the compact representation.  We only do it for the
+    // data we own, since other meshes could be reading it.
+    if (    owned && ATOMIC_GET(block->data->ref) == 1 &&
+            !ATOMIC_GET(block->data->in_store) && !block->data->cold)
+        data_compact(block->data);
+    if (block_is_empty(block, false)) *(bool*)user = true;
+}
 
-static void mesh_add_neighbors_blocks(mesh_t *mesh)
+void mesh_remove_empty_blocks(mesh_t *mesh, bool fast)
 {
-    const int POS[6][3] = {
-        {0, 0, -1}, {0, 0, +1},
-        {0, -1, 0}, {0, +1, 0},
-        {-1, 0, 0}, {+1, 0, 0},
-    };
-    int i, p[3];
+    bool has_empty = false;
     uint64_t key = mesh->key;
-    block_t *block, *tmp, *other;
-
+    if (!mesh->table) return;
+    table_visit_blocks(mesh->table, check_empty_block, &has_empty);
+    // Don't trigger a copy of the table if there is nothing to remove.
+    if (!has_empty) return;
     mesh_prepare_write(mesh);
-    HASH_ITER(hh, mesh->blocks, block, tmp) {
-        if (block_is_empty(block, true)) continue;
-        for (i = 0; i < 6; i++) {
-            p[0] = block->pos[0] + POS[i][0] * N;
-            p[1] = block->pos[1] + POS[i][1] * N;
-            p[2] = block->pos[2] + POS[i][2] * N;
-            HASH_FIND(hh, mesh->blocks, p, 3 * sizeof(int), other);
-            if (!other) mesh_add_block(mesh, p);
-        }
-    }
-    // Adding empty blocks shouldn't change the key of the mesh.
+    table_remove_empty_blocks(mesh->table);
+    // Empty blocks shouldn't change the key of the mesh.
     mesh->key = key;
 }
 
-void mesh_remove_empty_blocks(mesh_t *mesh, bool fast)
+void mesh_sort_blocks(mesh_t *mesh)
 {
-    block_t *block, *tmp;
     uint64_t key = mesh->key;
+    if (!mesh->table || mesh->table->nb < 2) return;
     mesh_prepare_write(mesh);
-    HASH_ITER(hh, mesh->blocks, block, tmp) {
-        if (block_is_empty(block, false)) {
-            HASH_DEL(mesh->blocks, block);
-            block_delete(block);
+    table_sort(mesh->table);
+    // The content of the mesh didn't change.
+    mesh->key = key;
+}
+
+void mesh_dedup(mesh_t *mesh)
+{
+    uint64_t key = mesh_get_key(mesh);
+    int i;
+    block_t *block;
+    block_data_t *data;
+    bool copied = false;
+
+    if (!mesh->table || mesh->dedup_key == key) return;
+    for (i = 0; i < mesh->table->nb; i++) {
+        block = table_get(mesh->table, i);
+        // Leave the compressed or paged out data cold.
+        if (    block->data->id == 0 || ATOMIC_GET(block->data->in_store) ||
+                ATOMIC_GET(block->data->cold))
+            continue;
+        data = store_get_or_add(block->data);
+        if (!data) continue;
+        // Don't trigger a copy of the table if there is nothing to replace.
+        if (!copied) {
+            mesh_prepare_write(mesh);
+            copied = true;
         }
+        block = table_get_mut(mesh->table, i);
+        ATOMIC_INC(g_store.nb_deduped);
+        if (ATOMIC_GET(block->data->ref) == 1)
+            __atomic_add_fetch(&g_store.mem_saved,
+                               data_get_size(block->data), __ATOMIC_RELAXED);
+        data_release(block->data);
+        block->data = data;
     }
-    // Empty blocks shouldn't change the key of the mesh.
+    // The content of the mesh didn't change.
     mesh->key = key;
+    mesh->dedup_key = key;
+}
+
+// Compress a block data if the other mesh doesn't use it, for mesh_compress.
+static void compress_block(block_t *block, bool owned, void *user)
+{
+    const mesh_t *keep = user;
+    const block_t *other = keep ? table_find(keep->table, block->pos) : NULL;
+    if (other && other->data == block->data) return;
+    data_pack(block->data);
+}
+
+void mesh_compress(mesh_t *mesh, const mesh_t *keep)
+{
+    table_visit_blocks(mesh->table, compress_block, (void*)keep);
+}
+
+typedef struct {
+    const mesh_t    *other;
+    size_t          mem;
+} unshared_visit_t;
+
+// Add the size of a block data not used by the other mesh.
+static void unshared_add_block(block_t *block, bool owned, void *user)
+{
+    unshared_visit_t *visit = user;
+    const block_t *other = visit->other ?
+                           table_find(visit->other->table, block->pos) : NULL;
+    if (other && other->data == block->data) return;
+    visit->mem += data_get_size(block->data);
+}
+
+size_t mesh_get_unshared_mem(const mesh_t *mesh, const mesh_t *other)
+{
+    unshared_visit_t visit = {.other = other};
+    table_visit_blocks(mesh->table, unshared_add_block, &visit);
+    return visit.mem;
+}
+
+typedef struct {
+    const table_t   *a;
+    const table_t   *b;
+    int             nb;
+    void            (*f)(const int pos[3], int change, void *user);
+    void            *user;
+} diff_t;
+
+static void diff_report(diff_t *diff, const int pos[3], int change)
+{
+    diff->nb++;
+    if (diff->f) diff->f(pos, change, diff->user);
+}
+
+// Compare the blocks of a pair of vector nodes at the same place in the
+// two tries.  A node shared by the two tables has the same blocks at the
+// same indices, so we can skip it entirely.  The modified blocks are only
+// reported from the a side.
+static void diff_nodes(diff_t *diff, const table_node_t *a, int a_level,
+                       const table_node_t *b, int b_level)
+{
+    int i, n;
+    const block_t *block, *other;
+
+    if (a == b) return;
+    // The smaller trie is a prefix of the first child of the bigger one.
+    if (a && a_level > b_level) {
+        for (i = 0; i < a->nb; i++)
+            diff_nodes(diff, a->children[i], a_level - 1,
+                       i ? NULL : b, b_level);
+        return;
+    }
+    if (b && b_level > a_level) {
+        for (i = 0; i < b->nb; i++)
+            diff_nodes(diff, i ? NULL : a, a_level, b->children[i],
+                       b_level - 1);
+        return;
+    }
+    if (a_level) {
+        n = max(a ? a->nb : 0, b ? b->nb : 0);
+        for (i = 0; i < n; i++) {
+            diff_nodes(diff,
+                       a && i < a->nb ? a->children[i] : NULL, a_level - 1,
+                       b && i < b->nb ? b->children[i] : NULL, b_level - 1);
+        }
+        return;
+    }
+
+    for (i = 0; a && i < a->nb; i++) {
+        block = &a->blocks[i];
+        other = table_find(diff->b, block->pos);
+        if (!other) {
+            if (block->data->nb_voxels)
+                diff_report(diff, block->pos, MESH_DIFF_REMOVED);
+            continue;
+        }
+        if (other->data->id == block->data->id) continue;
+        if (!other->data->nb_voxels && !block->data->nb_voxels) continue;
+        diff_report(diff, block->pos, MESH_DIFF_MODIFIED);
+    }
+    for (i = 0; b && i < b->nb; i++) {
+        block = &b->blocks[i];
+        if (!block->data->nb_voxels) continue;
+        if (!table_find(diff->a, block->pos))
+            diff_report(diff, block->pos, MESH_DIFF_ADDED);
+    }
+}
+
+int mesh_diff(const mesh_t *a, const mesh_t *b,
+              void (*f)(const int pos[3], int change, void *user),
+              void *user)
+{
+    diff_t diff = {.a = a->table, .b = b->table, .f = f, .user = user};
+    if (a->table == b->table || mesh_get_key(a) == mesh_get_key(b))
+        return 0;
+    diff_nodes(&diff, a->table ? a->table->blocks : NULL,
+               a->table ? a->table->depth : 0,
+               b->table ? b->table->blocks : NULL,
+               b->table ? b->table->depth : 0);
+    return diff.nb;
 }
 
 bool mesh_is_empty(const mesh_t *mesh)
 {
-    return mesh->blocks == NULL;
+    return !mesh->table || mesh->table->nb == 0;
 }
 
 mesh_t *mesh_new(void)
 {
     mesh_t *mesh;
     mesh = calloc(1, sizeof(*mesh));
-    mesh->ref = calloc(1, sizeof(*mesh->ref));
     mesh->key = 1; // Empty mesh key.
-    *mesh->ref = 1;
     return mesh;
 }
 
@@ -363,14 +2415,106 @@ mesh_iterator_t mesh_get_iterator(const mesh_t *mesh, int flags)
     };
 }
 
+static bool table_is_sorted(const table_t *table)
+{
+    return !table || !table->unsorted;
+}
+
+// Morton code of the block at a given index of a table, or UINT64_MAX past
+// the end, for the union of sorted tables.
+static uint64_t union_get_code(const table_t *table, int i, int end)
+{
+    return i < end ? block_get_morton_code(table_get(table, i)) : UINT64_MAX;
+}
+
 mesh_iterator_t mesh_get_union_iterator(
         const mesh_t *m1, const mesh_t *m2, int flags)
 {
-    return (mesh_iterator_t){
+    mesh_iterator_t iter = {
         .mesh = m1,
         .mesh2 = m2,
         .flags = flags,
     };
+    if (table_is_sorted(m1->table) && table_is_sorted(m2->table)) {
+        iter.flags |= MESH_ITER_SORTED_UNION;
+        iter.union_nb = m1->table ? m1->table->nb : 0;
+        iter.union_code[0] = union_get_code(m1->table, 0, iter.union_nb);
+        iter.union_code[1] = union_get_code(m2->table, 0,
+                                            m2->table ? m2->table->nb : 0);
+    }
+    return iter;
+}
+
+// Union of sorted meshes, for mesh_visit_union_blocks.
+static void visit_union_sorted(const mesh_t *const *meshes, int nb,
+                               const int *end,
+                               void (*f)(const int pos[3], uint32_t mask,
+                                         void *user),
+                               void *user)
+{
+    int i, index[32] = {}, pos[3];
+    uint64_t code[32], min;
+    uint32_t mask;
+
+    for (i = 0; i < nb; i++)
+        code[i] = union_get_code(meshes[i]->table, 0, end[i]);
+    while (true) {
+        min = UINT64_MAX;
+        mask = 0;
+        for (i = 0; i < nb; i++) {
+            if (code[i] > min) continue;
+            if (code[i] < min) mask = 0;
+            min = code[i];
+            mask |= 1U << i;
+        }
+        if (min == UINT64_MAX) return;
+        i = __builtin_ctz(mask);
+        vec3_copy(table_get(meshes[i]->table, index[i])->pos, pos);
+        for (i = 0; i < nb; i++) {
+            if (!(mask & (1U << i))) continue;
+            code[i] = union_get_code(meshes[i]->table, ++index[i], end[i]);
+        }
+        f(pos, mask, user);
+    }
+}
+
+void mesh_visit_union_blocks(const mesh_t *const *meshes, int nb,
+                             void (*f)(const int pos[3], uint32_t mask,
+                                       void *user),
+                             void *user)
+{
+    int i, j, k, index, end[32], pos[3];
+    bool sorted = true;
+    uint32_t mask;
+
+    assert(nb <= 32);
+    // The first mesh can get new blocks, so we remember where to stop.
+    for (i = 0; i < nb; i++) {
+        end[i] = meshes[i]->table ? meshes[i]->table->nb : 0;
+        sorted = sorted && table_is_sorted(meshes[i]->table);
+    }
+    if (sorted) {
+        visit_union_sorted(meshes, nb, end, f, user);
+        return;
+    }
+
+    // Otherwise we go through the blocks of each mesh in turn, skipping
+    // the positions already done with the previous meshes.
+    for (i = 0; i < nb; i++) {
+        for (k = 0; k < end[i]; k++) {
+            vec3_copy(table_get(meshes[i]->table, k)->pos, pos);
+            mask = 1U << i;
+            for (j = 0; j < nb; j++) {
+                if (j == i) continue;
+                index = table_find_index(meshes[j]->table, pos);
+                if (index < 0 || index >= end[j]) continue;
+                if (j < i) break;
+                mask |= 1U << j;
+            }
+            if (j < nb) continue;
+            f(pos, mask, user);
+        }
+    }
 }
 
 mesh_iterator_t mesh_get_box_iterator(const mesh_t *mesh,
@@ -398,66 +2542,51 @@ mesh_accessor_t mesh_get_accessor(const mesh_t *mesh)
 }
 
 
+static void mesh_release_table(mesh_t *mesh)
+{
+    if (mesh->table) table_release(mesh->table);
+    mesh->table = NULL;
+}
+
 void mesh_clear(mesh_t *mesh)
 {
     assert(mesh);
-    block_t *block, *tmp;
-    mesh_prepare_write(mesh);
-    HASH_ITER(hh, mesh->blocks, block, tmp) {
-        HASH_DEL(mesh->blocks, block);
-        block_delete(block);
-    }
+    mesh_release_table(mesh);
     mesh->key = 1; // Empty mesh key.
-    mesh->blocks = NULL;
 }
 
 void mesh_delete(mesh_t *mesh)
 {
-    block_t *block, *tmp;
     if (!mesh) return;
-    (*mesh->ref)--;
-    if (*mesh->ref == 0) {
-        HASH_ITER(hh, mesh->blocks, block, tmp) {
-            HASH_DEL(mesh->blocks, block);
-            block_delete(block);
-        }
-        free(mesh->ref);
-    }
+    mesh_release_table(mesh);
     free(mesh);
 }
 
 mesh_t *mesh_copy(const mesh_t *other)
 {
     mesh_t *mesh = calloc(1, sizeof(*mesh));
-    mesh->blocks = other->blocks;
-    mesh->ref = other->ref;
-    mesh->key = other->key;
-    (*mesh->ref)++;
+    mesh->table = other->table;
+    mesh->key = mesh_get_key(other);
+    if (mesh->table) ATOMIC_INC(mesh->table->ref);
     return mesh;
 }
 
 void mesh_set(mesh_t *mesh, const mesh_t *other)
 {
-    block_t *block, *tmp;
     assert(mesh && other);
-    if (mesh->blocks == other->blocks) return; // Already the same.
-    (*mesh->ref)--;
-    if (*mesh->ref == 0) {
-        HASH_ITER(hh, mesh->blocks, block, tmp) {
-            HASH_DEL(mesh->blocks, block);
-            block_delete(block);
-        }
-        free(mesh->ref);
-    }
-    mesh->blocks = other->blocks;
-    mesh->ref = other->ref;
-    mesh->key = other->key;
-    (*mesh->ref)++;
+    mesh->key = mesh_get_key(other);
+    if (mesh->table == other->table) return; // Already the same.
+    mesh_release_table(mesh);
+    mesh->table = other->table;
+    if (mesh->table) ATOMIC_INC(mesh->table->ref);
 }
 
-static uint64_t get_block_id(const block_t *block)
+// Return a value that changes every time the blocks of a mesh are moved
+// in memory, added or removed.  Used to check if the block pointers cached
+// in the iterators are still valid.
+static uint64_t get_table_id(const mesh_t *mesh)
 {
-    return block ? block->id : 1;
+    return mesh->table ? ATOMIC_GET(mesh->table->id) : 1;
 }
 
 static block_t *mesh_get_block_at(const mesh_t *mesh, const int pos[3],
@@ -467,18 +2596,16 @@ static block_t *mesh_get_block_at(const mesh_t *mesh, const int pos[3],
     int p[3] = {pos[0] & ~(int)(N - 1),
                 pos[1] & ~(int)(N - 1),
                 pos[2] & ~(int)(N - 1)};
-    if (!it) {
-        HASH_FIND(hh, mesh->blocks, p, 3 * sizeof(int), block);
-        return block;
-    }
+    if (!it) return table_find(mesh->table, p);
 
-    if (    it->block_id && it->block_id == get_block_id(it->block) &&
+    if (    it->table_id && it->table_id == get_table_id(mesh) &&
             vec3_equal(it->block_pos, p)) {
         return it->block;
     }
-    HASH_FIND(hh, mesh->blocks, p, 3 * sizeof(int), block);
+    block = table_find(mesh->table, p);
     it->block = block;
-    it->block_id = get_block_id(block);
+    it->block_owned = false;
+    it->table_id = get_table_id(mesh);
     vec3_copy(p, it->block_pos);
     return block;
 }
@@ -491,8 +2618,8 @@ static block_t *mesh_add_block(mesh_t *mesh, const int pos[3])
     assert(pos[2] % BLOCK_SIZE == 0);
     assert(!mesh_get_block_at(mesh, pos, NULL));
     mesh_prepare_write(mesh);
-    block = block_new(pos);
-    HASH_ADD(hh, mesh->blocks, pos, sizeof(block->pos), block);
+    if (!mesh->table) mesh->table = table_new();
+    block = table_add(mesh->table, pos);
     return block;
 }
 
@@ -502,7 +2629,7 @@ void mesh_get_at(const mesh_t *mesh, mesh_iterator_t *it,
     block_t *block;
     int p[3];
 
-    if (it && it->block_id && it->block_id == get_block_id(it->block)) {
+    if (it && it->table_id && it->table_id == get_table_id(mesh)) {
         p[0] = pos[0] - it->block_pos[0];
         p[1] = pos[1] - it->block_pos[1];
         p[2] = pos[2] - it->block_pos[2];
@@ -512,7 +2639,7 @@ void mesh_get_at(const mesh_t *mesh, mesh_iterator_t *it,
             if (!it->block)
                 memset(out, 0, 4);
             else
-                memcpy(out, BLOCK_AT(it->block, p[0], p[1], p[2]), 4);
+                data_get_at(it->block->data, p[0], p[1], p[2], out);
             return;
         }
     }
@@ -527,103 +2654,275 @@ void mesh_set_at(mesh_t *mesh, mesh_iterator_t *iter,
     int p[3] = {pos[0] & ~(int)(N - 1),
                 pos[1] & ~(int)(N - 1),
                 pos[2] & ~(int)(N - 1)};
+    block_t *block = NULL;
     mesh_prepare_write(mesh);
 
-    block_t *block = mesh_get_block_at(mesh, p, iter);
-
-    if (!block) {
-        block = mesh_add_block(mesh, p);
+    // The cached block can only be used if it was looked up for writing,
+    // since it could be in a node shared with an other mesh.
+    if (    iter && iter->block_owned &&
+            iter->table_id == get_table_id(mesh) &&
+            vec3_equal(iter->block_pos, p)) {
+        block = iter->block;
+    } else {
+        block = table_find_mut(mesh->table, p);
+        if (!block) block = mesh_add_block(mesh, p);
         if (iter) {
             iter->block = block;
-            iter->block_id = get_block_id(block);
+            iter->block_owned = true;
+            iter->table_id = get_table_id(mesh);
             vec3_copy(p, iter->block_pos);
         }
     }
 
-    block_prepare_write(block);
+    block_prepare_write(mesh, block);
     p[0] = pos[0] - block->pos[0];
     p[1] = pos[1] - block->pos[1];
     p[2] = pos[2] - block->pos[2];
     assert(p[0] >= 0 && p[0] < N);
     assert(p[1] >= 0 && p[1] < N);
     assert(p[2] >= 0 && p[2] < N);
-    memcpy(BLOCK_AT(block, p[0], p[1], p[2]), v, 4);
+    data_set_at(block->data, p[0], p[1], p[2], v);
 }
 
 
+/*
+ * Test if we can skip a block position in a box iterator with the
+ * MESH_ITER_SKIP_EMPTY flag.  If the block row of its superblock is
+ * empty we also move to the end of the row, so that we skip up to four
+ * blocks for a single lookup.
+ */
+static bool mesh_iter_skip_box_block(mesh_iterator_t *it)
+{
+    int bit;
+    uint64_t key, super;
+    const mesh_t *mesh = it->mesh;
+
+    // We cache the last superblock, since we usually iterate several
+    // blocks of it in a row.
+    key = get_super_key(it->block_pos, &bit);
+    if (key != it->super_key || it->super_table_id != get_table_id(mesh)) {
+        it->super_key = key;
+        it->super_mask = table_get_super(mesh->table, key);
+        it->super_table_id = get_table_id(mesh);
+    }
+    super = it->super_mask;
+    if (super & (1ULL << bit)) return false;
+    // Bits of the remaining blocks of the row.
+    if (!((super >> bit) & (0xf >> (bit & 3))))
+        it->block_pos[0] += (3 - (bit & 3)) * N;
+    return true;
+}
+
 static bool mesh_iter_next_block_box(mesh_iterator_t *it)
 {
     int i;
     const mesh_t *mesh = it->mesh;
-    if (!it->block_id) {
+    bool skip_empty = it->flags & MESH_ITER_SKIP_EMPTY;
+
+    if (skip_empty && (!mesh->table || !mesh->table->nb)) return false;
+    if (!it->table_id) {
+        // The box can be empty after the intersection with the mesh bbox.
+        for (i = 0; i < 3; i++)
+            if (it->bbox[0][i] > it->bbox[1][i]) return false;
         it->block_pos[0] = it->bbox[0][0] & ~(int)(N - 1);
         it->block_pos[1] = it->bbox[0][1] & ~(int)(N - 1);
         it->block_pos[2] = it->bbox[0][2] & ~(int)(N - 1);
-        goto end;
+        it->table_id = get_table_id(mesh);
+        if (!skip_empty || !mesh_iter_skip_box_block(it)) goto end;
     }
 
-    for (i = 0; i < 3; i++) {
-        it->block_pos[i] += N;
-        if (it->block_pos[i] <= it->bbox[1][i]) break;
-        it->block_pos[i] = it->bbox[0][i] & ~(int)(N - 1);
-    }
-    if (i == 3) return false;
+    do {
+        for (i = 0; i < 3; i++) {
+            it->block_pos[i] += N;
+            if (it->block_pos[i] <= it->bbox[1][i]) break;
+            it->block_pos[i] = it->bbox[0][i] & ~(int)(N - 1);
+        }
+        if (i == 3) return false;
+    } while (skip_empty && mesh_iter_skip_box_block(it));
 
 end:
-    HASH_FIND(hh, mesh->blocks, it->block_pos, 3 * sizeof(int), it->block);
-    it->block_id = get_block_id(it->block);
+    it->block = table_find(mesh->table, it->block_pos);
+    it->block_owned = false;
+    it->table_id = get_table_id(mesh);
     vec3_copy(it->block_pos, it->pos);
     return true;
 }
 
-static bool mesh_iter_next_block_union(mesh_iterator_t *it)
+// Set the iterator to the block following the current one in a mesh table.
+static bool mesh_iter_next_table_block(mesh_iterator_t *it,
+                                       const mesh_t *mesh)
 {
-    it->block = it->block ? it->block->hh.next : it->mesh->blocks;
-    if (!it->block && !(it->flags & MESH_ITER_MESH2)) {
-        it->block = it->mesh2->blocks;
-        it->flags |= MESH_ITER_MESH2;
+    int i = it->block ? it->block_index + 1 : 0;
+    if (!mesh->table || i >= mesh->table->nb) {
+        it->block = NULL;
+        return false;
     }
-    if (!it->block) return false;
-    it->block_id = it->block->id;
+    it->block = table_get(mesh->table, i);
+    it->block_index = i;
+    it->block_owned = false;
+    it->table_id = get_table_id(mesh);
+    vec3_copy(it->block->pos, it->block_pos);
+    vec3_copy(it->block->pos, it->pos);
+    return true;
+}
+
+/*
+ * Union iteration of two meshes with sorted tables: we advance the two
+ * tables together, always taking the block with the lowest Morton code, so
+ * that we don't need to look up the blocks of one mesh in the other one.
+ * The first mesh can get new blocks during the iteration (as in
+ * mesh_merge), but they are added at the end of the table so we just
+ * ignore them.
+ */
+static bool mesh_iter_next_block_sorted_union(mesh_iterator_t *it)
+{
+    const table_t *t1 = it->mesh->table, *t2 = it->mesh2->table;
+    uint64_t c1 = it->union_code[0], c2 = it->union_code[1];
+
+    if (c1 == UINT64_MAX && c2 == UINT64_MAX) {
+        it->block = NULL;
+        return false;
+    }
+    if (c1 <= c2) {
+        it->block = table_get(t1, it->union_index[0]++);
+        it->table_id = get_table_id(it->mesh);
+        it->union_code[0] = union_get_code(t1, it->union_index[0],
+                                           it->union_nb);
+        if (c1 == c2) {
+            it->union_code[1] = union_get_code(t2, ++it->union_index[1],
+                                               t2->nb);
+        }
+    } else {
+        it->block = table_get(t2, it->union_index[1]++);
+        it->table_id = get_table_id(it->mesh2);
+        it->union_code[1] = union_get_code(t2, it->union_index[1], t2->nb);
+    }
+    it->block_owned = false;
     vec3_copy(it->block->pos, it->block_pos);
     vec3_copy(it->block->pos, it->pos);
+    return true;
+}
+
+static bool mesh_iter_next_block_union(mesh_iterator_t *it)
+{
+    while (true) {
+        if (!(it->flags & MESH_ITER_MESH2)) {
+            if (mesh_iter_next_table_block(it, it->mesh)) return true;
+            it->flags |= MESH_ITER_MESH2;
+        }
+        if (!mesh_iter_next_table_block(it, it->mesh2)) return false;
+        // Discard blocks that we already did from the first mesh.
+        if (!table_find(it->mesh->table, it->block_pos)) return true;
+    }
+}
+
+static const int NEIGHBORS[6][3] = {
+    {0, 0, -1}, {0, 0, +1},
+    {0, -1, 0}, {0, +1, 0},
+    {-1, 0, 0}, {+1, 0, 0},
+};
 
-    // Discard blocks that we already did from the first mesh.
-    if (it->flags & MESH_ITER_MESH2) {
-        if (mesh_get_block_at(it->mesh, it->block_pos, NULL))
-            return mesh_iter_next_block_union(it);
+/*
+ * Set the iterator to the next missing neighbor of the mesh blocks, for
+ * MESH_ITER_INCLUDES_NEIGHBORS.  We go through the six neighbors of each
+ * non empty block, and a position reachable from several blocks is only
+ * yielded from the first direction that reaches it, so that we don't
+ * need to remember the positions we already did.
+ */
+static bool mesh_iter_next_neighbor_block(mesh_iterator_t *it)
+{
+    const table_t *table = it->mesh->table;
+    const block_t *block;
+    int i, k, p[3], q[3];
+
+    while (true) {
+        if (++it->neighbor == 6) {
+            it->neighbor = 0;
+            it->block_index++;
+        }
+        if (!table || it->block_index >= table->nb) return false;
+        block = table_get(table, it->block_index);
+        if (block_is_empty(block, true)) {
+            it->neighbor = 5;
+            continue;
+        }
+        for (i = 0; i < 3; i++)
+            p[i] = block->pos[i] + NEIGHBORS[it->neighbor][i] * N;
+        if (table_find(table, p)) continue;
+        for (k = 0; k < it->neighbor; k++) {
+            for (i = 0; i < 3; i++) q[i] = p[i] - NEIGHBORS[k][i] * N;
+            if (!block_is_empty(table_find(table, q), true)) break;
+        }
+        if (k < it->neighbor) continue;
+        break;
     }
+    it->block = NULL;
+    it->block_owned = false;
+    it->table_id = get_table_id(it->mesh);
+    vec3_copy(p, it->block_pos);
+    vec3_copy(p, it->pos);
     return true;
 }
 
 static bool mesh_iter_next_block(mesh_iterator_t *it)
 {
-    if (it->block_id && it->block_id != get_block_id(it->block)) {
-        it->block = mesh_get_block_at(
-            (it->flags & MESH_ITER_MESH2) ? it->mesh2 : it->mesh,
-            it->block_pos,
-            it);
+    const mesh_t *mesh = (it->flags & MESH_ITER_MESH2) ? it->mesh2 : it->mesh;
+    if (it->flags & MESH_ITER_NEIGHBORS_PHASE)
+        return mesh_iter_next_neighbor_block(it);
+    if (it->flags & MESH_ITER_SORTED_UNION)
+        return mesh_iter_next_block_sorted_union(it);
+    if (it->table_id && it->table_id != get_table_id(mesh)) {
+        it->block = mesh_get_block_at(mesh, it->block_pos, it);
+        it->block_index = table_find_index(mesh->table, it->block_pos);
     }
 
     if (it->flags & MESH_ITER_BOX) return mesh_iter_next_block_box(it);
     if (it->mesh2) return mesh_iter_next_block_union(it);
+    if (mesh_iter_next_table_block(it, it->mesh)) return true;
+    if (!(it->flags & MESH_ITER_INCLUDES_NEIGHBORS)) return false;
+    // Once we did all the blocks, we continue with their neighbors.
+    it->flags |= MESH_ITER_NEIGHBORS_PHASE;
+    it->block_index = 0;
+    it->neighbor = -1;
+    return mesh_iter_next_neighbor_block(it);
+}
 
-    it->block = it->block ? it->block->hh.next : it->mesh->blocks;
+/*
+ * Move the iterator to the next non empty voxel of the current block,
+ * using the block occupancy mask.  Return false if there is none.
+ */
+static bool mesh_iter_skip_empty_voxels(mesh_iterator_t *it)
+{
+    const block_data_t *data;
+    uint64_t w;
+    int i, k;
+
+    if (it->table_id != get_table_id(it->mesh))
+        it->block = mesh_get_block_at(it->mesh, it->block_pos, it);
     if (!it->block) return false;
-    it->block_id = it->block->id;
-    vec3_copy(it->block->pos, it->block_pos);
-    vec3_copy(it->block->pos, it->pos);
+    data = it->block->data;
+    data_load(data);
+    if (!data->mask) return data->nb_voxels; // Uniform block.
+    i = (it->pos[0] - it->block_pos[0]) +
+        (it->pos[1] - it->block_pos[1]) * N +
+        (it->pos[2] - it->block_pos[2]) * N * N;
+    k = i / 64;
+    w = data->mask[k] & (~0ULL << (i % 64));
+    while (!w) {
+        if (++k == MASK_SIZE) return false;
+        w = data->mask[k];
+    }
+    i = k * 64 + __builtin_ctzll(w);
+    it->pos[0] = it->block_pos[0] + i % N;
+    it->pos[1] = it->block_pos[1] + i / N % N;
+    it->pos[2] = it->block_pos[2] + i / (N * N);
     return true;
 }
 
 int mesh_iter(mesh_iterator_t *it, int pos[3])
 {
     int i;
-    if (!it->block_id) { // First call.
-        // XXX: this is not good: mesh_iter shouldn't make change to the
-        // mesh.
-        if (it->flags & MESH_ITER_INCLUDES_NEIGHBORS)
-            mesh_add_neighbors_blocks((mesh_t*)it->mesh);
+    if (!it->table_id) { // First call.
         if (!mesh_iter_next_block(it)) return 0;
         goto end;
     }
@@ -636,38 +2935,209 @@ int mesh_iter(mesh_iterator_t *it, int pos[3])
     if (i < 3) goto end;
 
 next_block:
-    if (!mesh_iter_next_block(it)) {
-        // XXX: this is not good: mesh_iter shouldn't make changes to the
-        // mesh.
-        if (it->flags & MESH_ITER_INCLUDES_NEIGHBORS)
-            mesh_remove_empty_blocks((mesh_t*)it->mesh, true);
-        return 0;
-    }
+    if (!mesh_iter_next_block(it)) return 0;
 
 end:
+    if (    (it->flags & MESH_ITER_SKIP_EMPTY) &&
+            !(it->flags & MESH_ITER_BLOCKS) && !it->mesh2 &&
+            !mesh_iter_skip_empty_voxels(it))
+        goto next_block;
     if (pos) vec3_copy(it->pos, pos);
     return 1;
 }
 
 uint64_t mesh_get_key(const mesh_t *mesh)
 {
-    return mesh ? mesh->key : 0;
+    if (!mesh) return 0;
+    // Modified during an edit session: we can only be called from the
+    // thread doing the edit, so it's safe to set the new key now.
+    if (!mesh->key) ((mesh_t*)mesh)->key = new_uid();
+    return mesh->key;
 }
 
-void *mesh_get_block_data(const mesh_t *mesh, mesh_accessor_t *iter,
-                          const int bpos[3], uint64_t *id)
+void mesh_begin_edit(mesh_t *mesh)
+{
+    uint64_t key = mesh->key;
+    if (mesh->edit_depth++) return;
+    // Make sure we own the table, this doesn't change the mesh yet.
+    mesh_prepare_write(mesh);
+    mesh->key = key;
+    mesh->edit_id = new_uid();
+}
+
+void mesh_end_edit(mesh_t *mesh)
+{
+    assert(mesh->edit_depth > 0);
+    mesh_get_key(mesh);
+    if (--mesh->edit_depth) return;
+    mesh->edit_id = 0;
+}
+
+static void stats_add_block(block_t *block, bool owned, void *user)
+{
+    mesh_stats_t *stats = user;
+    const block_data_t *data = block->data;
+    stats->nb_blocks++;
+    stats->mem += data_get_size(data);
+    stats->mem_raw += sizeof(*data) + N * N * N * 4;
+    stats->nb_voxels += data->nb_voxels;
+}
+
+void mesh_get_stats(const mesh_t *mesh, mesh_stats_t *stats)
+{
+    memset(stats, 0, sizeof(*stats));
+    stats->nb_datas = ATOMIC_GET(g_pool_stats.nb_datas);
+    pool_lock();
+    stats->mem_used = g_pool_stats.used;
+    stats->mem_allocated = g_pool_stats.allocated;
+    stats->mem_peak = g_pool_stats.peak;
+    pool_unlock();
+    stats->nb_deduped = ATOMIC_GET(g_store.nb_deduped);
+    stats->mem_deduped = ATOMIC_GET(g_store.mem_saved);
+    paging_lock();
+    stats->nb_paged = g_paging.nb_paged;
+    stats->paging_file_size = g_paging.file_size;
+    paging_unlock();
+    if (!mesh) return;
+    table_visit_blocks(mesh->table, stats_add_block, stats);
+}
+
+bool mesh_set_paging(const char *path, size_t budget)
+{
+    if (!g_paging.enabled) {
+        if (!budget) return true;
+        g_paging.file = path ? fopen(path, "w+b") : tmpfile();
+        if (!g_paging.file) return false;
+    }
+    g_paging.budget = budget;
+    __atomic_store_n(&g_paging.enabled, true, __ATOMIC_RELAXED);
+    return true;
+}
+
+// Add a block data to the paging list, for mesh_paging_add.
+static void paging_add_block(block_t *block, bool owned, void *user)
+{
+    paging_add(block->data);
+}
+
+void mesh_paging_add(const mesh_t *mesh)
+{
+    if (!paging_is_enabled() || !mesh->table) return;
+    table_visit_blocks(mesh->table, paging_add_block, NULL);
+}
+
+static int paging_cmp(const void *a, const void *b)
+{
+    uint32_t ta = (*(block_data_t**)a)->tick,
+             tb = (*(block_data_t**)b)->tick;
+    return (ta > tb) - (ta < tb);
+}
+
+void mesh_paging_trim(void)
+{
+    block_data_t **datas, *data;
+    int i, nb = 0;
+
+    if (!paging_is_enabled()) return;
+    if (paging_over_budget(1, 1)) {
+        // Evict the least recently used data until we get some margin.
+        paging_lock();
+        datas = malloc(g_paging.nb_datas * sizeof(*datas));
+        for (i = 0; i < g_paging.nb_datas; i++) {
+            data = g_paging.datas[i];
+            if (data->bits && !data->cold) datas[nb++] = data;
+        }
+        paging_unlock();
+        qsort(datas, nb, sizeof(*datas), paging_cmp);
+        for (i = 0; i < nb && paging_over_budget(7, 8); i++)
+            data_page_out(datas[i]);
+        free(datas);
+    }
+    __atomic_add_fetch(&g_paging.tick, 1, __ATOMIC_RELAXED);
+}
+
+static block_t *mesh_get_block(const mesh_t *mesh, mesh_accessor_t *iter,
+                               const int bpos[3])
 {
-    block_t *block = NULL;
     if (    iter &&
-            iter->block_id &&
-            iter->block_id == get_block_id(iter->block) &&
+            iter->table_id &&
+            iter->table_id == get_table_id(mesh) &&
             memcmp(&iter->pos, bpos, sizeof(iter->pos)) == 0) {
-        block = iter->block;
-    } else {
-        HASH_FIND(hh, mesh->blocks, bpos, sizeof(iter->pos), block);
+        return iter->block;
     }
+    return table_find(mesh->table, bpos);
+}
+
+uint64_t mesh_get_block_id(const mesh_t *mesh, mesh_accessor_t *iter,
+                           const int bpos[3])
+{
+    const block_t *block = mesh_get_block(mesh, iter, bpos);
+    return block ? block->data->id : 0;
+}
+
+void *mesh_get_block_data(const mesh_t *mesh, mesh_accessor_t *iter,
+                          const int bpos[3], uint64_t *id)
+{
+    block_t *block = mesh_get_block(mesh, iter, bpos);
     if (id) *id = block ? block->data->id : 0;
-    return block ? block->data->voxels : NULL;
+    if (!block) return NULL;
+    // Palette encoded blocks are decoded on demand.
+    data_decode(block->data);
+    return ATOMIC_GET(block->data->voxels);
+}
+
+bool mesh_block_is_uniform(const mesh_t *mesh, mesh_accessor_t *accessor,
+                           const int bpos[3], uint8_t value[4])
+{
+    const block_t *block = mesh_get_block_at(mesh, bpos, accessor);
+    if (!block) {
+        if (value) memset(value, 0, 4);
+        return true;
+    }
+    if (block->data->bits) return false;
+    if (value) memcpy(value, block->data->palette[0].v, 4);
+    return true;
+}
+
+int mesh_get_block_mask(const mesh_t *mesh, mesh_accessor_t *accessor,
+                        const int bpos[3], uint64_t *mask)
+{
+    const block_t *block = mesh_get_block_at(mesh, bpos, accessor);
+    const block_data_t *data = block ? block->data : NULL;
+    if (!mask) return data ? data->nb_voxels : 0;
+    if (data) data_load(data);
+    if (data && data->mask)
+        memcpy(mask, data->mask, MASK_SIZE * sizeof(*mask));
+    else
+        memset(mask, data && data->nb_voxels ? 0xff : 0,
+               MASK_SIZE * sizeof(*mask));
+    return data ? data->nb_voxels : 0;
+}
+
+void mesh_fill_block(mesh_t *mesh, const int bpos[3], const uint8_t v[4])
+{
+    block_t *block;
+    block_data_t *data;
+    mesh_prepare_write(mesh);
+    block = table_find_mut(mesh->table, bpos);
+    if (!block) block = mesh_add_block(mesh, bpos);
+    data = data_new_uniform(v);
+    data->id = new_uid();
+    data_release(block->data);
+    block->data = data;
+}
+
+void mesh_write_block(mesh_t *mesh, const int bpos[3],
+                      const uint8_t (*voxels)[4])
+{
+    block_t *block;
+    block_data_t *data;
+    mesh_prepare_write(mesh);
+    block = table_find_mut(mesh->table, bpos);
+    if (!block) block = mesh_add_block(mesh, bpos);
+    data = data_new_from_voxels(voxels);
+    data_release(block->data);
+    block->data = data;
 }
 
 uint8_t mesh_get_alpha_at(const mesh_t *mesh, mesh_iterator_t *iter,
@@ -682,95 +3152,141 @@ void mesh_copy_block(const mesh_t *src, const int src_pos[3],
                      mesh_t *dst, const int dst_pos[3])
 {
     block_t *b1, *b2;
+    block_data_t *data;
     mesh_prepare_write(dst);
     b1 = mesh_get_block_at(src, src_pos, NULL);
-    b2 = mesh_get_block_at(dst, dst_pos, NULL);
+    // Adding a block can move the blocks in memory, so we keep a pointer
+    // to the data in case src and dst are the same mesh.
+    data = b1->data;
+    b2 = table_find_mut(dst->table, dst_pos);
     if (!b2) b2 = mesh_add_block(dst, dst_pos);
-    block_set_data(b2, b1->data);
+    block_set_data(b2, data);
+}
+
+// Iterate all the blocks positions intersecting a box.
+#define BOX_BLOCKS_ITER(pos, size, bpos) \
+    for (bpos[2] = pos[2] & ~(N - 1); bpos[2] < pos[2] + size[2]; \
+         bpos[2] += N) \
+    for (bpos[1] = pos[1] & ~(N - 1); bpos[1] < pos[1] + size[1]; \
+         bpos[1] += N) \
+    for (bpos[0] = pos[0] & ~(N - 1); bpos[0] < pos[0] + size[0]; \
+         bpos[0] += N)
+
+// Compute the intersection of a box with a block, in block coordinates.
+static void box_block_intersection(const int pos[3], const int size[3],
+                                   const int bpos[3], int a[3], int b[3])
+{
+    int i;
+    for (i = 0; i < 3; i++) {
+        a[i] = max(pos[i] - bpos[i], 0);
+        b[i] = min(pos[i] + size[i] - bpos[i], N);
+    }
 }
 
 void mesh_read(const mesh_t *mesh,
                const int pos[3], const int size[3],
                uint8_t *data)
 {
-    // For the moment we only support the case where we get the rectangle
-    // of a block plus a one voxel border around it!
-    assert(pos[0] - (pos[0] & ~(int)(N - 1)) == N - 1);
-    assert(pos[1] - (pos[1] & ~(int)(N - 1)) == N - 1);
-    assert(pos[2] - (pos[2] & ~(int)(N - 1)) == N - 1);
-    assert(size[0] == N + 2);
-    assert(size[1] == N + 2);
-    assert(size[2] == N + 2);
-
-    block_t *block;
-    int block_pos[3] = {pos[0] + 1, pos[1] + 1, pos[2] + 1};
-    int i, z, y, x, dx, dy, dz, p[3];
-    uint8_t v[4];
-    mesh_accessor_t accessor;
+    const block_t *block;
+    int bpos[3], a[3], b[3], y, z;
+    uint8_t *dst;
 
     memset(data, 0, size[0] * size[1] * size[2] * 4);
-    block = mesh_get_block_at(mesh, block_pos, NULL);
-    if (!block) goto rest;
-
-    for (z = 0; z < N; z++)
-    for (y = 0; y < N; y++)
-    for (x = 0; x < N; x++) {
-        dx = x + 1;
-        dy = y + 1;
-        dz = z + 1;
-        memcpy(&data[(dz * size[1] * size[0] + dy * size[0] + dx) * 4],
-               &block->data->voxels[z * N * N + y * N + x],
-               4);
+    BOX_BLOCKS_ITER(pos, size, bpos) {
+        block = table_find(mesh->table, bpos);
+        if (!block) continue;
+        // No need to read zero uniform blocks.
+        if (    block->data->bits == 0 &&
+                !memcmp(block->data->palette[0].v, (uint8_t[4]){0}, 4))
+            continue;
+        box_block_intersection(pos, size, bpos, a, b);
+        for (z = a[2]; z < b[2]; z++)
+        for (y = a[1]; y < b[1]; y++) {
+            dst = &data[(((bpos[2] + z - pos[2]) * size[1] +
+                           bpos[1] + y - pos[1]) * size[0] +
+                           bpos[0] + a[0] - pos[0]) * 4];
+            data_read_row(block->data, a[0], y, z, b[0] - a[0], dst);
+        }
     }
+}
 
-rest:
-    // Fill the rest.
-    // In order to optimize access, we iter in such a way to avoid changing
-    // the current block: start with the planes, then the edges, and finally
-    // the 8 corners.
-    accessor = mesh_get_accessor(mesh);
-    const int ranges[26][3][2] = {
-        // 6 planes.
-        {{0,         1}, {1,     N + 1}, {1,     N + 1}},
-        {{N + 1, N + 2}, {1,     N + 1}, {1,     N + 1}},
-        {{1,     N + 1}, {0,         1}, {1,     N + 1}},
-        {{1,     N + 1}, {N + 1, N + 2}, {1,     N + 1}},
-        {{1,     N + 1}, {1,     N + 1}, {0,         1}},
-        {{1,     N + 1}, {1,     N + 1}, {N + 1, N + 2}},
-        // 4 edges moving along X.
-        {{1,     N + 1}, {0,         1}, {0,         1}},
-        {{1,     N + 1}, {N + 1, N + 2}, {0,         1}},
-        {{1,     N + 1}, {0,         1}, {N + 1, N + 2}},
-        {{1,     N + 1}, {N + 1, N + 2}, {N + 1, N + 2}},
-        // 4 edges moving along Y.
-        {{0,         1}, {1,     N + 1}, {0,         1}},
-        {{N + 1, N + 2}, {1,     N + 1}, {0,         1}},
-        {{0,         1}, {1,     N + 1}, {1,     N + 2}},
-        {{N + 1, N + 2}, {1,     N + 1}, {1,     N + 2}},
-        // 4 edges moving along Z.
-        {{0,         1}, {0,         1}, {1,     N + 1}},
-        {{N + 1, N + 2}, {0,         1}, {1,     N + 1}},
-        {{0,         1}, {N + 1, N + 2}, {1,     N + 1}},
-        {{N + 1, N + 2}, {N + 1, N + 2}, {1,     N + 1}},
-        // 8 Corners.
-        {{0,     1    }, {0,     1    }, {0,     1    }},
-        {{N + 1, N + 2}, {0,     1    }, {0,     1    }},
-        {{0,     1    }, {N + 1, N + 2}, {0,     1    }},
-        {{N + 1, N + 2}, {N + 1, N + 2}, {0,     1    }},
-        {{0,     1    }, {0,     1    }, {N + 1, N + 2}},
-        {{N + 1, N + 2}, {0,     1    }, {N + 1, N + 2}},
-        {{0,     1    }, {N + 1, N + 2}, {N + 1, N + 2}},
-        {{N + 1, N + 2}, {N + 1, N + 2}, {N + 1, N + 2}},
-    };
+void mesh_write(mesh_t *mesh,
+                const int pos[3], const int size[3],
+                const uint8_t *data)
+{
+    block_t *block;
+    block_data_t *bdata, *uniform = NULL, **written = NULL;
+    int bpos[3], a[3], b[3], y, z, nb_written = 0, nb_evicted = 0;
+    uint8_t (*voxels)[4];
+    const uint8_t *src;
+
+    voxels = malloc(N * N * N * 4);
+    mesh_begin_edit(mesh);
+    BOX_BLOCKS_ITER(pos, size, bpos) {
+        block = table_find_mut(mesh->table, bpos);
+        box_block_intersection(pos, size, bpos, a, b);
+        // Start from the current block data, unless we overwrite it all.
+        if (    block &&
+                (a[0] != 0 || a[1] != 0 || a[2] != 0 ||
+                 b[0] != N || b[1] != N || b[2] != N)) {
+            for (z = 0; z < N; z++)
+            for (y = 0; y < N; y++)
+                data_read_row(block->data, 0, y, z, N,
+                              voxels[(z * N + y) * N]);
+        } else {
+            memset(voxels, 0, N * N * N * 4);
+        }
+        for (z = a[2]; z < b[2]; z++)
+        for (y = a[1]; y < b[1]; y++) {
+            src = &data[(((bpos[2] + z - pos[2]) * size[1] +
+                           bpos[1] + y - pos[1]) * size[0] +
+                           bpos[0] + a[0] - pos[0]) * 4];
+            memcpy(voxels[(z * N + y) * N + a[0]], src, (b[0] - a[0]) * 4);
+        }
+        bdata = data_new_from_voxels(voxels);
+
+        // Successive uniform blocks with the same value share their data.
+        if (bdata->bits == 0 && uniform &&
+                !memcmp(bdata->palette[0].v, uniform->palette[0].v, 4)) {
+            data_release(bdata);
+            bdata = uniform;
+            ATOMIC_INC(bdata->ref);
+        }
+        if (bdata->bits == 0 && bdata != uniform) {
+            if (uniform) data_release(uniform);
+            uniform = bdata;
+            ATOMIC_INC(uniform->ref);
+        }
 
-    for (i = 0; i < 26; i++)
-    for (z = ranges[i][2][0]; z < ranges[i][2][1]; z++)
-    for (y = ranges[i][1][0]; y < ranges[i][1][1]; y++)
-    for (x = ranges[i][0][0]; x < ranges[i][0][1]; x++) {
-        p[0] = pos[0] + x;
-        p[1] = pos[1] + y;
-        p[2] = pos[2] + z;
-        mesh_get_at(mesh, &accessor, p, v);
-        memcpy(&data[(z * size[1] * size[0] + y * size[0] + x) * 4], v, 4);
+        if (!block) {
+            if (data_is_empty(bdata)) {
+                data_release(bdata);
+                continue;
+            }
+            block = mesh_add_block(mesh, bpos);
+        } else {
+            // Replacing the data of a block changes the mesh too.
+            mesh_prepare_write(mesh);
+        }
+        data_release(block->data);
+        block->data = bdata;
+
+        // With paging, we evict the blocks as we go when we write more
+        // than the budget, starting from the first ones.  Nobody else can
+        // access them yet, so it's safe to do it here.
+        if (!paging_is_enabled() || bdata->bits == 0) continue;
+        if (nb_written % 64 == 0)
+            written = realloc(written, (nb_written + 64) * sizeof(*written));
+        written[nb_written++] = bdata;
+        if (nb_written % 16) continue;
+        while (nb_evicted < nb_written && paging_over_budget(7, 8)) {
+            bdata = written[nb_evicted++];
+            if (ATOMIC_GET(bdata->ref) == 1) data_page_out(bdata);
+        }
     }
+    if (uniform) data_release(uniform);
+    free(written);
+    free(voxels);
+    mesh_remove_empty_blocks(mesh, false);
+    mesh_end_edit(mesh);
 }
@@ -2,9 +2,47 @@
 #define MESH_H
 
 #include <stdbool.h>
+#include <stddef.h>
 #include <stdint.h>
 
-#define BLOCK_SIZE 16
+// Size of the blocks, selected at compile time (scons block_size=N).
+// Only 8, 16 and 32 are supported, 16 being the default, and the size used
+// by the gox file format.
+#ifndef BLOCK_SIZE
+#   define BLOCK_SIZE 16
+#endif
+#if BLOCK_SIZE != 8 && BLOCK_SIZE != 16 && BLOCK_SIZE != 32
+#   error "BLOCK_SIZE can only be 8, 16 or 32"
+#endif
+
+// Order of the voxels inside the blocks, see mesh.c.
+#ifndef BLOCK_LAYOUT
+#   define BLOCK_LAYOUT 0
+#endif
+
+/*
+ * Section: Concurrency
+ *
+ * Meshes use copy on write: a copy of a mesh shares all its blocks data,
+ * that only get copied when one of the meshes is modified.  The reference
+ * counts and ids used for that are atomic, so the functions of this file
+ * follow a simple contract:
+ *
+ * - Any number of threads can read the same mesh at the same time, as long
+ *   as no thread modifies it.
+ * - A mesh can only be modified by one thread at a time, and no other
+ *   thread can read it during that time.  But the other threads can still
+ *   freely read or modify any copy of it (the copy being done before the
+ *   modification starts).
+ *
+ * So the typical use is to give a copy of a mesh to a worker thread.
+ *
+ * Note that this only covers the functions of this file.  The functions of
+ * mesh_utils.c (mesh_op, mesh_merge, ...) use some global caches and so
+ * should only be called from the main thread for the moment.  Internally,
+ * mesh_op and mesh_merge process the blocks in parallel on the workers
+ * (see workers_run), each worker writing into its own mesh.
+ */
 
 /* Type: mesh_t
  * Opaque type that represents a mesh.
@@ -21,7 +59,10 @@ typedef struct block block_t;
  * MESH_ITER_BLOCKS - Iter on the blocks: the iterator return successive
  *                    blocks positions.
  * MESH_ITER_INCLUDES_NEIGHBORS - Also yield one position for each
- *                                neighbor of the voxels.
+ *                                neighbor of the voxels: after all the
+ *                                blocks of the mesh, we go through the
+ *                                missing blocks next to them.  Only for
+ *                                the simple mesh iterators.
  * MESH_ITER_SKIP_EMPTY - Don't yield empty voxels/blocks.
  */
 enum {
@@ -50,12 +91,33 @@ typedef struct {
     // the block can be NULL if there is no block at this position.
     block_t *block;
     int block_pos[3];
-    uint64_t block_id;
+    // Id of the mesh blocks table when we cached the block, the block
+    // pointer is only valid as long as the table id doesn't change.
+    uint64_t table_id;
+    // Index of the cached block in the mesh table.
+    int block_index;
+    // Direction of the current neighbor of the block at block_index, when
+    // we iterate the neighbors with MESH_ITER_INCLUDES_NEIGHBORS.
+    int neighbor;
+    // Cursors in the tables of the two meshes of a union iterator, and
+    // number of blocks of the first mesh when we started, when we can
+    // iterate the union with a merge of the sorted tables.
+    int union_index[2];
+    int union_nb;
+    uint64_t union_code[2]; // Morton codes of the blocks at the cursors.
+    // Set if the cached block was looked up for writing, so that it can be
+    // modified in place.
+    bool block_owned;
 
     int pos[3];
     float box[4][4];
     int bbox[2][3];
 
+    // Last superblock used by the box iterators.
+    uint64_t super_key;
+    uint64_t super_mask;
+    uint64_t super_table_id;
+
     int flags;
 } mesh_iterator_t;
 typedef mesh_iterator_t mesh_accessor_t;
@@ -103,9 +165,133 @@ uint8_t mesh_get_alpha_at(const mesh_t *mesh, mesh_iterator_t *it,
 void mesh_set_at(mesh_t *mesh, mesh_iterator_t *it,
                  const int pos[3], const uint8_t v[4]);
 
+/*
+ * Function: mesh_begin_edit
+ *
+ * Start an edit session on a mesh.
+ *
+ * Each modification of a mesh normally needs to check if the mesh shares
+ * its data with a copy, and to give new ids to the mesh and the modified
+ * blocks.  Inside an edit session this is only done once per block, so it
+ * is worth using when we set a lot of voxels one by one.
+ *
+ * Sessions can be nested, the session only ends with the last call to
+ * <mesh_end_edit>.  The blocks ids returned by <mesh_get_block_data>
+ * during a session are not updated by the subsequent modifications, so
+ * they should not be used until the end of the session.
+ */
+void mesh_begin_edit(mesh_t *mesh);
+
+/*
+ * Function: mesh_end_edit
+ *
+ * End an edit session started with <mesh_begin_edit>.
+ */
+void mesh_end_edit(mesh_t *mesh);
+
 // XXX: we should remove this one I guess.
 void mesh_remove_empty_blocks(mesh_t *mesh, bool fast);
 
+/*
+ * Function: mesh_sort_blocks
+ *
+ * Reorder the blocks of a mesh in Morton (Z-order) order.
+ *
+ * The iterators normally visit the blocks in the order they were added to
+ * the mesh.  After this call they visit them in Morton order, so that
+ * successive blocks tend to be close to each other, until new blocks are
+ * added out of order.  This doesn't change the mesh key.  The union of
+ * sorted meshes can be iterated without looking up the blocks, see
+ * <mesh_get_union_iterator>.
+ */
+void mesh_sort_blocks(mesh_t *mesh);
+
+/*
+ * Function: mesh_dedup
+ *
+ * Make the blocks of a mesh share their data with the blocks of the same
+ * content in all the meshes previously passed to this function.
+ *
+ * The blocks data are hashed and kept in a global content addressed
+ * store, until they get modified or released, so calling this on all the
+ * layers and undo snapshots of an image lets the identical blocks use the
+ * memory only once.  This doesn't change the mesh key, and calling it
+ * again on a mesh that didn't change returns immediately.  The data
+ * compressed by <mesh_compress> or paged out are skipped, so that they
+ * stay cold.  See the nb_deduped and mem_deduped attributes of
+ * <mesh_stats_t> for the total effect.
+ */
+void mesh_dedup(mesh_t *mesh);
+
+/*
+ * Function: mesh_compress
+ *
+ * Compress in memory the blocks data of a mesh, except the ones used at
+ * the same position by an other mesh.
+ *
+ * The data get decompressed transparently the next time we access their
+ * voxels, so this is meant for the meshes we don't expect to use soon,
+ * like the old steps of the undo history, with the current version of the
+ * layer as the other mesh.  This doesn't change the mesh key.  Since the
+ * data can be shared, this should be called at a time when no other thread
+ * is using any mesh.
+ *
+ * Inputs:
+ *   mesh - The mesh to compress.
+ *   keep - Optional mesh whose blocks data are left untouched.
+ */
+void mesh_compress(mesh_t *mesh, const mesh_t *keep);
+
+/*
+ * Function: mesh_get_unshared_mem
+ *
+ * Return the memory used by the blocks data of a mesh that are not used at
+ * the same position by an other mesh, or by all the blocks data if the
+ * other mesh is NULL.  Compressed data are counted at their compressed
+ * size.
+ */
+size_t mesh_get_unshared_mem(const mesh_t *mesh, const mesh_t *other);
+
+/* Enum: MESH_DIFF
+ * The kinds of block changes reported by <mesh_diff>.
+ *
+ * MESH_DIFF_ADDED    - The block only has voxels in the second mesh.
+ * MESH_DIFF_REMOVED  - The block only has voxels in the first mesh.
+ * MESH_DIFF_MODIFIED - The block is in both meshes with different data.
+ */
+enum {
+    MESH_DIFF_ADDED     = 1,
+    MESH_DIFF_REMOVED,
+    MESH_DIFF_MODIFIED,
+};
+
+/*
+ * Function: mesh_diff
+ *
+ * List the blocks that differ between two meshes.
+ *
+ * This only compares the blocks data ids and never looks at the voxels,
+ * and the parts of the blocks tables still shared by the two meshes (as
+ * after a <mesh_copy>) are skipped, so it's fast enough to find what
+ * changed between two versions of a layer.  Blocks whose data differ but
+ * with the same voxels (for example data modified and set back) can be
+ * reported as modified.  Like the blocks ids, the result is not reliable
+ * for a mesh in an edit session.
+ *
+ * Inputs:
+ *   a    - The first mesh.
+ *   b    - The second mesh.
+ *   f    - Optional function called with each differing block position
+ *          and one of the <MESH_DIFF> values.
+ *   user - Passed to the callback.
+ *
+ * Returns:
+ *   The number of differing blocks.
+ */
+int mesh_diff(const mesh_t *a, const mesh_t *b,
+              void (*f)(const int pos[3], int change, void *user),
+              void *user);
+
 /*
  * Function: mesh_is_empty
  *
@@ -151,9 +337,43 @@ mesh_iterator_t mesh_get_box_iterator(const mesh_t *mesh,
                                       const float box[4][4],
                                       int flags);
 
+/*
+ * Function: mesh_get_union_iterator
+ *
+ * Return an iterator on the union of the blocks of two meshes.
+ *
+ * If the two meshes blocks are in Morton order (see <mesh_sort_blocks>),
+ * the blocks are yielded in that order, without having to look up the
+ * blocks of one mesh in the other one.  The first mesh can be modified
+ * during the iteration, but the blocks it gets are not visited.
+ */
 mesh_iterator_t mesh_get_union_iterator(
         const mesh_t *m1, const mesh_t *m2, int flags);
 
+/*
+ * Function: mesh_visit_union_blocks
+ *
+ * Call a function once on each block position of the union of several
+ * meshes.
+ *
+ * The callback gets a mask of the meshes that have a block at the
+ * position, so that this can also be used for intersections.  Like with
+ * <mesh_get_union_iterator>, if all the meshes are sorted we do a single
+ * merge pass over their tables, and the positions come in Morton order.
+ * The callback can modify the first mesh, but the blocks it adds are not
+ * visited.
+ *
+ * Inputs:
+ *   meshes - Array of meshes, up to 32.
+ *   nb     - Number of meshes.
+ *   f      - Function called with the block position and the mask.
+ *   user   - Passed to the callback.
+ */
+void mesh_visit_union_blocks(const mesh_t *const *meshes, int nb,
+                             void (*f)(const int pos[3], uint32_t mask,
+                                       void *user),
+                             void *user);
+
 int mesh_iter(mesh_iterator_t *it, int pos[3]);
 
 /*
@@ -176,15 +396,236 @@ int mesh_iter(mesh_iterator_t *it, int pos[3]);
  */
 uint64_t mesh_get_key(const mesh_t *mesh);
 
+/*
+ * Function: mesh_get_block_data
+ *
+ * Return the voxels of a block as an array of N^3 RGBA values.
+ *
+ * The blocks are stored palette encoded, so this call has to decode the
+ * data into an array that stays attached to the data until it gets
+ * modified.  If we only need the block id, use <mesh_get_block_id>
+ * instead, and to read many blocks once prefer <mesh_read> with a
+ * temporary buffer.
+ *
+ * The returned pointer is only valid until the next change to the mesh.
+ *
+ * Outputs:
+ *   id - If not NULL, set to the id of the block data (see
+ *        <mesh_get_block_id>).
+ *
+ * Returns:
+ *   The voxels data, or NULL if the block is not in the mesh.
+ */
 void *mesh_get_block_data(const mesh_t *mesh, mesh_accessor_t *accessor,
                           const int bpos[3], uint64_t *id);
 
+/*
+ * Function: mesh_get_block_id
+ *
+ * Return the id of the data of a block.
+ *
+ * Two blocks with the same id are guaranteed to have the same content.
+ * Blocks not in the mesh have an id of zero.  The blocks in the mesh whose
+ * voxels are all transparent can still have a non zero id, use
+ * <mesh_get_block_mask> to test if a block is empty.
+ */
+uint64_t mesh_get_block_id(const mesh_t *mesh, mesh_accessor_t *accessor,
+                           const int bpos[3]);
+
+/*
+ * Function: mesh_block_is_uniform
+ *
+ * Test if all the voxels of a block have the same value.
+ *
+ * This only looks at the way the block is stored, so it can return false
+ * for a block whose voxels happen to all be equal.
+ *
+ * Inputs:
+ *   mesh     - The mesh.
+ *   accessor - Optional accessor to speed up successive calls.
+ *   bpos     - Position of the block.
+ *
+ * Outputs:
+ *   value    - If not NULL, set to the value of all the voxels of the
+ *              block when it is uniform.
+ *
+ * Returns:
+ *   true if the block is uniform.  Blocks that are not in the mesh are
+ *   considered uniform with a value of zero.
+ */
+bool mesh_block_is_uniform(const mesh_t *mesh, mesh_accessor_t *accessor,
+                           const int bpos[3], uint8_t value[4]);
+
+/*
+ * Function: mesh_get_block_mask
+ *
+ * Get the occupancy mask of a block: one bit per voxel, set if the voxel
+ * is not transparent.  The voxels are in the same order as with
+ * <mesh_read>, starting from the least significant bit of the first word.
+ *
+ * This only reads the mask the block maintains, so it is much faster than
+ * reading the voxels.
+ *
+ * Inputs:
+ *   mesh     - The mesh.
+ *   accessor - Optional accessor to speed up successive calls.
+ *   bpos     - Position of the block.
+ *
+ * Outputs:
+ *   mask     - If not NULL, receives the BLOCK_SIZE^3 / 64 words of the
+ *              mask.
+ *
+ * Returns:
+ *   The number of non transparent voxels of the block.
+ */
+int mesh_get_block_mask(const mesh_t *mesh, mesh_accessor_t *accessor,
+                        const int bpos[3], uint64_t *mask);
+
+/*
+ * Function: mesh_fill_block
+ *
+ * Set all the voxels of a block to the same value.
+ *
+ * This is much faster than setting the voxels one by one, and the block
+ * doesn't need to allocate any voxels data.
+ */
+void mesh_fill_block(mesh_t *mesh, const int bpos[3], const uint8_t v[4]);
+
+/*
+ * Function: mesh_write_block
+ *
+ * Set all the voxels of a block from an array of BLOCK_SIZE^3 values, in
+ * the same order as with <mesh_read>.
+ *
+ * Unlike <mesh_write>, this doesn't remove the blocks that end up empty.
+ */
+void mesh_write_block(mesh_t *mesh, const int bpos[3],
+                      const uint8_t (*voxels)[4]);
+
 // Maybe replace this with a generic mesh_copy_part function?
 void mesh_copy_block(const mesh_t *src, const int src_pos[3],
                      mesh_t *dst, const int dst_pos[3]);
 
+/*
+ * Function: mesh_read
+ *
+ * Read the voxels of a box into an array.
+ *
+ * Inputs:
+ *   mesh - The mesh.
+ *   pos  - Position of the lowest corner of the box.
+ *   size - Size of the box.
+ *
+ * Outputs:
+ *   data - Receives the RGBA values of the voxels, in xyz order, so it
+ *          must be at least size[0] * size[1] * size[2] * 4 bytes.
+ */
 void mesh_read(const mesh_t *mesh,
                const int pos[3], const int size[3],
                uint8_t *data);
 
+/*
+ * Function: mesh_write
+ *
+ * Write the voxels of a box from an array.
+ *
+ * This is the fastest way to put a lot of voxels into a mesh: the data is
+ * copied by rows and each block is only encoded once.
+ *
+ * Inputs:
+ *   mesh - The mesh.
+ *   pos  - Position of the lowest corner of the box.
+ *   size - Size of the box.
+ *   data - RGBA values of the voxels, in xyz order.
+ */
+void mesh_write(mesh_t *mesh,
+                const int pos[3], const int size[3],
+                const uint8_t *data);
+
+/* Type: mesh_stats_t
+ * Memory statistics of a mesh, as returned by <mesh_get_stats>.
+ */
+typedef struct {
+    int     nb_blocks;
+    int     nb_voxels;  // Number of non transparent voxels.
+    size_t  mem;        // Memory used by the blocks data, in bytes.
+    size_t  mem_raw;    // Memory the data would use as raw RGBA values.
+
+    // Global counters of the blocks data allocator, for all the meshes.
+    int     nb_datas;       // Number of blocks data alive.
+    size_t  mem_used;       // Memory used by the blocks data.
+    size_t  mem_allocated;  // Memory allocated from the system.
+    size_t  mem_peak;       // Peak value of mem_allocated.
+    int     nb_deduped;     // Blocks whose data was replaced by mesh_dedup.
+    size_t  mem_deduped;    // Memory released by mesh_dedup.
+    int     nb_paged;       // Blocks data evicted to the spill file.
+    size_t  paging_file_size; // Size of the spill file.
+} mesh_stats_t;
+
+/*
+ * Function: mesh_get_stats
+ *
+ * Compute memory statistics of a mesh.
+ *
+ * The data shared by several blocks is counted once for each block, so
+ * this is not the actual memory used by the mesh, but the memory it would
+ * use if it didn't share any data.
+ *
+ * The stats also contain the global counters of the blocks memory
+ * allocator.  The mesh can be NULL if we only want those.
+ */
+void mesh_get_stats(const mesh_t *mesh, mesh_stats_t *stats);
+
+/*
+ * Function: mesh_set_paging
+ *
+ * Enable the paging of the blocks data to a spill file, to work with
+ * meshes that don't fit in memory.
+ *
+ * When the memory used by the blocks data goes above the budget, the
+ * voxels of the least recently accessed blocks are written to the spill
+ * file and released, until the next time we access them.  This is
+ * transparent to the users of the meshes, the data being shared and
+ * copied on write as usual.
+ *
+ * The data are only evicted by <mesh_paging_trim>, and by <mesh_write> for
+ * the blocks it just wrote, so that we can import volumes bigger than the
+ * budget.  Only the data created after the paging is enabled can be
+ * evicted, so the meshes that already exist have to be registered with
+ * <mesh_paging_add>.
+ *
+ * Inputs:
+ *   path   - Path of the spill file, that gets overwritten.  If NULL we
+ *            use an anonymous temporary file.  Ignored if the paging is
+ *            already enabled.
+ *   budget - Memory budget of the blocks data, in bytes.  Zero to stop
+ *            evicting the data.
+ *
+ * Returns:
+ *   false if we could not create the spill file.
+ */
+bool mesh_set_paging(const char *path, size_t budget);
+
+/*
+ * Function: mesh_paging_add
+ *
+ * Let the paging evict the blocks data of a mesh created before the
+ * paging was enabled.  Calling it several times on the same data is
+ * harmless.  Like <mesh_paging_trim>, this should be called at a time
+ * when no other thread is using any mesh.
+ */
+void mesh_paging_add(const mesh_t *mesh);
+
+/*
+ * Function: mesh_paging_trim
+ *
+ * Evict the least recently used blocks data until the memory goes back
+ * under the paging budget.
+ *
+ * This should be called regularly (goxel calls it at each frame), at a
+ * time when no other thread is using any mesh.  Each call also starts a
+ * new period for the blocks access recency.
+ */
+void mesh_paging_trim(void);
+
 #endif // MESH_H
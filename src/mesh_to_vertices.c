@@ -185,7 +185,7 @@ static uint32_t get_neighboors(const uint8_t *data,
     return ret;
 }
 
-/* Packing of block id, pos, and face:
+/* Packing of block id, pos, and face (with the default block size):
  *
  *    x   :  4 bits
  *    y   :  4 bits
@@ -194,11 +194,15 @@ static uint32_t get_neighboors(const uint8_t *data,
  *    face:  3 bits
  *    -------------
  *    tot : 16 bits
+ *
+ * The coordinates use POS_DATA_BITS bits each, and the face is only
+ * there if POS_DATA_HAS_FACE is set.
  */
 static uint16_t get_pos_data(uint16_t x, uint16_t y, uint16_t z, uint16_t f)
 {
-    assert(BLOCK_SIZE == 16);
-    return (x << 12) | (y << 8) | (z << 4) | (f << 0);
+    const int b = POS_DATA_BITS;
+    return (x << (16 - b)) | (y << (16 - 2 * b)) | (z << (16 - 3 * b)) |
+           (POS_DATA_HAS_FACE ? f : 0);
 }
 
 
@@ -206,7 +210,8 @@ int mesh_generate_vertices(const mesh_t *mesh, const int block_pos[3],
                            int effects, voxel_vertex_t *out)
 {
     int x, y, z, f;
-    int i, nb = 0;
+    int i, k, nb = 0;
+    uint64_t mask[N * N * N / 64], w;
     uint32_t neighboors_mask;
     uint8_t shadow_mask, borders_mask;
     const int ts = VOXEL_TEXTURE_SIZE;
@@ -218,6 +223,23 @@ int mesh_generate_vertices(const mesh_t *mesh, const int block_pos[3],
     if (effects & EFFECT_MARCHING_CUBES)
         return mesh_generate_vertices_mc(mesh, block_pos, effects, out);
 
+    // Fast path for uniform blocks: nothing to render if the block is
+    // transparent, or if it is solid and surrounded by solid blocks.
+    if (mesh_block_is_uniform(mesh, NULL, block_pos, v)) {
+        if (v[3] < 127) return 0;
+        for (f = 0; f < 6; f++) {
+            pos[0] = block_pos[0] + FACES_NORMALS[f][0] * N;
+            pos[1] = block_pos[1] + FACES_NORMALS[f][1] * N;
+            pos[2] = block_pos[2] + FACES_NORMALS[f][2] * N;
+            if (!mesh_block_is_uniform(mesh, NULL, pos, v)) break;
+            if (v[3] < 127) break;
+        }
+        if (f == 6) return 0;
+    }
+
+    // Only the non transparent voxels of the block can have faces.
+    if (!mesh_get_block_mask(mesh, NULL, block_pos, mask)) return 0;
+
     // To speed things up we first get the voxel cube around the block.
     // XXX: can we do this while still using mesh iterators somehow?
 #define IVEC(...) ((int[]){__VA_ARGS__})
@@ -226,12 +248,12 @@ int mesh_generate_vertices(const mesh_t *mesh, const int block_pos[3],
               IVEC(block_pos[0] - 1, block_pos[1] - 1, block_pos[2] - 1),
               IVEC(N + 2, N + 2, N + 2), data);
 
-    for (z = 0; z < N; z++)
-    for (y = 0; y < N; y++)
-    for (x = 0; x < N; x++) {
-        pos[0] = x;
-        pos[1] = y;
-        pos[2] = z;
+    for (k = 0; k < N * N * N / 64; k++)
+    for (w = mask[k]; w; w &= w - 1) {
+        i = k * 64 + __builtin_ctzll(w);
+        x = pos[0] = i % N;
+        y = pos[1] = i / N % N;
+        z = pos[2] = i / (N * N);
         data_get_at(data, x, y, z, v);
         if (v[3] < 127) continue;    // Non visible
         neighboors_mask = get_neighboors(data, pos, neighboors);
@@ -151,12 +151,14 @@ static void mesh_fill(
     mesh_accessor_t accessor;
 
     mesh_clear(mesh);
+    mesh_begin_edit(mesh);
     accessor = mesh_get_accessor(mesh);
     iter = mesh_get_box_iterator(mesh, box, 0);
     while (mesh_iter(&iter, pos)) {
         get_color(pos, color, user_data);
         mesh_set_at(mesh, &accessor, pos, color);
     }
+    mesh_end_edit(mesh);
 }
 
 static void mesh_move_get_color(const int pos[3], uint8_t c[4], void *user)
@@ -185,19 +187,9 @@ void mesh_move(mesh_t *mesh, const float mat[4][4])
 }
 
 void mesh_blit(mesh_t *mesh, const uint8_t *data,
-               int x, int y, int z, int w, int h, int d,
-               mesh_iterator_t *iter)
+               int x, int y, int z, int w, int h, int d)
 {
-    mesh_iterator_t default_iter = {0};
-    int pos[3];
-    if (!iter) iter = &default_iter;
-    for (pos[2] = z; pos[2] < z + d; pos[2]++)
-    for (pos[1] = y; pos[1] < y + h; pos[1]++)
-    for (pos[0] = x; pos[0] < x + w; pos[0]++) {
-        mesh_set_at(mesh, iter, pos, data);
-        data += 4;
-    }
-    mesh_remove_empty_blocks(mesh, false);
+    mesh_write(mesh, (int[]){x, y, z}, (int[]){w, h, d}, data);
 }
 
 void mesh_shift_alpha(mesh_t *mesh, int v)
@@ -271,21 +263,566 @@ static void combine(const uint8_t a[4], const uint8_t b[4], int mode,
     memcpy(out, ret, 4);
 }
 
+/*
+ * Versions of combine specialized for each mode, working on all the voxels
+ * of a block at once.  They give the same values as combine, but without
+ * any branch and with a constant number of iterations, so that the
+ * compiler can vectorize the loops.
+ */
+
+static void combine_voxels_over(uint8_t (*a)[4], const uint8_t (*b)[4])
+{
+    int i;
+    // The division by the alpha doesn't vectorize anyway.
+    for (i = 0; i < N * N * N; i++) combine(a[i], b[i], MODE_OVER, a[i]);
+}
+
+static void combine_voxels_sub(uint8_t (*a)[4], const uint8_t (*b)[4])
+{
+    int i;
+    for (i = 0; i < N * N * N; i++) a[i][3] = max(0, a[i][3] - b[i][3]);
+}
+
+static void combine_voxels_sub_clamp(uint8_t (*a)[4], const uint8_t (*b)[4])
+{
+    int i;
+    for (i = 0; i < N * N * N; i++) a[i][3] = min(a[i][3], 255 - b[i][3]);
+}
+
+static void combine_voxels_paint(uint8_t (*a)[4], const uint8_t (*b)[4])
+{
+    int i, j;
+    for (i = 0; i < N * N * N; i++) {
+        for (j = 0; j < 3; j++)
+            a[i][j] = mix(a[i][j], b[i][j], b[i][3] / 255.);
+    }
+}
+
+static void combine_voxels_max(uint8_t (*a)[4], const uint8_t (*b)[4])
+{
+    int i;
+    for (i = 0; i < N * N * N; i++) {
+        a[i][0] = b[i][0];
+        a[i][1] = b[i][1];
+        a[i][2] = b[i][2];
+        a[i][3] = max(a[i][3], b[i][3]);
+    }
+}
+
+static void combine_voxels_intersect(uint8_t (*a)[4], const uint8_t (*b)[4])
+{
+    int i;
+    for (i = 0; i < N * N * N; i++) a[i][3] = min(a[i][3], b[i][3]);
+}
+
+static void combine_voxels_mult_alpha(uint8_t (*a)[4],
+                                      const uint8_t (*b)[4])
+{
+    int i, j;
+    for (i = 0; i < N * N * N; i++) {
+        for (j = 0; j < 4; j++)
+            a[i][j] = a[i][j] * b[i][3] / 255;
+    }
+}
+
+// Combine all the voxels of a block with the voxels of b, in place.
+static void combine_voxels(uint8_t (*a)[4], const uint8_t (*b)[4], int mode)
+{
+    switch (mode) {
+    case MODE_OVER:         combine_voxels_over(a, b); break;
+    case MODE_SUB:          combine_voxels_sub(a, b); break;
+    case MODE_SUB_CLAMP:    combine_voxels_sub_clamp(a, b); break;
+    case MODE_PAINT:        combine_voxels_paint(a, b); break;
+    case MODE_MAX:          combine_voxels_max(a, b); break;
+    case MODE_INTERSECT:    combine_voxels_intersect(a, b); break;
+    case MODE_MULT_ALPHA:   combine_voxels_mult_alpha(a, b); break;
+    default: assert(false);
+    }
+}
+
+// Test if combining any value with c leaves it unchanged.
+static bool combine_is_identity(const uint8_t c[4], int mode)
+{
+    if (IS_IN(mode, MODE_OVER, MODE_PAINT, MODE_SUB, MODE_SUB_CLAMP))
+        return c[3] == 0;
+    if (IS_IN(mode, MODE_MULT_ALPHA, MODE_INTERSECT))
+        return c[3] == 255;
+    return false;
+}
+
+// Test if combining any value with c gives c.
+static bool combine_is_constant(const uint8_t c[4], int mode)
+{
+    return IS_IN(mode, MODE_OVER, MODE_MAX) && c[3] == 255;
+}
+
+/*
+ * Conservative classification of a block against the shape of mesh_op:
+ * return 1 if the shape value is 1 for all the voxels of the block, -1 if
+ * it is 0 for all of them, and 0 if we don't know, in which case we have
+ * to evaluate the voxels one by one.
+ *
+ * The shape functions are not distance functions, but for the sphere and
+ * the cylinder the value r(1 - |q|), with q the position scaled to the
+ * unit shape, is bounded by the smallest radius.  We keep a small margin
+ * so that the rounding errors don't matter.
+ */
+static int shape_classify_block(const shape_t *shape, const float mat[4][4],
+                                const float size[3], float smoothness,
+                                const int bpos[3])
+{
+    const float eps = 0.01;
+    float p[3], lo[3] = {INFINITY, INFINITY, INFINITY},
+          hi[3] = {-INFINITY, -INFINITY, -INFINITY}, q[3], r, k;
+    float qmax = 0, qmin = 0, qxy_max = 0, qxy_min = 0;
+    int i, j;
+
+    // Bounds of the voxels centers in the shape space.
+    for (i = 0; i < 8; i++) {
+        for (j = 0; j < 3; j++)
+            p[j] = bpos[j] + ((i >> j) & 1 ? N - 0.5 : 0.5);
+        mat4_mul_vec3(mat, p, p);
+        for (j = 0; j < 3; j++) {
+            lo[j] = min(lo[j], p[j]);
+            hi[j] = max(hi[j], p[j]);
+        }
+    }
+    k = smoothness + eps;
+
+    if (shape == &shape_cube) {
+        for (j = 0; j < 3; j++) {
+            if (hi[j] < -size[j] - k || lo[j] >= size[j] + k) return -1;
+        }
+        for (j = 0; j < 3; j++) {
+            if (lo[j] < -size[j] + k || hi[j] >= size[j] - k) return 0;
+        }
+        return 1;
+    }
+
+    if (shape != &shape_sphere && shape != &shape_cylinder) return 0;
+    if (min3(size[0], size[1], size[2]) <= 0) return 0;
+    // Smallest and biggest norms of the scaled positions, the smallest one
+    // from the bounding box so that it's still conservative.
+    for (j = 0; j < 3; j++) {
+        q[0] = lo[j] / size[j];
+        q[1] = hi[j] / size[j];
+        r = max(q[0] * q[0], q[1] * q[1]);
+        q[2] = (q[0] > 0) ? q[0] : (q[1] < 0) ? q[1] : 0;
+        if (j < 2) {
+            qxy_max += r;
+            qxy_min += q[2] * q[2];
+        }
+        qmax += r;
+        qmin += q[2] * q[2];
+    }
+
+    if (shape == &shape_sphere) {
+        r = min3(size[0], size[1], size[2]);
+        if (sqrt(qmax) <= 1 - k / r) return 1;
+        if (sqrt(qmin) >= 1 + k / r) return -1;
+        return 0;
+    }
+
+    // Cylinder.
+    r = min(size[0], size[1]);
+    if (    sqrt(qxy_min) >= 1 + k / r ||
+            lo[2] >= size[2] + k || hi[2] <= -size[2] - k)
+        return -1;
+    if (    sqrt(qxy_max) <= 1 - k / r &&
+            lo[2] >= -size[2] + k && hi[2] <= size[2] - k)
+        return 1;
+    return 0;
+}
+
+/*
+ * Combine the voxels of a block with an array of BLOCK_SIZE^3 values.  Only
+ * the voxels whose bit is set in mask are changed, or all of them if mask
+ * is NULL.
+ */
+static void combine_voxels_masked(uint8_t (*voxels)[4],
+                                  const uint8_t (*src)[4],
+                                  const uint64_t *mask, int mode)
+{
+    int i;
+    uint8_t (*tmp)[4];
+
+    if (!mask) {
+        combine_voxels(voxels, src, mode);
+        return;
+    }
+    tmp = malloc(N * N * N * 4);
+    memcpy(tmp, voxels, N * N * N * 4);
+    combine_voxels(tmp, src, mode);
+    for (i = 0; i < N * N * N; i++) {
+        if (mask[i / 64] & (1ULL << (i % 64)))
+            memcpy(voxels[i], tmp[i], 4);
+    }
+    free(tmp);
+}
+
+// Same as combine_voxels_masked, but on a block of a mesh.
+static void block_combine_voxels(mesh_t *mesh, const int bpos[3],
+                                 const uint8_t (*src)[4],
+                                 const uint64_t *mask, int mode)
+{
+    uint8_t (*orig)[4], (*voxels)[4];
+
+    orig = malloc(2 * N * N * N * 4);
+    voxels = orig + N * N * N;
+    mesh_read(mesh, bpos, (int[]){N, N, N}, orig[0]);
+    memcpy(voxels, orig, N * N * N * 4);
+    combine_voxels_masked(voxels, src, mask, mode);
+    if (memcmp(voxels, orig, N * N * N * 4))
+        mesh_write_block(mesh, bpos, voxels);
+    free(orig);
+}
+
+// Combine all the voxels of a block with the same color.
+static void block_combine(mesh_t *mesh, mesh_accessor_t *accessor,
+                          const int bpos[3], const uint8_t c[4], int mode,
+                          bool skip_dst_empty)
+{
+    uint8_t value[4], new_value[4], (*src)[4];
+    uint64_t mask[N * N * N / 64];
+    int i;
+
+    if (combine_is_identity(c, mode)) return;
+    if (mesh_block_is_uniform(mesh, accessor, bpos, value)) {
+        if (!value[3] && skip_dst_empty) return;
+        combine(value, c, mode, new_value);
+        if (!vec4_equal(value, new_value))
+            mesh_fill_block(mesh, bpos, new_value);
+        return;
+    }
+    if (combine_is_constant(c, mode)) {
+        mesh_fill_block(mesh, bpos, c);
+        return;
+    }
+    if (skip_dst_empty) mesh_get_block_mask(mesh, accessor, bpos, mask);
+    src = malloc(N * N * N * 4);
+    for (i = 0; i < N * N * N; i++) memcpy(src[i], c, 4);
+    block_combine_voxels(mesh, bpos, src, skip_dst_empty ? mask : NULL, mode);
+    free(src);
+}
+
+/*
+ * Below this number of blocks, running the blocks functions on the workers
+ * costs more than it saves.
+ */
+#define MIN_PARALLEL_BLOCKS 16
+
+typedef struct {
+    mesh_t      *mesh;
+    const int   (*bpos)[3];
+    mesh_t      **shards;
+    int         *owners;
+    void        (*func)(mesh_t *mesh, const int bpos[3], void *user);
+    void        *user;
+} apply_blocks_t;
+
+static void apply_blocks_task(int i, int worker, void *user)
+{
+    apply_blocks_t *apply = user;
+    mesh_t *shard = apply->shards[worker];
+    const int *bpos = apply->bpos[i];
+    if (mesh_get_block_id(apply->mesh, NULL, bpos))
+        mesh_copy_block(apply->mesh, bpos, shard, bpos);
+    apply->func(shard, bpos, apply->user);
+    apply->owners[i] = worker;
+}
+
+/*
+ * Call a function on a list of blocks of a mesh.  The function can only
+ * modify the block at the position it gets.
+ *
+ * With enough blocks the calls are run in parallel on the workers.  Since
+ * a mesh can only be modified by one thread at a time, each worker then
+ * writes into its own mesh, starting with a copy of the block (that only
+ * shares the data), and we put back the resulting blocks in the order of
+ * the list, so that the result doesn't depend on the scheduling.
+ */
+static void apply_blocks(mesh_t *mesh, int nb, const int (*bpos)[3],
+                         void (*func)(mesh_t *mesh, const int bpos[3],
+                                      void *user),
+                         void *user)
+{
+    int i, nb_workers = workers_get_count();
+    uint64_t id;
+    mesh_t *shard;
+    apply_blocks_t apply = {mesh, bpos, NULL, NULL, func, user};
+
+    if (nb_workers < 2 || nb < MIN_PARALLEL_BLOCKS) {
+        for (i = 0; i < nb; i++) func(mesh, bpos[i], user);
+        return;
+    }
+
+    apply.shards = calloc(nb_workers, sizeof(*apply.shards));
+    apply.owners = calloc(nb, sizeof(*apply.owners));
+    for (i = 0; i < nb_workers; i++) {
+        apply.shards[i] = mesh_new();
+        mesh_begin_edit(apply.shards[i]);
+    }
+    workers_run(nb, apply_blocks_task, &apply);
+    for (i = 0; i < nb; i++) {
+        shard = apply.shards[apply.owners[i]];
+        id = mesh_get_block_id(shard, NULL, bpos[i]);
+        if (id && id != mesh_get_block_id(mesh, NULL, bpos[i]))
+            mesh_copy_block(shard, bpos[i], mesh, bpos[i]);
+    }
+    for (i = 0; i < nb_workers; i++) {
+        mesh_end_edit(apply.shards[i]);
+        mesh_delete(apply.shards[i]);
+    }
+    free(apply.shards);
+    free(apply.owners);
+}
+
+// Return the list of the blocks positions of a blocks iterator.
+static int iter_get_blocks(mesh_iterator_t *iter, int (**ret)[3])
+{
+    int nb = 0, size = 0, bpos[3];
+    *ret = NULL;
+    while (mesh_iter(iter, bpos)) {
+        if (nb == size) {
+            size = max(size * 2, 64);
+            *ret = realloc(*ret, size * sizeof(**ret));
+        }
+        memcpy((*ret)[nb++], bpos, sizeof(bpos));
+    }
+    return nb;
+}
+
+// One of the mirrored copies of the shape of mesh_op.
+typedef struct {
+    float           box[4][4];
+    float           mat[4][4];
+    float           size[3];
+    int             aabb[2][3]; // Range of the blocks visited by this pass.
+} op_pass_t;
+
+// The values of mesh_op that are the same for all the blocks.
+typedef struct {
+    const painter_t *painter;
+    int             nb_passes;
+    op_pass_t       passes[8];
+    bool            use_box;
+    bool            skip_src_empty;
+    bool            skip_dst_empty;
+} op_t;
+
+// Classify a block against the shape of a pass, see shape_classify_block.
+static int op_classify_block(const op_t *op, const op_pass_t *pass,
+                             const int bpos[3])
+{
+    const painter_t *painter = op->painter;
+    int i, j;
+    float p[3];
+
+    if (op->use_box) {
+        // Only if the whole block is in the clipping box.
+        for (i = 0; i < 8; i++) {
+            for (j = 0; j < 3; j++)
+                p[j] = bpos[j] + ((i >> j) & 1 ? N - 0.5 : 0.5);
+            if (!bbox_contains_vec(*painter->box, p)) return 0;
+        }
+    }
+    return shape_classify_block(painter->shape, pass->mat, pass->size,
+                                painter->smoothness, bpos);
+}
+
+// Apply a pass of mesh_op to the voxels of a block.
+static void op_pass_voxels(const op_t *op, const op_pass_t *pass,
+                           const int bpos[3], int cls, uint8_t (*voxels)[4])
+{
+    const painter_t *painter = op->painter;
+    int i, x, vp[3];
+    uint8_t c[4], (*src)[4];
+    uint64_t mask[N * N * N / 64], row;
+    float p[3], k, v, row_p[3][N], row_k[N];
+
+    if (cls) {
+        memcpy(c, painter->color, 4);
+        if (cls == -1) c[3] = 0;
+        if (!c[3] && op->skip_src_empty) return;
+    }
+    memset(mask, op->skip_dst_empty ? 0 : 0xff, sizeof(mask));
+    for (i = 0; op->skip_dst_empty && i < N * N * N; i++) {
+        if (voxels[i][3]) mask[i / 64] |= 1ULL << (i % 64);
+    }
+    src = calloc(N * N * N, 4);
+
+    if (cls) {
+        for (i = 0; i < N * N * N; i++) memcpy(src[i], c, 4);
+        combine_voxels_masked(voxels, src, mask, painter->mode);
+        free(src);
+        return;
+    }
+
+    // Evaluate the shape one row of the block at a time, and put the
+    // values in an array, removing from the mask the voxels we skip.
+    for (i = 0; i < N * N * N; i += N) {
+        row = (mask[i / 64] >> (i % 64)) & ((1ULL << N) - 1);
+        if (!row) continue;
+        vp[1] = bpos[1] + i / N % N;
+        vp[2] = bpos[2] + i / (N * N);
+        for (x = 0; x < N; x++) {
+            vec3_set(p, bpos[0] + x + 0.5, vp[1] + 0.5, vp[2] + 0.5);
+            mat4_mul_vec3(pass->mat, p, p);
+            row_p[0][x] = p[0];
+            row_p[1][x] = p[1];
+            row_p[2][x] = p[2];
+        }
+        painter->shape->func_batch(N, row_p[0], row_p[1], row_p[2],
+                                   pass->size, painter->smoothness, row_k);
+        for (x = 0; x < N; x++) {
+            if (!(row & (1ULL << x))) continue;
+            vec3_set(p, bpos[0] + x + 0.5, vp[1] + 0.5, vp[2] + 0.5);
+            k = clamp(row_k[x] / painter->smoothness, -1.0f, 1.0f);
+            v = k / 2.0f + 0.5f;
+            memcpy(c, painter->color, 4);
+            c[3] *= v;
+            if (    (op->use_box && !bbox_contains_vec(*painter->box, p)) ||
+                    (!c[3] && op->skip_src_empty)) {
+                mask[(i + x) / 64] &= ~(1ULL << ((i + x) % 64));
+                continue;
+            }
+            memcpy(src[i + x], c, 4);
+        }
+    }
+    combine_voxels_masked(voxels, src, mask, painter->mode);
+    free(src);
+}
+
+/*
+ * Apply all the passes of mesh_op to a block, in order.
+ *
+ * The blocks entirely inside or outside the shape are combined directly in
+ * the mesh.  Once a pass needs to evaluate the voxels one by one, we read
+ * the block into an array and do the next passes on it, so that the block
+ * is only written once.
+ */
+static void op_block(mesh_t *mesh, const int bpos[3], void *user)
+{
+    const op_t *op = user;
+    const op_pass_t *pass;
+    int i, j, cls;
+    uint8_t c[4], (*orig)[4] = NULL, (*voxels)[4] = NULL;
+    mesh_accessor_t accessor = mesh_get_accessor(mesh);
+
+    for (i = 0; i < op->nb_passes; i++) {
+        pass = &op->passes[i];
+        for (j = 0; j < 3; j++) {
+            if (    bpos[j] < pass->aabb[0][j] ||
+                    bpos[j] > pass->aabb[1][j]) break;
+        }
+        if (j < 3) continue;
+        cls = op_classify_block(op, pass, bpos);
+        if (cls && !voxels) {
+            memcpy(c, op->painter->color, 4);
+            if (cls == -1) c[3] = 0;
+            if (!c[3] && op->skip_src_empty) continue;
+            block_combine(mesh, &accessor, bpos, c, op->painter->mode,
+                          op->skip_dst_empty);
+            continue;
+        }
+        if (!voxels) {
+            // Nothing to do on the empty voxels.
+            if (    op->skip_dst_empty &&
+                    !mesh_get_block_mask(mesh, &accessor, bpos, NULL))
+                continue;
+            orig = malloc(2 * N * N * N * 4);
+            voxels = orig + N * N * N;
+            mesh_read(mesh, bpos, (int[]){N, N, N}, orig[0]);
+            memcpy(voxels, orig, N * N * N * 4);
+        }
+        op_pass_voxels(op, pass, bpos, cls, voxels);
+    }
+    if (voxels && memcmp(voxels, orig, N * N * N * 4))
+        mesh_write_block(mesh, bpos, voxels);
+    free(orig);
+}
+
+/*
+ * Add the passes of a mesh_op with symmetry: one per mirrored copy of the
+ * box, in the same order as if we applied the op once per copy, starting
+ * from the most mirrored ones.
+ */
+static void op_add_passes(op_t *op, const float box[4][4], int symmetry)
+{
+    int i;
+    float box2[4][4];
+    op_pass_t *pass;
+
+    for (i = 0; i < 3; i++) {
+        if (!(symmetry & (1 << i))) continue;
+        symmetry &= ~(1 << i);
+        mat4_set_identity(box2);
+        if (i == 0) mat4_iscale(box2, -1,  1,  1);
+        if (i == 1) mat4_iscale(box2,  1, -1,  1);
+        if (i == 2) mat4_iscale(box2,  1,  1, -1);
+        mat4_imul(box2, box);
+        op_add_passes(op, box2, symmetry);
+    }
+    assert(op->nb_passes < ARRAY_SIZE(op->passes));
+    pass = &op->passes[op->nb_passes++];
+    mat4_copy(box, pass->box);
+    box_get_size(box, pass->size);
+    mat4_copy(box, pass->mat);
+    mat4_iscale(pass->mat, 1 / pass->size[0], 1 / pass->size[1],
+                1 / pass->size[2]);
+    mat4_invert(pass->mat, pass->mat);
+}
+
+typedef struct {
+    int pos[3];
+    int i;
+} block_index_t;
+
+static int block_index_cmp(const void *a_, const void *b_)
+{
+    const block_index_t *a = a_, *b = b_;
+    int i;
+    for (i = 2; i >= 0; i--) {
+        if (a->pos[i] != b->pos[i]) return a->pos[i] < b->pos[i] ? -1 : 1;
+    }
+    return a->i - b->i;
+}
+
+// Remove the duplicated positions from a list of blocks, keeping the
+// first ones in the same order.  Return the new number of blocks.
+static int blocks_remove_duplicates(int nb, int (*bpos)[3])
+{
+    int i, j;
+    block_index_t *sorted;
+    bool *keep;
+
+    sorted = malloc(nb * sizeof(*sorted));
+    keep = calloc(nb, sizeof(*keep));
+    for (i = 0; i < nb; i++) {
+        memcpy(sorted[i].pos, bpos[i], sizeof(sorted[i].pos));
+        sorted[i].i = i;
+    }
+    qsort(sorted, nb, sizeof(*sorted), block_index_cmp);
+    for (i = 0; i < nb; i++) {
+        keep[sorted[i].i] = i == 0 ||
+            memcmp(sorted[i].pos, sorted[i - 1].pos, sizeof(int[3]));
+    }
+    for (i = 0, j = 0; i < nb; i++) {
+        if (keep[i]) memmove(bpos[j++], bpos[i], sizeof(int[3]));
+    }
+    free(sorted);
+    free(keep);
+    return j;
+}
 
 void mesh_op(mesh_t *mesh, const painter_t *painter, const float box[4][4])
 {
-    int i, vp[3];
-    uint8_t value[4], new_value[4], c[4];
+    int i, j, k, nb = 0, nb_pass;
+    int (*blocks)[3] = NULL, (*pass_blocks)[3];
     mesh_iterator_t iter;
-    mesh_accessor_t accessor;
-    float size[3], p[3];
-    float mat[4][4];
-    float (*shape_func)(const float[3], const float[3], float smoothness);
-    float k, v;
     int mode = painter->mode;
-    bool use_box, skip_src_empty, skip_dst_empty;
-    painter_t painter2;
-    float box2[4][4];
+    op_t op = {painter};
+    op_pass_t *pass;
     mesh_t *cached;
     static cache_t *cache = NULL;
 
@@ -306,58 +843,54 @@ void mesh_op(mesh_t *mesh, const painter_t *painter, const float box[4][4])
         return;
     }
 
-    if (painter->symmetry) {
-        painter2 = *painter;
-        for (i = 0; i < 3; i++) {
-            if (!(painter->symmetry & (1 << i))) continue;
-            painter2.symmetry &= ~(1 << i);
-            mat4_set_identity(box2);
-            if (i == 0) mat4_iscale(box2, -1,  1,  1);
-            if (i == 1) mat4_iscale(box2,  1, -1,  1);
-            if (i == 2) mat4_iscale(box2,  1,  1, -1);
-            mat4_imul(box2, box);
-            mesh_op(mesh, &painter2, box2);
-        }
-    }
-
-    shape_func = painter->shape->func;
-    box_get_size(box, size);
-    mat4_copy(box, mat);
-    mat4_iscale(mat, 1 / size[0], 1 / size[1], 1 / size[2]);
-    mat4_invert(mat, mat);
-    use_box = painter->box && !box_is_null(*painter->box);
+    mesh_begin_edit(mesh);
+    // With symmetry we apply all the mirrored shapes in a single traversal
+    // of the blocks.  Since the voxels are independent, doing all the
+    // passes on each block gives the same result as doing each pass on
+    // the whole mesh.
+    op_add_passes(&op, box, painter->symmetry);
+    op.use_box = painter->box && !box_is_null(*painter->box);
     // XXX: cleanup.
-    skip_src_empty = IS_IN(mode, MODE_SUB, MODE_SUB_CLAMP, MODE_MULT_ALPHA);
-    skip_dst_empty = IS_IN(mode, MODE_SUB, MODE_SUB_CLAMP, MODE_MULT_ALPHA,
-                                 MODE_INTERSECT);
-    if (mode != MODE_INTERSECT) {
-        iter = mesh_get_box_iterator(mesh, box,
-                skip_dst_empty ? MESH_ITER_SKIP_EMPTY : 0);
-    } else {
-        iter = mesh_get_iterator(mesh,
-                skip_dst_empty ? MESH_ITER_SKIP_EMPTY : 0);
-    }
+    op.skip_src_empty = IS_IN(mode, MODE_SUB, MODE_SUB_CLAMP,
+                                    MODE_MULT_ALPHA);
+    op.skip_dst_empty = IS_IN(mode, MODE_SUB, MODE_SUB_CLAMP,
+                                    MODE_MULT_ALPHA, MODE_INTERSECT);
 
-    // XXX: for the moment we cannot use the same accessor for both
-    // setting and getting!  Need to fix that!!
-    accessor = mesh_get_accessor(mesh);
-    while (mesh_iter(&iter, vp)) {
-        vec3_set(p, vp[0] + 0.5, vp[1] + 0.5, vp[2] + 0.5);
-        if (use_box && !bbox_contains_vec(*painter->box, p)) continue;
-        mat4_mul_vec3(mat, p, p);
-        k = shape_func(p, size, painter->smoothness);
-        k = clamp(k / painter->smoothness, -1.0f, 1.0f);
-        v = k / 2.0f + 0.5f;
-        if (!v && skip_src_empty) continue;
-        memcpy(c, painter->color, 4);
-        c[3] *= v;
-        if (!c[3] && skip_src_empty) continue;
-        mesh_get_at(mesh, &accessor, vp, value);
-        if (!value[3] && skip_dst_empty) continue;
-        combine(value, c, mode, new_value);
-        if (!vec4_equal(value, new_value))
-            mesh_set_at(mesh, &accessor, vp, new_value);
+    // We work block by block, and first check if they are entirely inside
+    // or outside the shape, so that for big shapes we only have to evaluate
+    // the voxels of the blocks crossing the surface.
+    //
+    // The ops that skip the empty voxels never add any, so we can already
+    // skip the empty blocks for all the passes.  Each pass keeps the range
+    // of its blocks, the other blocks in the range being empty.
+    for (i = 0; i < op.nb_passes; i++) {
+        pass = &op.passes[i];
+        if (mode != MODE_INTERSECT) {
+            iter = mesh_get_box_iterator(mesh, pass->box, MESH_ITER_BLOCKS |
+                    (op.skip_dst_empty ? MESH_ITER_SKIP_EMPTY : 0));
+        } else {
+            iter = mesh_get_iterator(mesh, MESH_ITER_BLOCKS |
+                    (op.skip_dst_empty ? MESH_ITER_SKIP_EMPTY : 0));
+        }
+        nb_pass = iter_get_blocks(&iter, &pass_blocks);
+        memcpy(pass->aabb, (int[2][3]){{INT_MAX, INT_MAX, INT_MAX},
+                                       {INT_MIN, INT_MIN, INT_MIN}},
+               sizeof(pass->aabb));
+        for (j = 0; j < nb_pass; j++) {
+            for (k = 0; k < 3; k++) {
+                pass->aabb[0][k] = min(pass->aabb[0][k], pass_blocks[j][k]);
+                pass->aabb[1][k] = max(pass->aabb[1][k], pass_blocks[j][k]);
+            }
+        }
+        blocks = realloc(blocks, (nb + nb_pass) * sizeof(*blocks));
+        memcpy(blocks + nb, pass_blocks, nb_pass * sizeof(*blocks));
+        nb += nb_pass;
+        free(pass_blocks);
     }
+    if (op.nb_passes > 1) nb = blocks_remove_duplicates(nb, blocks);
+    apply_blocks(mesh, nb, blocks, op_block, &op);
+    free(blocks);
+    mesh_end_edit(mesh);
 
     cache_add(cache, &key, sizeof(key), mesh_copy(mesh), 1, mesh_del);
 }
@@ -370,19 +903,31 @@ void mesh_get_box(const mesh_t *mesh, bool exact, float box[4][4])
     bbox_from_aabb(box, bbox);
 }
 
+// Cache of the merged blocks, see block_merge.
+static cache_t *g_merge_cache = NULL;
+static bool g_merge_cache_lock = false;
+
+static void merge_cache_lock(void)
+{
+    while (__atomic_test_and_set(&g_merge_cache_lock, __ATOMIC_ACQUIRE)) {}
+}
+
+static void merge_cache_unlock(void)
+{
+    __atomic_clear(&g_merge_cache_lock, __ATOMIC_RELEASE);
+}
+
 static void block_merge(mesh_t *mesh, const mesh_t *other, const int pos[3],
                         int mode, const uint8_t color[4])
 {
-    int p[3];
-    int x, y, z;
+    int i;
     uint64_t id1, id2;
     mesh_t *block;
-    uint8_t v1[4], v2[4];
-    static cache_t *cache = NULL;
-    mesh_accessor_t a1, a2, a3;
+    uint8_t v1[4], v2[4], (*voxels1)[4], (*voxels2)[4];
+    bool cached;
 
-    mesh_get_block_data(mesh,  NULL, pos, &id1);
-    mesh_get_block_data(other, NULL, pos, &id2);
+    id1 = mesh_get_block_id(mesh,  NULL, pos);
+    id2 = mesh_get_block_id(other, NULL, pos);
 
     // XXX: cleanup this code!
 
@@ -401,8 +946,21 @@ static void block_merge(mesh_t *mesh, const mesh_t *other, const int pos[3],
         // XXX: could just delete the block.
     }
 
-    // Check if the merge op has been cached.
-    if (!cache) cache = cache_create(512);
+    // If both blocks are uniform, so is the result.  We don't touch the
+    // block if it doesn't change, so that it keeps its id, and we don't
+    // add a block to get an empty one.  The blocks that become empty are
+    // removed at the end of the merge.
+    if (    mesh_block_is_uniform(mesh, NULL, pos, v1) &&
+            mesh_block_is_uniform(other, NULL, pos, v2)) {
+        if (color) color_mul(v2, color, v2);
+        combine(v1, v2, mode, v2);
+        if (memcmp(v1, v2, 4) == 0 || (!v2[3] && id1 == 0)) return;
+        mesh_fill_block(mesh, pos, v2);
+        return;
+    }
+
+    // Check if the merge op has been cached.  The blocks can be merged
+    // from several workers, so we only access the cache with the lock.
     struct {
         uint64_t id1;
         uint64_t id2;
@@ -411,31 +969,45 @@ static void block_merge(mesh_t *mesh, const mesh_t *other, const int pos[3],
     } key = { id1, id2, mode };
     if (color) memcpy(key.color, color, 4);
     _Static_assert(sizeof(key) == 24, "");
-    block = cache_get(cache, &key, sizeof(key));
-    if (block) goto end;
+    merge_cache_lock();
+    if (!g_merge_cache) g_merge_cache = cache_create(512);
+    block = cache_get(g_merge_cache, &key, sizeof(key));
+    if (block) mesh_copy_block(block, (int[]){0, 0, 0}, mesh, pos);
+    merge_cache_unlock();
+    if (block) return;
 
-    block = mesh_new();
-    a1 = mesh_get_accessor(mesh);
-    a2 = mesh_get_accessor(other);
-    a3 = mesh_get_accessor(block);
-
-    for (z = 0; z < N; z++)
-    for (y = 0; y < N; y++)
-    for (x = 0; x < N; x++) {
-        p[0] = pos[0] + x;
-        p[1] = pos[1] + y;
-        p[2] = pos[2] + z;
-        mesh_get_at(mesh, &a1, p, v1);
-        mesh_get_at(other, &a2, p, v2);
-        if (color) color_mul(v2, color, v2);
-        combine(v1, v2, mode, v1);
-        mesh_set_at(block, &a3, (int[]){x, y, z}, v1);
+    voxels1 = malloc(2 * N * N * N * 4);
+    voxels2 = voxels1 + N * N * N;
+    mesh_read(mesh, pos, (int[]){N, N, N}, voxels1[0]);
+    mesh_read(other, pos, (int[]){N, N, N}, voxels2[0]);
+    if (color) {
+        for (i = 0; i < N * N * N; i++)
+            color_mul(voxels2[i], color, voxels2[i]);
     }
-    cache_add(cache, &key, sizeof(key), block, 1, mesh_del);
-
-end:
+    combine_voxels(voxels1, voxels2, mode);
+    block = mesh_new();
+    mesh_write_block(block, (int[]){0, 0, 0}, voxels1);
+    free(voxels1);
     mesh_copy_block(block, (int[]){0, 0, 0}, mesh, pos);
-    return;
+    merge_cache_lock();
+    // Another worker could have merged the same blocks in the meantime.
+    cached = cache_get(g_merge_cache, &key, sizeof(key)) != NULL;
+    if (!cached)
+        cache_add(g_merge_cache, &key, sizeof(key), block, 1, mesh_del);
+    merge_cache_unlock();
+    if (cached) mesh_delete(block);
+}
+
+typedef struct {
+    const mesh_t    *other;
+    int             mode;
+    const uint8_t   *color;
+} merge_t;
+
+static void merge_block(mesh_t *mesh, const int bpos[3], void *user)
+{
+    const merge_t *merge = user;
+    block_merge(mesh, merge->other, bpos, merge->mode, merge->color);
 }
 
 void mesh_merge(mesh_t *mesh, const mesh_t *other, int mode,
@@ -445,8 +1017,10 @@ void mesh_merge(mesh_t *mesh, const mesh_t *other, int mode,
     assert(mesh && other);
     static cache_t *cache = NULL;
     mesh_iterator_t iter;
-    int bpos[3];
+    int nb;
+    int (*blocks)[3];
     uint64_t id1, id2;
+    merge_t merge = {other, mode, color};
 
     // Check if the merge op has been cached.
     if (!cache) cache = cache_create(512);
@@ -467,13 +1041,75 @@ void mesh_merge(mesh_t *mesh, const mesh_t *other, int mode,
     }
 
     iter = mesh_get_union_iterator(mesh, other, MESH_ITER_BLOCKS);
-    while (mesh_iter(&iter, bpos)) {
-        block_merge(mesh, other, bpos, mode, color);
-    }
+    nb = iter_get_blocks(&iter, &blocks);
+    apply_blocks(mesh, nb, blocks, merge_block, &merge);
+    free(blocks);
+    mesh_remove_empty_blocks(mesh, false);
 
     cache_add(cache, &key, sizeof(key), mesh_copy(mesh), 1, mesh_del);
 }
 
+typedef struct {
+    mesh_t              *mesh;
+    const mesh_t *const *others;
+    int                 nb;
+    int                 mode;
+} merge_all_t;
+
+// Merge all the meshes blocks at a given position, for mesh_merge_all.
+static void merge_all_block(const int pos[3], uint32_t mask, void *user)
+{
+    merge_all_t *merge = user;
+    int i;
+    bool has_block = mask & 1;
+    // Those modes don't change anything where the other mesh has no block.
+    bool skip_empty = IS_IN(merge->mode, MODE_OVER, MODE_MAX, MODE_SUB,
+                            MODE_SUB_CLAMP);
+    // Only merge the blocks that the successive mesh_merge calls would
+    // visit: where the mesh or the other mesh has a block.
+    for (i = 0; i < merge->nb; i++) {
+        if (!(mask & (2U << i)) && (skip_empty || !has_block)) continue;
+        block_merge(merge->mesh, merge->others[i], pos, merge->mode, NULL);
+        has_block = true;
+    }
+}
+
+void mesh_merge_all(mesh_t *mesh, const mesh_t *const *others, int nb,
+                    int mode)
+{
+    static cache_t *cache = NULL;
+    const mesh_t *meshes[32];
+    uint64_t key[32];
+    mesh_t *cached;
+    merge_all_t merge = {mesh, others, nb, mode};
+    int i;
+
+    // We can only visit up to 32 meshes at once.
+    if (nb > 30) {
+        for (i = 0; i < nb; i++) mesh_merge(mesh, others[i], mode, NULL);
+        return;
+    }
+
+    // Check if the merge op has been cached.
+    if (!cache) cache = cache_create(32);
+    key[0] = mode;
+    key[1] = mesh_get_key(mesh);
+    for (i = 0; i < nb; i++) key[i + 2] = mesh_get_key(others[i]);
+    cached = cache_get(cache, key, (nb + 2) * sizeof(*key));
+    if (cached) {
+        mesh_set(mesh, cached);
+        return;
+    }
+
+    meshes[0] = mesh;
+    memcpy(meshes + 1, others, nb * sizeof(*others));
+    mesh_visit_union_blocks(meshes, nb + 1, merge_all_block, &merge);
+    mesh_remove_empty_blocks(mesh, false);
+
+    cache_add(cache, key, (nb + 2) * sizeof(*key), mesh_copy(mesh), 1,
+              mesh_del);
+}
+
 void mesh_crop(mesh_t *mesh, const float box[4][4])
 {
     painter_t painter = {
@@ -414,7 +414,6 @@ static render_item_t *get_item_for_block(
     const int effects_mask = EFFECT_BORDERS | EFFECT_BORDERS_ALL |
                              EFFECT_MARCHING_CUBES | EFFECT_SMOOTH |
                              EFFECT_FLAT;
-    uint64_t block_data_id;
     int p[3], i, x, y, z;
     block_item_key_t key = {};
 
@@ -431,8 +430,7 @@ static render_item_t *get_item_for_block(
         p[0] = block_pos[0] + x * BLOCK_SIZE;
         p[1] = block_pos[1] + y * BLOCK_SIZE;
         p[2] = block_pos[2] + z * BLOCK_SIZE;
-        mesh_get_block_data(mesh, NULL, p, &block_data_id);
-        key.ids[i] = block_data_id;
+        key.ids[i] = mesh_get_block_id(mesh, NULL, p);
     }
 
     item = cache_get(g_items_cache, &key, sizeof(key));
@@ -74,18 +74,101 @@ static float cylinder_func(const float p[3], const float s[3],
     return min(rz, r - d);
 }
 
+/*
+ * Batched versions of the shape functions.
+ *
+ * On x86_64 we use the gcc vector extension, compiled once for SSE2
+ * (always available) with vectors of four floats, and once for AVX2 with
+ * vectors of eight floats, that we only use if the cpu supports it.
+ * Elsewhere we fall back to calling the scalar functions in a loop.
+ */
+#if defined(__x86_64__) && defined(__GNUC__)
+#define SHAPE_SIMD 1
+#include <immintrin.h>
+
+typedef float float4_t __attribute__((vector_size(16)));
+typedef int32_t mask4_t __attribute__((vector_size(16)));
+typedef float float8_t __attribute__((vector_size(32)));
+typedef int32_t mask8_t __attribute__((vector_size(32)));
+
+#define SPLAT(x) ((SIMD_FLOAT){0} + (x))
+#define ABS(v) ((SIMD_FLOAT)((SIMD_MASK)(v) & 0x7fffffff))
+#define SELECT(m, a, b) \
+    ((SIMD_FLOAT)(((SIMD_MASK)(a) & (m)) | ((SIMD_MASK)(b) & ~(m))))
+
+#define SIMD_NAME(x) x##_sse
+#define SIMD_TARGET
+#define SIMD_WIDTH 4
+#define SIMD_FLOAT float4_t
+#define SIMD_MASK mask4_t
+#define SIMD_SQRT(v) ((float4_t)_mm_sqrt_ps((__m128)(v)))
+#include "shape_simd.inl"
+#undef SIMD_NAME
+#undef SIMD_TARGET
+#undef SIMD_WIDTH
+#undef SIMD_FLOAT
+#undef SIMD_MASK
+#undef SIMD_SQRT
+
+#define SIMD_NAME(x) x##_avx2
+#define SIMD_TARGET __attribute__((target("avx2")))
+#define SIMD_WIDTH 8
+#define SIMD_FLOAT float8_t
+#define SIMD_MASK mask8_t
+#define SIMD_SQRT(v) ((float8_t)_mm256_sqrt_ps((__m256)(v)))
+#include "shape_simd.inl"
+#undef SIMD_NAME
+#undef SIMD_TARGET
+#undef SIMD_WIDTH
+#undef SIMD_FLOAT
+#undef SIMD_MASK
+#undef SIMD_SQRT
+
+#else
+#define SHAPE_SIMD 0
+#endif
+
+#define SCALAR_BATCH(name, func) \
+    static void name(int n, const float *x, const float *y, \
+                     const float *z, const float s[3], float smoothness, \
+                     float *out) \
+    { \
+        int i; \
+        for (i = 0; i < n; i++) \
+            out[i] = func(VEC(x[i], y[i], z[i]), s, smoothness); \
+    }
+
+SCALAR_BATCH(sphere_batch_scalar, sphere_func)
+SCALAR_BATCH(cube_batch_scalar, cube_func)
+SCALAR_BATCH(cylinder_batch_scalar, cylinder_func)
+
 void shapes_init(void)
 {
     shape_sphere = (shape_t){
-        .id     = "sphere",
-        .func   = sphere_func,
+        .id         = "sphere",
+        .func       = sphere_func,
+        .func_batch = sphere_batch_scalar,
     };
     shape_cube = (shape_t){
-        .id     = "cube",
-        .func   = cube_func,
+        .id         = "cube",
+        .func       = cube_func,
+        .func_batch = cube_batch_scalar,
     };
     shape_cylinder = (shape_t){
-        .id     = "cylinder",
-        .func = cylinder_func,
+        .id         = "cylinder",
+        .func       = cylinder_func,
+        .func_batch = cylinder_batch_scalar,
     };
+
+#if SHAPE_SIMD
+    if (__builtin_cpu_supports("avx2")) {
+        shape_sphere.func_batch = sphere_batch_avx2;
+        shape_cube.func_batch = cube_batch_avx2;
+        shape_cylinder.func_batch = cylinder_batch_avx2;
+    } else {
+        shape_sphere.func_batch = sphere_batch_sse;
+        shape_cube.func_batch = cube_batch_sse;
+        shape_cylinder.func_batch = cylinder_batch_sse;
+    }
+#endif
 }
@@ -0,0 +1,127 @@
+/* Goxel 3D voxels editor
+ *
+ * copyright (c) 2015 Guillaume Chereau <guillaume@noctua-software.com>
+ *
+ * Goxel is free software: you can redistribute it and/or modify it under the
+ * terms of the GNU General Public License as published by the Free Software
+ * Foundation, either version 3 of the License, or (at your option) any later
+ * version.
+
+ * Goxel is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details.
+
+ * You should have received a copy of the GNU General Public License along with
+ * goxel.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Batched shape functions, evaluating several positions at once.
+ *
+ * This file is included several times by shape.c, once per instruction set,
+ * with the following macros defined:
+ *
+ *   SIMD_NAME(x)   - Name of the functions for this instruction set.
+ *   SIMD_TARGET    - Function attribute for this instruction set.
+ *   SIMD_WIDTH     - Number of floats in a vector (4 or 8).
+ *   SIMD_FLOAT     - Vector type of SIMD_WIDTH floats.
+ *   SIMD_MASK      - Vector type of SIMD_WIDTH int32, for the comparisons.
+ *   SIMD_SQRT(v)   - Square root of a SIMD_FLOAT.
+ *
+ * The operations are done in the same order as in the scalar functions, so
+ * that we get exactly the same values.
+ */
+
+#define LOAD(v, src) memcpy(&(v), (src), sizeof(SIMD_FLOAT))
+#define STORE(dst, v) memcpy((dst), &(v), sizeof(SIMD_FLOAT))
+
+SIMD_TARGET
+static void SIMD_NAME(sphere_batch)(int n, const float *x, const float *y,
+                                    const float *z, const float s[3],
+                                    float smoothness, float *out)
+{
+    int i;
+    SIMD_FLOAT px, py, pz, d, u[3], r, ret;
+    SIMD_MASK zero;
+
+    for (i = 0; i < n; i += SIMD_WIDTH) {
+        LOAD(px, x + i);
+        LOAD(py, y + i);
+        LOAD(pz, z + i);
+        d = SIMD_SQRT(px * px + py * py + pz * pz);
+        u[0] = s[1] * s[2] * px / d;
+        u[1] = s[0] * s[2] * py / d;
+        u[2] = s[0] * s[1] * pz / d;
+        r = s[0] * s[1] * s[2] /
+            SIMD_SQRT(u[0] * u[0] + u[1] * u[1] + u[2] * u[2]);
+        ret = r - d;
+        zero = (px == 0) & (py == 0) & (pz == 0);
+        ret = SELECT(zero, SPLAT(max3(s[0], s[1], s[2])), ret);
+        STORE(out + i, ret);
+    }
+}
+
+SIMD_TARGET
+static void SIMD_NAME(cube_batch)(int n, const float *x, const float *y,
+                                  const float *z, const float s[3],
+                                  float sm, float *out)
+{
+    int i, j;
+    SIMD_FLOAT p[3], a, v, min_v, ret;
+    SIMD_MASK outside, inside, m;
+    const SIMD_FLOAT inf = SPLAT(INFINITY);
+
+    for (i = 0; i < n; i += SIMD_WIDTH) {
+        LOAD(p[0], x + i);
+        LOAD(p[1], y + i);
+        LOAD(p[2], z + i);
+        outside = (p[0] < -s[0] - sm) | (p[0] >= +s[0] + sm) |
+                  (p[1] < -s[1] - sm) | (p[1] >= +s[1] + sm) |
+                  (p[2] < -s[2] - sm) | (p[2] >= +s[2] + sm);
+        inside = (p[0] >= -s[0] + sm) & (p[0] < +s[0] - sm) &
+                 (p[1] >= -s[1] + sm) & (p[1] < +s[1] - sm) &
+                 (p[2] >= -s[2] + sm) & (p[2] < +s[2] - sm);
+        min_v = inf;
+        ret = inf;
+        for (j = 0; j < 3; j++) {
+            a = ABS(p[j]);
+            v = s[j] / a;
+            m = (p[j] != 0) & (v < min_v);
+            min_v = SELECT(m, v, min_v);
+            ret = SELECT(m, s[j] - a, ret);
+        }
+        ret = SELECT(inside, inf, ret);
+        ret = SELECT(outside, -inf, ret);
+        STORE(out + i, ret);
+    }
+}
+
+SIMD_TARGET
+static void SIMD_NAME(cylinder_batch)(int n, const float *x, const float *y,
+                                      const float *z, const float s[3],
+                                      float smoothness, float *out)
+{
+    int i;
+    SIMD_FLOAT px, py, pz, d, rz, u[2], r, ret;
+    SIMD_MASK zero;
+
+    for (i = 0; i < n; i += SIMD_WIDTH) {
+        LOAD(px, x + i);
+        LOAD(py, y + i);
+        LOAD(pz, z + i);
+        d = SIMD_SQRT(px * px + py * py);
+        rz = s[2] - ABS(pz);
+        u[0] = s[1] * px / d;
+        u[1] = s[0] * py / d;
+        r = s[0] * s[1] / SIMD_SQRT(u[0] * u[0] + u[1] * u[1]);
+        ret = r - d;
+        zero = (px == 0) & (py == 0);
+        ret = SELECT(zero, SPLAT(max3(s[0], s[1], s[2])), ret);
+        ret = SELECT(rz < ret, rz, ret);
+        STORE(out + i, ret);
+    }
+}
+
+#undef LOAD
+#undef STORE
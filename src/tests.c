@@ -29,7 +29,7 @@
 static void test_file(const char *b64_data, uint64_t crc32)
 {
     FILE *file;
-    size_t data_size;
+    size_t data_size, mem;
     uint8_t *data;
     if (DEFINED(WIN32)) return; // Don't test on Windows for the moment!
     data = calloc(b64_decode(b64_data, NULL), 1);
@@ -40,6 +40,10 @@ static void test_file(const char *b64_data, uint64_t crc32)
     free(data);
     action_exec2("import", "p", "/tmp/goxel_test.gox");
     TEST(mesh_crc32(goxel->image->active_layer->mesh) == crc32);
+    // Saving doesn't keep any decoded copy of the blocks.
+    mem = mesh_get_unshared_mem(goxel->image->active_layer->mesh, NULL);
+    save_to_file(goxel, "/tmp/goxel_test_save.gox", false);
+    TEST(mesh_get_unshared_mem(goxel->image->active_layer->mesh, NULL) == mem);
     image_delete(goxel->image);
     goxel->image = image_new();
     goxel_update_meshes(goxel, -1);
@@ -121,9 +125,761 @@ static void test_load_corrupt(void)
     action_exec2("import", "p", "/tmp/goxel_test.gox");
 }
 
+// Compute the exact bbox of a mesh by iterating all its voxels.
+static bool get_bbox_brute_force(const mesh_t *mesh, int bbox[2][3])
+{
+    mesh_iterator_t iter;
+    int i, pos[3];
+    bool empty = true;
+    uint8_t v[4];
+
+    memset(bbox, 0, 6 * sizeof(int));
+    iter = mesh_get_iterator(mesh, 0);
+    while (mesh_iter(&iter, pos)) {
+        mesh_get_at(mesh, &iter, pos, v);
+        if (!v[3]) continue;
+        for (i = 0; i < 3; i++) {
+            bbox[0][i] = empty ? pos[i] : min(bbox[0][i], pos[i]);
+            bbox[1][i] = empty ? pos[i] + 1 : max(bbox[1][i], pos[i] + 1);
+        }
+        empty = false;
+    }
+    return !empty;
+}
+
+// Check the exact bbox of a mesh, computed and then cached.
+static void test_bbox_check(const mesh_t *mesh)
+{
+    int bbox[2][3], expected[2][3];
+    TEST(mesh_get_bbox(mesh, bbox, true) ==
+         get_bbox_brute_force(mesh, expected));
+    TEST(memcmp(bbox, expected, sizeof(bbox)) == 0);
+    // Second call uses the cached value.
+    mesh_get_bbox(mesh, bbox, true);
+    TEST(memcmp(bbox, expected, sizeof(bbox)) == 0);
+}
+
+static void test_bbox(void)
+{
+    mesh_t *mesh = mesh_new(), *copy;
+    int i, j, pos[3], bbox[2][3];
+    uint32_t seed = 1;
+    uint8_t v[4] = {255, 0, 0, 255}, data[4][4][4][4] = {0};
+    float box[4][4];
+    painter_t painter = {
+        .mode = MODE_SUB,
+        .color = {255, 255, 255, 255},
+        .shape = &shape_cube,
+    };
+
+    TEST(!mesh_get_bbox(mesh, bbox, true));
+    for (i = 0; i < 200; i++) {
+        for (j = 0; j < 3; j++) {
+            seed = seed * 1664525u + 1013904223u;
+            pos[j] = (int)((seed >> 8) % 80) - 40;
+        }
+        // Remove the voxels from time to time to shrink the box.
+        v[3] = (i % 3 == 2) ? 0 : 255;
+        mesh_set_at(mesh, NULL, pos, v);
+        if (i % 10) continue;
+        copy = mesh_copy(mesh);
+        test_bbox_check(mesh);
+        test_bbox_check(copy);
+        mesh_delete(copy);
+    }
+
+    // The other ways to change a mesh, each after the bbox got cached.
+    data[3][3][3][3] = 255;
+    mesh_write(mesh, (int[]){50, 40, 40}, (int[]){4, 4, 4}, data[0][0][0]);
+    test_bbox_check(mesh);
+    mesh_blit(mesh, data[0][0][0], -60, 0, 0, 4, 4, 4);
+    test_bbox_check(mesh);
+    data[3][3][3][3] = 0;
+    mesh_write(mesh, (int[]){50, 40, 40}, (int[]){4, 4, 4}, data[0][0][0]);
+    test_bbox_check(mesh);
+    mesh_fill_block(mesh, (int[]){4 * BLOCK_SIZE, 0, 0}, v);
+    test_bbox_check(mesh);
+    mesh_fill_block(mesh, (int[]){4 * BLOCK_SIZE, 0, 0}, (uint8_t[4]){0});
+    test_bbox_check(mesh);
+    copy = mesh_new();
+    mesh_fill_block(copy, (int[]){0, 0, 0}, v);
+    mesh_copy_block(copy, (int[]){0, 0, 0}, mesh,
+                    (int[]){0, -4 * BLOCK_SIZE, 0});
+    test_bbox_check(mesh);
+    mesh_delete(copy);
+    bbox_from_extents(box, VEC(0, -4 * BLOCK_SIZE, 0), BLOCK_SIZE,
+                      BLOCK_SIZE / 2, BLOCK_SIZE);
+    mesh_op(mesh, &painter, box);
+    test_bbox_check(mesh);
+    mesh_delete(mesh);
+}
+
+// Writing over existing blocks with mesh_write must change the mesh key.
+static void test_write_key(void)
+{
+    const int n = BLOCK_SIZE;
+    mesh_t *mesh = mesh_new();
+    uint8_t (*data)[4];
+    uint64_t key;
+    int i, bbox[2][3], expected[2][3];
+
+    data = calloc(n * n * n, sizeof(*data));
+    for (i = 0; i < n * n * n; i++)
+        memcpy(data[i], (uint8_t[]){255, 0, 0, i % n < n / 2 ? 255 : 0}, 4);
+    mesh_write(mesh, (int[]){0, 0, 0}, (int[]){n, n, n}, data[0]);
+    mesh_get_bbox(mesh, bbox, true); // Cache the bbox.
+
+    // Overwrite the whole block.
+    key = mesh_get_key(mesh);
+    for (i = 0; i < n * n * n; i++) data[i][3] = i % n < n / 4 ? 255 : 0;
+    mesh_write(mesh, (int[]){0, 0, 0}, (int[]){n, n, n}, data[0]);
+    TEST(mesh_get_key(mesh) != key);
+    TEST(mesh_get_bbox(mesh, bbox, true) ==
+         get_bbox_brute_force(mesh, expected));
+    TEST(memcmp(bbox, expected, sizeof(bbox)) == 0);
+
+    // Overwrite a single voxel of the block.
+    key = mesh_get_key(mesh);
+    mesh_write(mesh, (int[]){n - 1, 0, 0}, (int[]){1, 1, 1},
+               (uint8_t[]){255, 0, 0, 255});
+    TEST(mesh_get_key(mesh) != key);
+    TEST(mesh_get_bbox(mesh, bbox, true) ==
+         get_bbox_brute_force(mesh, expected));
+    TEST(memcmp(bbox, expected, sizeof(bbox)) == 0);
+
+    free(data);
+    mesh_delete(mesh);
+}
+
+// A block cached as owned in an accessor must not be written in place
+// after the mesh has been copied.
+static void test_accessor_copy(void)
+{
+    mesh_t *a = mesh_new(), *b;
+    mesh_iterator_t iter = {0};
+    uint8_t v[4];
+    int i;
+
+    for (i = 0; i < 200; i++)
+        mesh_set_at(a, NULL, (int[]){i * BLOCK_SIZE, 0, 0},
+                    (uint8_t[]){255, 0, 0, 255});
+    mesh_set_at(a, &iter, (int[]){0, 0, 0}, (uint8_t[]){255, 0, 0, 255});
+    b = mesh_copy(a);
+    // Only detach the nodes of b that don't contain the cached block.
+    mesh_set_at(b, NULL, (int[]){150 * BLOCK_SIZE, 0, 0},
+                (uint8_t[]){0, 255, 0, 255});
+    mesh_set_at(a, &iter, (int[]){1, 0, 0}, (uint8_t[]){0, 0, 255, 255});
+    mesh_get_at(a, NULL, (int[]){1, 0, 0}, v);
+    TEST(v[2] == 255 && v[3] == 255);
+    mesh_get_at(b, NULL, (int[]){1, 0, 0}, v);
+    TEST(v[3] == 0);
+    mesh_delete(a);
+    mesh_delete(b);
+}
+
+static void test_dedup(void)
+{
+    mesh_t *a = mesh_new(), *b = mesh_new();
+    mesh_stats_t stats;
+    const int n = BLOCK_SIZE;
+    int i, nb_datas, pos[3];
+    uint32_t crc;
+
+    // Same content, built separately, with a pattern repeated every block.
+    for (i = 0; i < 64 * 64; i++) {
+        pos[0] = i % 64;
+        pos[1] = i / 64;
+        pos[2] = (i % n) * 3 % n;
+        mesh_set_at(a, NULL, pos, (uint8_t[]){255, 0, 0, 255});
+        mesh_set_at(b, NULL, pos, (uint8_t[]){255, 0, 0, 255});
+    }
+    crc = mesh_crc32(a);
+    mesh_get_stats(NULL, &stats);
+    nb_datas = stats.nb_datas;
+    mesh_dedup(a);
+    mesh_dedup(b);
+    mesh_get_stats(NULL, &stats);
+    TEST(stats.nb_datas <= nb_datas - (2 * (64 / n) * (64 / n) - 1));
+    TEST(mesh_crc32(a) == crc && mesh_crc32(b) == crc);
+    // Modifying a shared block doesn't change the other blocks.
+    mesh_set_at(a, NULL, (int[]){0, 0, 0}, (uint8_t[]){0, 0, 0, 0});
+    TEST(mesh_crc32(a) != crc && mesh_crc32(b) == crc);
+    mesh_delete(a);
+    mesh_delete(b);
+}
+
+static void test_compress(void)
+{
+    const int n = 2 * BLOCK_SIZE;
+    mesh_t *a = mesh_new(), *b;
+    int i, pos[3];
+    size_t mem;
+    uint32_t crc;
+
+    // Layers of 4 voxels of the same color, so that the palette indices
+    // have long runs with all the block layouts.
+    for (i = 0; i < n * n * n; i++) {
+        pos[0] = i % n;
+        pos[1] = i / n % n;
+        pos[2] = i / n / n;
+        mesh_set_at(a, NULL, pos, (uint8_t[]){pos[2] / 4 % 4 * 64, 0, 0, 255});
+    }
+    crc = mesh_crc32(a);
+    // Only the blocks that differ from b get compressed.
+    b = mesh_copy(a);
+    mesh_set_at(b, NULL, (int[]){0, 0, 1}, (uint8_t[]){0, 0, 0, 0});
+    TEST(mesh_get_unshared_mem(b, a) < mesh_get_unshared_mem(b, NULL));
+    mem = mesh_get_unshared_mem(a, b);
+    mesh_compress(a, b);
+    TEST(mesh_get_unshared_mem(a, b) < mem);
+    TEST(mesh_crc32(a) == crc);
+    mesh_set_at(a, NULL, (int[]){1, 0, 1}, (uint8_t[]){0, 0, 0, 0});
+    TEST(mesh_crc32(a) != crc && mesh_crc32(b) != crc);
+    // The deduplication doesn't decompress the blocks.
+    crc = mesh_crc32(a);
+    mesh_compress(a, NULL);
+    mem = mesh_get_unshared_mem(a, NULL);
+    mesh_dedup(a);
+    TEST(mesh_get_unshared_mem(a, NULL) <= mem);
+    TEST(mesh_crc32(a) == crc);
+    mesh_delete(a);
+    mesh_delete(b);
+}
+
+static void test_bricks(void)
+{
+    const int n = BLOCK_SIZE * BLOCK_SIZE * BLOCK_SIZE;
+    mesh_t *a = mesh_new(), *b;
+    int i, pos[3];
+    size_t mem;
+    uint32_t crc;
+    uint8_t v[4];
+
+    // A single block with 4 colors.
+    for (i = 0; i < n; i++) {
+        pos[0] = i % BLOCK_SIZE;
+        pos[1] = i / BLOCK_SIZE % BLOCK_SIZE;
+        pos[2] = i / BLOCK_SIZE / BLOCK_SIZE;
+        mesh_set_at(a, NULL, pos, (uint8_t[]){i % 4 * 64, 0, 0, 255});
+    }
+    crc = mesh_crc32(a);
+    mem = mesh_get_unshared_mem(a, NULL);
+    // Modifying a voxel of a copy only duplicates one brick of the indices
+    // (blocks of 8 only have a single brick).
+    b = mesh_copy(a);
+    mesh_set_at(b, NULL, (int[]){1, 1, 1}, (uint8_t[]){128, 0, 0, 255});
+    if (BLOCK_SIZE > 8)
+        TEST(mesh_get_unshared_mem(b, a) < mem * 3 / 4);
+    TEST(mesh_crc32(a) == crc);
+    mesh_get_at(b, NULL, (int[]){1, 1, 1}, v);
+    TEST(v[0] == 128);
+    mesh_delete(a);
+    mesh_delete(b);
+}
+
+static void test_diff_callback(const int pos[3], int change, void *user)
+{
+    int (*changes)[4] = user;
+    changes[pos[0] / 32][change]++;
+}
+
+static void test_diff(void)
+{
+    mesh_t *a = mesh_new(), *b;
+    int changes[3][4] = {};
+    const uint8_t v[4] = {255, 0, 0, 255};
+
+    mesh_set_at(a, NULL, (int[]){0, 0, 0}, v);
+    mesh_set_at(a, NULL, (int[]){32, 0, 0}, v);
+    b = mesh_copy(a);
+    TEST(mesh_diff(a, b, NULL, NULL) == 0);
+    mesh_set_at(b, NULL, (int[]){1, 0, 0}, v);
+    mesh_set_at(b, NULL, (int[]){64, 0, 0}, v);
+    mesh_set_at(b, NULL, (int[]){32, 0, 0}, (uint8_t[]){0, 0, 0, 0});
+    mesh_remove_empty_blocks(b, false);
+    TEST(mesh_diff(a, b, test_diff_callback, changes) == 3);
+    TEST(changes[0][MESH_DIFF_MODIFIED] == 1);
+    TEST(changes[1][MESH_DIFF_REMOVED] == 1);
+    TEST(changes[2][MESH_DIFF_ADDED] == 1);
+    mesh_delete(a);
+    mesh_delete(b);
+}
+
+static void test_neighbors_iter(void)
+{
+    mesh_t *mesh = mesh_new(), *copy;
+    mesh_iterator_t iter;
+    mesh_stats_t stats;
+    int n = 0, pos[3];
+
+    mesh_set_at(mesh, NULL, (int[]){0, 0, 0}, (uint8_t[]){255, 0, 0, 255});
+    mesh_set_at(mesh, NULL, (int[]){BLOCK_SIZE, 0, 0},
+                (uint8_t[]){255, 0, 0, 255});
+    copy = mesh_copy(mesh);
+    // The iteration doesn't add the neighbors blocks to the mesh.
+    iter = mesh_get_iterator(copy,
+            MESH_ITER_BLOCKS | MESH_ITER_INCLUDES_NEIGHBORS);
+    while (mesh_iter(&iter, pos)) {
+        mesh_get_stats(copy, &stats);
+        TEST(stats.nb_blocks == 2);
+        n++;
+    }
+    TEST(n == 12);
+    TEST(mesh_get_unshared_mem(copy, mesh) == 0);
+    mesh_delete(mesh);
+    mesh_delete(copy);
+}
+
+static void test_op_blocks(void)
+{
+    mesh_t *mesh = mesh_new();
+    float box[4][4];
+    uint8_t v[4];
+    painter_t painter = {
+        .mode = MODE_OVER,
+        .color = {255, 0, 0, 255},
+        .shape = &shape_sphere,
+    };
+
+    bbox_from_extents(box, VEC(0, 0, 0), 4 * BLOCK_SIZE, 4 * BLOCK_SIZE,
+                      4 * BLOCK_SIZE);
+    mesh_op(mesh, &painter, box);
+    // The blocks fully inside the sphere are stored as uniform blocks.
+    TEST(mesh_block_is_uniform(mesh, NULL, (int[]){0, 0, 0}, v) &&
+         v[0] == 255 && v[3] == 255);
+    mesh_get_at(mesh, NULL, (int[]){4 * BLOCK_SIZE - 1, 0, 0}, v);
+    TEST(v[3] == 255);
+    mesh_get_at(mesh, NULL, (int[]){4 * BLOCK_SIZE, 0, 0}, v);
+    TEST(v[3] == 0);
+    painter.mode = MODE_SUB;
+    mesh_op(mesh, &painter, box);
+    TEST(mesh_crc32(mesh) == 0);
+    mesh_delete(mesh);
+}
+
+/*
+ * Compare mesh_op with a per-voxel evaluation of the shape, so that a bound
+ * of shape_classify_block that is too tight makes the test fail.  The mesh
+ * is either empty and painted with MODE_OVER, or full and painted with
+ * MODE_SUB, so that the expected alpha is easy to compute.
+ */
+static void test_op_check(const painter_t *painter, const float box[4][4])
+{
+    const int n = 3 * BLOCK_SIZE;
+    const bool sub = painter->mode == MODE_SUB;
+    mesh_t *mesh = mesh_new(), *visited = mesh_new();
+    mesh_iterator_t iter = {0}, visited_iter = {0};
+    float mat[4][4], size[3], p[3], k, v;
+    float row[3][BLOCK_SIZE], row_k[BLOCK_SIZE];
+    int x, y, z, i, pos[3];
+    uint8_t c[4], out[4];
+
+    for (z = -n; sub && z < n; z += BLOCK_SIZE)
+    for (y = -n; y < n; y += BLOCK_SIZE)
+    for (x = -n; x < n; x += BLOCK_SIZE)
+        mesh_fill_block(mesh, (int[]){x, y, z}, (uint8_t[]){0, 255, 0, 255});
+    // mesh_op only changes the blocks intersecting the box, even if the
+    // smoothness extends the shape further.
+    iter = mesh_get_box_iterator(visited, box, MESH_ITER_BLOCKS);
+    while (mesh_iter(&iter, pos))
+        mesh_fill_block(visited, pos, (uint8_t[]){255, 255, 255, 255});
+    iter = (mesh_iterator_t){0};
+    mesh_op(mesh, painter, box);
+
+    // Same computation as mesh_op, one row at a time.
+    box_get_size(box, size);
+    mat4_copy(box, mat);
+    mat4_iscale(mat, 1 / size[0], 1 / size[1], 1 / size[2]);
+    mat4_invert(mat, mat);
+    for (z = -n; z < n; z++)
+    for (y = -n; y < n; y++)
+    for (x = -n; x < n; x += BLOCK_SIZE) {
+        for (i = 0; i < BLOCK_SIZE; i++) {
+            vec3_set(p, x + i + 0.5, y + 0.5, z + 0.5);
+            mat4_mul_vec3(mat, p, p);
+            row[0][i] = p[0];
+            row[1][i] = p[1];
+            row[2][i] = p[2];
+        }
+        painter->shape->func_batch(BLOCK_SIZE, row[0], row[1], row[2], size,
+                                   painter->smoothness, row_k);
+        for (i = 0; i < BLOCK_SIZE; i++) {
+            vec3_set(p, x + i + 0.5, y + 0.5, z + 0.5);
+            k = clamp(row_k[i] / painter->smoothness, -1.0f, 1.0f);
+            v = k / 2.0f + 0.5f;
+            c[3] = 255;
+            c[3] *= v;
+            pos[0] = x + i;
+            pos[1] = y;
+            pos[2] = z;
+            mesh_get_at(visited, &visited_iter, pos, out);
+            if (    !out[3] ||
+                    (painter->box && !bbox_contains_vec(*painter->box, p)))
+                c[3] = 0;
+            if (sub) c[3] = 255 - c[3];
+            mesh_get_at(mesh, &iter, pos, out);
+            TEST(out[3] == c[3]);
+        }
+    }
+    mesh_delete(mesh);
+    mesh_delete(visited);
+}
+
+static void test_op_brute_force(void)
+{
+    const shape_t *shapes[] = {&shape_sphere, &shape_cube, &shape_cylinder};
+    const float smoothness[] = {0, 1, 4};
+    float box[4][4], clip[4][4];
+    painter_t painter = {.color = {255, 0, 0, 255}};
+    int i, j, r;
+
+    bbox_from_extents(clip, VEC(BLOCK_SIZE / 2, 0, 0), 1.5 * BLOCK_SIZE,
+                      2.5 * BLOCK_SIZE, 2.5 * BLOCK_SIZE);
+    for (i = 0; i < ARRAY_SIZE(shapes); i++)
+    for (j = 0; j < ARRAY_SIZE(smoothness); j++)
+    for (r = 0; r < 3; r++) {
+        bbox_from_extents(box, VEC(1.3, -0.7, 2.1), 1.6 * BLOCK_SIZE,
+                          1.1 * BLOCK_SIZE, 1.3 * BLOCK_SIZE);
+        if (r) mat4_irotate(box, 0.5, 1, 2, 3);
+        painter.shape = shapes[i];
+        painter.smoothness = smoothness[j];
+        // The last pass also uses a clipping box.
+        painter.box = r == 2 ? &clip : NULL;
+        painter.mode = MODE_OVER;
+        test_op_check(&painter, box);
+        painter.mode = MODE_SUB;
+        test_op_check(&painter, box);
+    }
+}
+
+static void test_merge_all(void)
+{
+    mesh_t *meshes[3], *a = mesh_new(), *b = mesh_new();
+    int i, j, pos[3];
+    uint8_t v[4];
+
+    for (i = 0; i < 3; i++) {
+        meshes[i] = mesh_new();
+        for (j = 0; j < 2000; j++) {
+            pos[0] = (j * 7 + i * 13) % 50 - 25;
+            pos[1] = (j * 11) % 40 - 20;
+            pos[2] = (j * 3 + i * 29) % 60 - 30;
+            v[0] = i * 100;
+            v[1] = j % 3 * 100;
+            v[2] = 0;
+            v[3] = (j % 5) ? 255 : 0;
+            mesh_set_at(meshes[i], NULL, pos, v);
+        }
+    }
+    // Unsorted meshes, then sorted ones.
+    for (i = 0; i < 2; i++) {
+        for (j = 0; i && j < 3; j++) {
+            mesh_sort_blocks(meshes[j]);
+            mesh_set_at(meshes[j], NULL, (int[]){0, 0, 0},
+                        (uint8_t[]){j * 50, 0, 0, 255});
+        }
+        mesh_clear(a);
+        mesh_clear(b);
+        for (j = 0; j < 3; j++) mesh_merge(a, meshes[j], MODE_OVER, NULL);
+        mesh_merge_all(b, (const mesh_t**)meshes, 3, MODE_OVER);
+        // The crc depends on the order of the blocks.
+        mesh_sort_blocks(a);
+        mesh_sort_blocks(b);
+        TEST(mesh_crc32(b) == mesh_crc32(a));
+    }
+    for (i = 0; i < 3; i++) mesh_delete(meshes[i]);
+    mesh_delete(a);
+    mesh_delete(b);
+}
+
+// Check the values of the voxels after a merge of two non uniform blocks.
+static void test_merge_block(void)
+{
+    const int n = BLOCK_SIZE * BLOCK_SIZE * BLOCK_SIZE;
+    mesh_t *a = mesh_new(), *b = mesh_new(), *c;
+    uint8_t (*va)[4], (*vb)[4], (*out)[4];
+    const uint8_t color[4] = {255, 255, 255, 128};
+    int i, ok = 1;
+
+    va = calloc(3 * n, sizeof(*va));
+    vb = va + n;
+    out = vb + n;
+    for (i = 0; i < n; i++) {
+        memcpy(va[i], (uint8_t[]){i % 256, 100, 0, i % 2 ? 255 : 128}, 4);
+        memcpy(vb[i], (uint8_t[]){0, 200, 50, i * 7 % 256}, 4);
+    }
+    mesh_write_block(a, (int[]){0, 0, 0}, va);
+    mesh_write_block(b, (int[]){0, 0, 0}, vb);
+
+    c = mesh_copy(a);
+    mesh_merge(c, b, MODE_SUB, NULL);
+    mesh_read(c, (int[]){0, 0, 0}, (int[]){BLOCK_SIZE, BLOCK_SIZE, BLOCK_SIZE},
+              out[0]);
+    for (i = 0; i < n; i++) {
+        ok &= memcmp(out[i], va[i], 3) == 0;
+        ok &= out[i][3] == max(0, va[i][3] - vb[i][3]);
+    }
+    mesh_delete(c);
+
+    c = mesh_copy(a);
+    mesh_merge(c, b, MODE_MULT_ALPHA, color);
+    mesh_read(c, (int[]){0, 0, 0}, (int[]){BLOCK_SIZE, BLOCK_SIZE, BLOCK_SIZE},
+              out[0]);
+    for (i = 0; i < n; i++)
+        ok &= out[i][0] == va[i][0] * (vb[i][3] * 128 / 255) / 255;
+    mesh_delete(c);
+
+    TEST(ok);
+    free(va);
+    mesh_delete(a);
+    mesh_delete(b);
+}
+
+// Merging uniform blocks doesn't touch the blocks that don't change, and
+// doesn't leave any empty block.
+static void test_merge_uniform(void)
+{
+    const uint8_t v[4] = {255, 0, 0, 255};
+    mesh_t *a = mesh_new(), *b = mesh_new();
+    mesh_stats_t stats;
+    uint64_t id, key;
+
+    mesh_fill_block(a, (int[]){0, 0, 0}, v);
+    mesh_fill_block(b, (int[]){0, 0, 0}, v);
+    mesh_fill_block(b, (int[]){BLOCK_SIZE, 0, 0}, v);
+    id = mesh_get_block_id(a, NULL, (int[]){0, 0, 0});
+    key = mesh_get_key(a);
+    mesh_merge(a, b, MODE_INTERSECT, NULL);
+    TEST(mesh_get_block_id(a, NULL, (int[]){0, 0, 0}) == id);
+    TEST(mesh_get_key(a) == key);
+    mesh_get_stats(a, &stats);
+    TEST(stats.nb_blocks == 1);
+    mesh_merge(a, b, MODE_MAX, NULL);
+    TEST(mesh_get_block_id(a, NULL, (int[]){0, 0, 0}) == id);
+    mesh_get_stats(a, &stats);
+    TEST(stats.nb_blocks == 2);
+    mesh_merge(a, b, MODE_SUB, NULL);
+    mesh_get_stats(a, &stats);
+    TEST(stats.nb_blocks == 0);
+    mesh_delete(a);
+    mesh_delete(b);
+}
+
+// Always return the same mesh for a given seed.
+static mesh_t *test_parallel_mesh(int seed)
+{
+    mesh_t *mesh = mesh_new();
+    int i, pos[3];
+    for (i = 0; i < 5000; i++) {
+        pos[0] = (i * 7 + seed * 13) % 90 - 45;
+        pos[1] = (i * 11) % 80 - 40;
+        pos[2] = (i * 3 + seed * 29) % 70 - 35;
+        mesh_set_at(mesh, NULL, pos,
+                    (uint8_t[]){seed * 100, i % 3 * 100, 0, 255});
+    }
+    return mesh;
+}
+
+// Check that mesh_op and mesh_merge give the same results on the workers.
+static void test_parallel(void)
+{
+    const int modes[] = {MODE_OVER, MODE_SUB, MODE_PAINT, MODE_INTERSECT};
+    mesh_t *a, *b;
+    float box[4][4];
+    uint32_t crcs[2][2][ARRAY_SIZE(modes)];
+    int i, m;
+    painter_t painter = {
+        .color = {255, 0, 0, 255},
+        .shape = &shape_sphere,
+        .smoothness = 1,
+    };
+
+    bbox_from_extents(box, VEC(5, 3, 1), 3 * BLOCK_SIZE, 2 * BLOCK_SIZE,
+                      3 * BLOCK_SIZE);
+    for (i = 0; i < 2; i++) {
+        workers_set_count(i ? 4 : 1);
+        for (m = 0; m < ARRAY_SIZE(modes); m++) {
+            a = test_parallel_mesh(0);
+            painter.mode = modes[m];
+            mesh_op(a, &painter, box);
+            crcs[i][0][m] = mesh_crc32(a);
+            mesh_delete(a);
+
+            a = test_parallel_mesh(0);
+            b = test_parallel_mesh(1);
+            mesh_merge(a, b, modes[m], NULL);
+            crcs[i][1][m] = mesh_crc32(a);
+            mesh_delete(a);
+            mesh_delete(b);
+        }
+    }
+    workers_set_count(0);
+    TEST(memcmp(crcs[0], crcs[1], sizeof(crcs[0])) == 0);
+}
+
+// Check that an op with X and Z symmetry gives the same result as doing
+// the op once per mirrored box.
+static void test_op_symmetry(void)
+{
+    // The boxes in the order of the passes.
+    const float mirrors[4][3] = {{-1, 1, -1}, {-1, 1, 1}, {1, 1, -1},
+                                 {1, 1, 1}};
+    const int modes[] = {MODE_OVER, MODE_SUB, MODE_MULT_ALPHA};
+    mesh_t *a, *b;
+    float box[4][4], box2[4][4];
+    int i, m;
+    painter_t painter = {
+        .color = {255, 0, 0, 128},
+        .shape = &shape_sphere,
+        .smoothness = 1,
+    };
+
+    bbox_from_extents(box, VEC(5, 3, 1), 2 * BLOCK_SIZE, BLOCK_SIZE,
+                      BLOCK_SIZE);
+    for (m = 0; m < ARRAY_SIZE(modes); m++) {
+        painter.mode = modes[m];
+        a = test_parallel_mesh(0);
+        b = test_parallel_mesh(0);
+        painter.symmetry = 1 << 0 | 1 << 2;
+        mesh_op(a, &painter, box);
+        painter.symmetry = 0;
+        for (i = 0; i < 4; i++) {
+            mat4_set_identity(box2);
+            mat4_iscale(box2, mirrors[i][0], mirrors[i][1], mirrors[i][2]);
+            mat4_imul(box2, box);
+            mesh_op(b, &painter, box2);
+        }
+        // The crc depends on the order of the blocks.
+        mesh_sort_blocks(a);
+        mesh_sort_blocks(b);
+        TEST(mesh_crc32(a) == mesh_crc32(b));
+        mesh_delete(a);
+        mesh_delete(b);
+    }
+}
+
+// The data created before the paging gets enabled can be evicted once
+// registered with mesh_paging_add.
+static void test_paging_add(void)
+{
+    mesh_t *mesh = mesh_new();
+    mesh_stats_t stats;
+    uint32_t crc;
+    int i, pos[3];
+
+    for (i = 0; i < 64 * 64; i++) {
+        pos[0] = i % 64;
+        pos[1] = i / 64;
+        pos[2] = (i * 7) % 64;
+        mesh_set_at(mesh, NULL, pos, (uint8_t[]){i % 5, 255, 0, 255});
+    }
+    crc = mesh_crc32(mesh);
+    if (!mesh_set_paging(NULL, 1)) {
+        mesh_delete(mesh);
+        return;
+    }
+    mesh_paging_add(mesh);
+    mesh_paging_trim();
+    mesh_get_stats(NULL, &stats);
+    TEST(stats.nb_paged > 0);
+    TEST(mesh_crc32(mesh) == crc);
+    mesh_set_paging(NULL, 0);
+    mesh_delete(mesh);
+}
+
+#if defined(__unix__) && !defined(__EMSCRIPTEN__)
+#include <pthread.h>
+
+typedef struct {
+    const mesh_t    *shared;
+    uint32_t        seed;
+} test_threads_arg_t;
+
+static void *test_threads_worker(void *arg_)
+{
+    test_threads_arg_t *arg = arg_;
+    mesh_t *mesh, *copy;
+    int i, j, pos[3];
+    uint8_t v[4] = {0, 0, 0, 255}, out[4];
+
+    for (i = 0; i < 200; i++) {
+        mesh = mesh_copy(arg->shared);
+        v[0] = i;
+        for (j = 0; j < 64; j++) {
+            arg->seed = arg->seed * 1664525u + 1013904223u;
+            pos[0] = (arg->seed >> 8) % 64;
+            pos[1] = (arg->seed >> 16) % 64;
+            pos[2] = j;
+            mesh_set_at(mesh, NULL, pos, v);
+            mesh_get_at(mesh, NULL, pos, out);
+            TEST(memcmp(v, out, 4) == 0);
+        }
+        mesh_dedup(mesh);
+        copy = mesh_copy(mesh);
+        mesh_delete(mesh);
+        // Force some concurrent decoding of the shared blocks.
+        mesh_get_block_data(arg->shared, NULL,
+                            (int[]){0, 0, (i % 64) & ~(BLOCK_SIZE - 1)},
+                            NULL);
+        mesh_set_at(copy, NULL, (int[]){0, 0, 0}, v);
+        mesh_delete(copy);
+    }
+    return NULL;
+}
+
+/*
+ * Stress test the copy on write from several threads, all making copies of
+ * the same mesh.  Better run with a TSan build (scons tsan=1).
+ */
+static void test_threads(void)
+{
+    const int nb = 4;
+    mesh_t *mesh = mesh_new();
+    pthread_t threads[nb];
+    test_threads_arg_t args[nb];
+    uint32_t crc;
+    int i, pos[3];
+
+    for (i = 0; i < 64 * 64; i++) {
+        pos[0] = i % 64;
+        pos[1] = i / 64;
+        pos[2] = (i * 7) % 64;
+        mesh_set_at(mesh, NULL, pos, (uint8_t[]){i % 5, 255, 0, 255});
+    }
+    crc = mesh_crc32(mesh);
+    for (i = 0; i < nb; i++) {
+        args[i] = (test_threads_arg_t){mesh, i};
+        pthread_create(&threads[i], NULL, test_threads_worker, &args[i]);
+    }
+    for (i = 0; i < nb; i++)
+        pthread_join(threads[i], NULL);
+    TEST(mesh_crc32(mesh) == crc);
+    mesh_delete(mesh);
+}
+#else
+static void test_threads(void) {}
+#endif
+
 void tests_run(void)
 {
     test_load_file_v2();
     test_load_file_v1_with_preview();
     test_load_corrupt();
+    test_bbox();
+    test_write_key();
+    test_accessor_copy();
+    test_dedup();
+    test_compress();
+    test_bricks();
+    test_diff();
+    test_neighbors_iter();
+    test_op_blocks();
+    test_op_brute_force();
+    test_merge_all();
+    test_merge_block();
+    test_merge_uniform();
+    test_parallel();
+    test_op_symmetry();
+    test_threads();
+    test_paging_add();
 }
@@ -0,0 +1,257 @@
+/* Goxel 3D voxels editor
+ *
+ * copyright (c) 2015 Guillaume Chereau <guillaume@noctua-software.com>
+ *
+ * Goxel is free software: you can redistribute it and/or modify it under the
+ * terms of the GNU General Public License as published by the Free Software
+ * Foundation, either version 3 of the License, or (at your option) any later
+ * version.
+
+ * Goxel is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details.
+
+ * You should have received a copy of the GNU General Public License along with
+ * goxel.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "goxel.h"
+
+/*
+ * Pool of worker threads used to run independent tasks in parallel.
+ *
+ * The tasks of a run are first split in equal ranges of indices, one per
+ * worker.  Each worker takes the tasks from the start of its own range, and
+ * once it is empty steals the second half of the range of another worker.
+ * A range is stored as two 32 bits indices in a single 64 bits integer, so
+ * that both the owner and the thieves can update it with a compare and swap.
+ *
+ * The calling thread is the worker 0, so that a pool of one worker doesn't
+ * need any thread at all.
+ */
+
+#if (defined(__unix__) || defined(__APPLE__)) && !defined(__EMSCRIPTEN__)
+#define HAVE_THREADS 1
+#include <pthread.h>
+#include <sched.h>
+#include <unistd.h>
+#else
+#define HAVE_THREADS 0
+#endif
+
+#define MAX_WORKERS 64
+
+#define RANGE(begin, end) (((uint64_t)(begin) << 32) | (uint32_t)(end))
+#define RANGE_BEGIN(r) ((int)((r) >> 32))
+#define RANGE_END(r) ((int)((r) & 0xffffffff))
+
+typedef struct {
+    uint64_t range;
+    char     pad[56]; // Keep each range in its own cache line.
+} worker_range_t;
+
+static struct {
+    int             nb;         // Number of workers, 0 for the default.
+#if HAVE_THREADS
+    int             nb_threads; // Number of threads started.
+    pthread_t       threads[MAX_WORKERS];
+    pthread_mutex_t lock;
+    pthread_cond_t  start_cond;
+    pthread_cond_t  done_cond;
+    bool            running;    // Set during a run, to detect nested runs.
+    uint64_t        run_id;     // Incremented at each run.
+    uint64_t        start_id;   // Value of run_id when the threads started.
+    int             nb_active;  // Number of threads still in the run.
+    bool            quit;
+#endif
+
+    // The current run.
+    int             nb_workers;
+    int             nb_left;    // Number of tasks not done yet.
+    void            (*func)(int i, int worker, void *user);
+    void            *user;
+    worker_range_t  ranges[MAX_WORKERS];
+} g_workers
+#if HAVE_THREADS
+= {
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+    .start_cond = PTHREAD_COND_INITIALIZER,
+    .done_cond = PTHREAD_COND_INITIALIZER,
+}
+#endif
+;
+
+// Take the first task of a worker own range.
+static bool range_pop(int worker, int *i)
+{
+    uint64_t *range = &g_workers.ranges[worker].range;
+    uint64_t r = __atomic_load_n(range, __ATOMIC_ACQUIRE);
+    while (RANGE_BEGIN(r) < RANGE_END(r)) {
+        if (__atomic_compare_exchange_n(range, &r,
+                RANGE(RANGE_BEGIN(r) + 1, RANGE_END(r)), false,
+                __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+            *i = RANGE_BEGIN(r);
+            return true;
+        }
+    }
+    return false;
+}
+
+// Steal the second half of the range of another worker, and make it our
+// own range.
+static bool range_steal(int worker)
+{
+    int k, victim, begin, end, mid;
+    uint64_t *range, r;
+
+    for (k = 1; k < g_workers.nb_workers; k++) {
+        victim = (worker + k) % g_workers.nb_workers;
+        range = &g_workers.ranges[victim].range;
+        r = __atomic_load_n(range, __ATOMIC_ACQUIRE);
+        while (RANGE_BEGIN(r) < RANGE_END(r)) {
+            begin = RANGE_BEGIN(r);
+            end = RANGE_END(r);
+            mid = begin + (end - begin) / 2;
+            if (__atomic_compare_exchange_n(range, &r, RANGE(begin, mid),
+                    false, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+                __atomic_store_n(&g_workers.ranges[worker].range,
+                                 RANGE(mid, end), __ATOMIC_RELEASE);
+                return true;
+            }
+        }
+    }
+    return false;
+}
+
+// Run tasks until all the tasks of the run are done.  Once we cannot find
+// any task left, the last ones are still being run by other workers.
+static void worker_run_tasks(int worker)
+{
+    int i;
+    while (__atomic_load_n(&g_workers.nb_left, __ATOMIC_ACQUIRE) > 0) {
+        if (range_pop(worker, &i)) {
+            g_workers.func(i, worker, g_workers.user);
+            __atomic_sub_fetch(&g_workers.nb_left, 1, __ATOMIC_ACQ_REL);
+            continue;
+        }
+        if (range_steal(worker)) continue;
+#if HAVE_THREADS
+        sched_yield();
+#endif
+    }
+}
+
+#if HAVE_THREADS
+
+static void *worker_thread(void *arg)
+{
+    int worker = (int)(intptr_t)arg;
+    uint64_t run_id;
+
+    pthread_mutex_lock(&g_workers.lock);
+    run_id = g_workers.start_id;
+    while (true) {
+        while (!g_workers.quit && g_workers.run_id == run_id)
+            pthread_cond_wait(&g_workers.start_cond, &g_workers.lock);
+        if (g_workers.quit) break;
+        run_id = g_workers.run_id;
+        if (worker >= g_workers.nb_workers) continue;
+        pthread_mutex_unlock(&g_workers.lock);
+        worker_run_tasks(worker);
+        pthread_mutex_lock(&g_workers.lock);
+        if (--g_workers.nb_active == 0)
+            pthread_cond_signal(&g_workers.done_cond);
+    }
+    pthread_mutex_unlock(&g_workers.lock);
+    return NULL;
+}
+
+static void stop_threads(void)
+{
+    int i;
+    pthread_mutex_lock(&g_workers.lock);
+    g_workers.quit = true;
+    pthread_cond_broadcast(&g_workers.start_cond);
+    pthread_mutex_unlock(&g_workers.lock);
+    for (i = 1; i < g_workers.nb_threads; i++)
+        pthread_join(g_workers.threads[i], NULL);
+    g_workers.nb_threads = 0;
+    g_workers.quit = false;
+}
+
+#endif
+
+int workers_get_count(void)
+{
+    int nb = g_workers.nb;
+#if HAVE_THREADS && defined(_SC_NPROCESSORS_ONLN)
+    if (!nb) nb = sysconf(_SC_NPROCESSORS_ONLN);
+#endif
+    return clamp(nb, 1, MAX_WORKERS);
+}
+
+void workers_set_count(int nb)
+{
+#if HAVE_THREADS
+    pthread_mutex_lock(&g_workers.lock);
+    assert(!g_workers.running);
+    pthread_mutex_unlock(&g_workers.lock);
+    if (g_workers.nb_threads) stop_threads();
+#endif
+    g_workers.nb = nb;
+}
+
+void workers_run(int n, void (*func)(int i, int worker, void *user),
+                 void *user)
+{
+    int i, nb;
+
+    nb = min(workers_get_count(), n);
+#if HAVE_THREADS
+    // Nested runs, or runs from another thread while the pool is busy,
+    // are done on the calling thread only.
+    pthread_mutex_lock(&g_workers.lock);
+    if (g_workers.running) nb = 1;
+    if (nb > 1) g_workers.running = true;
+    pthread_mutex_unlock(&g_workers.lock);
+#else
+    nb = 1;
+#endif
+    if (nb <= 1) {
+        for (i = 0; i < n; i++) func(i, 0, user);
+        return;
+    }
+
+#if HAVE_THREADS
+    if (!g_workers.nb_threads) {
+        g_workers.nb_threads = workers_get_count();
+        g_workers.start_id = g_workers.run_id;
+        for (i = 1; i < g_workers.nb_threads; i++) {
+            pthread_create(&g_workers.threads[i], NULL, worker_thread,
+                           (void*)(intptr_t)i);
+        }
+    }
+
+    g_workers.nb_workers = nb;
+    g_workers.nb_left = n;
+    g_workers.func = func;
+    g_workers.user = user;
+    for (i = 0; i < nb; i++)
+        g_workers.ranges[i].range = RANGE(n * i / nb, n * (i + 1) / nb);
+
+    pthread_mutex_lock(&g_workers.lock);
+    g_workers.nb_active = nb - 1;
+    g_workers.run_id++;
+    pthread_cond_broadcast(&g_workers.start_cond);
+    pthread_mutex_unlock(&g_workers.lock);
+
+    worker_run_tasks(0);
+
+    pthread_mutex_lock(&g_workers.lock);
+    while (g_workers.nb_active)
+        pthread_cond_wait(&g_workers.done_cond, &g_workers.lock);
+    g_workers.running = false;
+    pthread_mutex_unlock(&g_workers.lock);
+#endif
+}